@@ -0,0 +1,461 @@
+#include "../binary.h"
+#include "../css_grammar.h"
+#include "../json.h"
+#include "../lexer.h"
+#include "../parallel.h"
+#include "../parser.h"
+#include "../peg.h"
+#include "../peg_optimizer.h"
+#include "css_recognizer.h"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Rough throughput numbers for the hot parsers. Not a substitute for a real
+// profiler, but enough to compare alternatives on the same machine.
+
+namespace {
+
+template <typename F>
+void run_bench(std::string_view name, size_t bytes, int iterations, F&& fn) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    fn();
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  double mb = static_cast<double>(bytes) * iterations / (1024 * 1024);
+  std::cout << fmt::format("{:<32} {:>10.2f} MB/s", name,
+                           mb / elapsed.count())
+            << std::endl;
+}
+
+// The digit at a time number grammar that parse_int replaces.
+Parser<int> digit_fold_number() {
+  auto positive_number = parse_digit(1, 9).and_then_cached([](int val) {
+    return parse_some(parse_digit()).transform([val](std::vector<int> digits) {
+      int result = val;
+      for (auto d : digits) {
+        result = (result * 10) + d;
+      }
+      return result;
+    });
+  });
+  auto zero = parse_digit(0, 0).and_not(parse_digit(0, 9));
+  return positive_number.or_else(zero).or_else(
+      parse_literal('-').and_then(positive_number).transform([](int val) {
+        return -val;
+      }));
+}
+
+std::string number_list(size_t count) {
+  std::string out = "[";
+  for (size_t i = 0; i < count; ++i) {
+    out += fmt::format("{}{}", i ? "," : "", (i * 7919) % 2000000000);
+  }
+  out += "]";
+  return out;
+}
+
+void bench_numbers() {
+  std::string input = number_list(100000);
+  auto list_of = [](Parser<int> number) {
+    return parse_literal('[').and_then(
+        parse_delimited_by(number, parse_literal(','), parse_literal(']')));
+  };
+  auto old_parser = list_of(digit_fold_number());
+  auto new_parser = list_of(parse_int<int>());
+  auto float_parser = parse_literal('[').and_then(parse_delimited_by(
+      parse_float<double>(), parse_literal(','), parse_literal(']')));
+
+  run_bench("numbers/digit fold", input.size(), 10,
+            [&] { old_parser(input); });
+  run_bench("numbers/parse_int", input.size(), 10,
+            [&] { new_parser(input); });
+  run_bench("numbers/parse_float", input.size(), 10,
+            [&] { float_parser(input); });
+}
+
+// The char at a time color grammar that parse_hex_color replaces.
+Parser<uint32_t> strtoul_color() {
+  auto decode = [](std::string_view str) {
+    char buf[3] = {str[0], str[1], '\0'};
+    return static_cast<uint32_t>(std::strtoul(buf, nullptr, 16));
+  };
+  auto hexit = detail::parse_char_class([](int ch) {
+    ch = toupper(ch);
+    return (ch >= '0' && ch <= '9') || (ch >= 'A' && ch <= 'F') ? 1 : 0;
+  });
+  return parse_literal('#').and_then(parse_n(hexit, 6)).transform(
+      [decode](std::string_view value) {
+        return (decode(value.substr(0, 2)) << 16) |
+               (decode(value.substr(2, 2)) << 8) | decode(value.substr(4, 2));
+      });
+}
+
+void bench_colors() {
+  std::string input;
+  for (uint32_t i = 0; i < 100000; ++i) {
+    input += fmt::format("#{:06x};", (i * 2654435761u) & 0xFFFFFF);
+  }
+  auto list_of = [](Parser<uint32_t> color) {
+    return parse_some(color.skip(parse_literal(';')));
+  };
+  auto old_parser = list_of(strtoul_color());
+  auto new_parser = list_of(parse_hex_color());
+
+  run_bench("colors/strtoul", input.size(), 10, [&] { old_parser(input); });
+  run_bench("colors/parse_hex_color", input.size(), 10,
+            [&] { new_parser(input); });
+}
+
+void bench_names() {
+  std::string input;
+  for (size_t i = 0; i < 100000; ++i) {
+    input += fmt::format("{}name{} ", "_.#a"[i % 4], i);
+  }
+  auto combinators =
+      parse_sequence({parse_any_of("_.#").or_else(parse_alpha()),
+                      parse_n(parse_alnum(), 1).or_else(parse_any_of("-"))});
+  auto name = peg::seq({peg::choice({peg::any_of("_.#"), peg::alpha()}),
+                        peg::choice({peg::plus(peg::alnum()), peg::lit('-')})});
+  auto dfa = peg::to_parser(
+      std::make_shared<const peg::Dfa>(*peg::Dfa::compile(name)));
+  auto list_of = [](StringParser name) {
+    return parse_count(name.skip(parse_literal(' ')));
+  };
+  auto old_parser = list_of(combinators);
+  auto new_parser = list_of(dfa);
+
+  run_bench("names/combinators", input.size(), 10,
+            [&] { old_parser(input); });
+  run_bench("names/dfa", input.size(), 10, [&] { new_parser(input); });
+}
+
+void bench_lines() {
+  std::string input;
+  for (size_t i = 0; i < 20000; ++i) {
+    input += fmt::format("line {} with a typical amount of text on it\n", i);
+  }
+  auto list_of = [](StringParser line) {
+    return parse_count(line.skip(parse_literal('\n')));
+  };
+  auto old_parser = list_of(parse_some(parse_none_of("\n")));
+  auto new_parser = list_of(parse_until('\n'));
+
+  run_bench("lines/none_of", input.size(), 10, [&] { old_parser(input); });
+  run_bench("lines/parse_until", input.size(), 10,
+            [&] { new_parser(input); });
+}
+
+void bench_binary() {
+  // Records of a little endian u32, a big endian u16 and a varint.
+  std::vector<std::byte> input;
+  for (uint32_t i = 0; i < 200000; ++i) {
+    uint32_t id = i * 2654435761u;
+    for (int shift = 0; shift < 32; shift += 8) {
+      input.push_back(std::byte(id >> shift));
+    }
+    input.push_back(std::byte(i >> 8));
+    input.push_back(std::byte(i));
+    for (uint32_t value = i % 20000;; value >>= 7) {
+      input.push_back(std::byte((value & 0x7f) | (value > 0x7f ? 0x80 : 0)));
+      if (value <= 0x7f) {
+        break;
+      }
+    }
+  }
+
+  // Byte at a time, the way frames were decoded before.
+  auto any_byte = parse_element_if<ByteSpan>([](std::byte) { return true; });
+  auto per_byte_int = [any_byte](int count, bool big_endian) {
+    auto parser = pure<uint32_t, ByteSpan>(0);
+    for (int i = 0; i < count; ++i) {
+      int shift = 8 * (big_endian ? count - 1 - i : i);
+      parser = parser.and_then([any_byte, shift](uint32_t value) {
+        return any_byte.transform([value, shift](ByteSpan byte) {
+          return value | std::to_integer<uint32_t>(byte[0]) << shift;
+        });
+      });
+    }
+    return parser;
+  };
+  auto continuation = parse_element_if<ByteSpan>(
+      [](std::byte b) { return b >= std::byte{0x80}; });
+  auto old_record = per_byte_int(4, false)
+                        .skip(per_byte_int(2, true))
+                        .skip(parse_count(continuation))
+                        .skip(any_byte);
+  auto new_record = parse_le<uint32_t>()
+                        .skip(parse_be<uint16_t>())
+                        .skip(parse_uleb128<uint32_t>());
+  auto old_parser = parse_count(old_record);
+  auto new_parser = parse_count(new_record);
+
+  ByteSpan bytes(input);
+  run_bench("binary/per byte", input.size(), 10, [&] { old_parser(bytes); });
+  run_bench("binary/primitives", input.size(), 10,
+            [&] { new_parser(bytes); });
+}
+
+std::string style_sheet(size_t blocks) {
+  std::string out;
+  for (size_t i = 0; i < blocks; ++i) {
+    out += fmt::format(
+        ".block{} {{\n    height: {}px;\n    color: rgb(156, 39, 188);\n"
+        "    padding: 10px 2px;\n}}\n\n",
+        i, i % 500);
+  }
+  return out;
+}
+
+Parser<size_t> css_combinators() {
+  auto ws = parse_opt_ws();
+  auto name = parse_some(parse_alnum().or_else(parse_any_of("_.#-")));
+  auto rule = name.skip(ws)
+                  .skip(parse_literal(':'))
+                  .skip(ws)
+                  .and_then(parse_some(parse_none_of(";}")))
+                  .skip(parse_literal(';'))
+                  .skip(ws);
+  auto block = name.skip(ws)
+                   .skip(parse_literal('{'))
+                   .skip(ws)
+                   .and_then(parse_count(rule))
+                   .skip(parse_literal('}'))
+                   .skip(ws);
+  return ws.and_then(parse_count(block, 1)).skip(parse_end());
+}
+
+void bench_style_sheets() {
+  std::string input = style_sheet(20000);
+  auto combinators = css_combinators();
+
+  auto punct = [](std::string_view text) {
+    return parse_token(TokenKind::kPunct, text);
+  };
+  auto ident = parse_token(TokenKind::kIdent);
+  auto value_token = parse_token(TokenKind::kDimension)
+                         .or_else(parse_token(TokenKind::kNumber))
+                         .or_else(ident)
+                         .or_else(punct("("))
+                         .or_else(punct(")"))
+                         .or_else(punct(","));
+  auto token_rule = ident.skip(punct(":"))
+                        .and_then(parse_count(value_token, 1))
+                        .skip(punct(";"));
+  auto token_block = parse_opt(punct("."))
+                         .and_then(ident)
+                         .skip(punct("{"))
+                         .and_then(parse_count(token_rule))
+                         .skip(punct("}"));
+  auto tokens = parse_count(token_block, 1).skip(parse_end<TokenSpan>());
+
+  auto program = peg::Program::compile(peg::css_grammar());
+  auto optimized = peg::Program::compile(peg::optimize(peg::css_grammar()));
+
+  run_bench("css/combinators", input.size(), 5, [&] { combinators(input); });
+  run_bench("css/tokens", input.size(), 5, [&] {
+    std::vector<Token> lexed = tokenize_css(input);
+    tokens(lexed);
+  });
+  run_bench("css/peg vm", input.size(), 5, [&] { program.match(input); });
+  run_bench("css/peg vm optimized", input.size(), 5,
+            [&] { optimized.match(input); });
+  run_bench("css/generated", input.size(), 5,
+            [&] { css_recognizer::match(input); });
+}
+
+// The cost of building a grammar rather than running it.
+void bench_construction() {
+  constexpr int kBuilds = 20000;
+  size_t nodes = parser_nodes_constructed();
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kBuilds; ++i) {
+    css_combinators();
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  nodes = (parser_nodes_constructed() - nodes) / kBuilds;
+  std::cout << fmt::format("{:<32} {:>10.0f} /s ({} nodes)",
+                           "css/build combinators", kBuilds / elapsed.count(),
+                           nodes)
+            << std::endl;
+}
+
+// One grammar shared by a growing number of threads, each parsing its own
+// copy of the input. Throughput should grow close to linearly up to the
+// number of cores.
+void bench_threads() {
+  std::string input = style_sheet(20000);
+  auto grammar = css_combinators();
+  unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+  for (unsigned threads = 1;; threads = std::min(threads * 2, cores)) {
+    run_bench(fmt::format("css/shared x{}", threads), input.size() * threads,
+              5, [&] {
+                std::vector<std::jthread> workers;
+                for (unsigned i = 0; i < threads; ++i) {
+                  workers.emplace_back([&] { grammar(input); });
+                }
+              });
+    if (threads == cores) {
+      break;
+    }
+  }
+}
+
+// One style sheet split into blocks of about 64KB parsed on the shared
+// pool, against parsing it in one go.
+void bench_parallel() {
+  std::string input = style_sheet(20000);
+  auto grammar = css_combinators();
+  auto parallel = parse_parallel(grammar, split_after('}', 1 << 16));
+
+  run_bench("css/sequential", input.size(), 5, [&] { grammar(input); });
+  run_bench(fmt::format("css/parallel x{}", ForkJoinPool::shared().size() + 1),
+            input.size(), 5, [&] { parallel(input); });
+
+  // A long list of numbers and quoted strings with commas in them, so that
+  // some pieces are cut inside an item and parsed again.
+  std::string list;
+  for (size_t i = 0; i < 1000000; ++i) {
+    list += i % 4 ? fmt::format("{},", i * 7919 % 2000000000)
+                  : fmt::format("\"item {}, of many\",", i);
+  }
+  list += "0]";
+  auto quote = parse_literal('"');
+  auto item = parse_span(quote.and_then(parse_until('"')).skip(quote))
+                  .or_else(parse_span(parse_int<int>()));
+  auto items = parse_delimited_by(item, parse_literal(','), parse_literal(']'));
+  auto parallel_items =
+      parse_delimited_by_parallel(item, ',', parse_literal(']'));
+  run_bench("list/sequential", list.size(), 5, [&] { items(list); });
+  run_bench("list/parallel", list.size(), 5, [&] { parallel_items(list); });
+
+  std::string lines;
+  for (size_t i = 0; i < 1000000; ++i) {
+    lines += fmt::format("{}\n", i * 7919 % 2000000000);
+  }
+  auto each_line = parse_count(parse_int<int>().skip(parse_literal('\n')));
+  auto parallel_lines = parse_lines_parallel(parse_int<int>());
+  run_bench("lines/sequential", lines.size(), 5, [&] { each_line(lines); });
+  run_bench("lines/parallel", lines.size(), 5,
+            [&] { parallel_lines(lines); });
+}
+
+// Validating with recognize against parsing the same grammars into values.
+// The style sheet grammar keeps every rule's value as a string, so a parse
+// allocates for each rule and each block.
+void bench_recognize() {
+  std::string numbers = number_list(100000);
+  auto list = parse_literal('[').and_then(parse_delimited_by(
+      digit_fold_number(), parse_literal(','), parse_literal(']')));
+  run_bench("numbers/digit fold parse", numbers.size(), 10,
+            [&] { list(numbers); });
+  run_bench("numbers/digit fold recognize", numbers.size(), 10,
+            [&] { recognize(list, numbers); });
+
+  std::string input = style_sheet(20000);
+  auto ws = parse_opt_ws();
+  auto name = parse_some(parse_alnum().or_else(parse_any_of("_.#-")));
+  auto rule = name.skip(ws)
+                  .skip(parse_literal(':'))
+                  .skip(ws)
+                  .and_then(parse_some(parse_none_of(";}")))
+                  .transform([](std::string_view value) {
+                    return std::string(value);
+                  })
+                  .skip(parse_literal(';'))
+                  .skip(ws);
+  auto block = name.skip(ws)
+                   .skip(parse_literal('{'))
+                   .skip(ws)
+                   .and_then(parse_some(rule))
+                   .skip(parse_literal('}'))
+                   .skip(ws);
+  auto sheet = ws.and_then(parse_n(block, 1)).skip(parse_end());
+  run_bench("css/values parse", input.size(), 5, [&] { sheet(input); });
+  run_bench("css/values recognize", input.size(), 5,
+            [&] { recognize(sheet, input); });
+}
+
+// An array of records, with a few escapes among longer plain strings.
+std::string json_records(size_t count) {
+  std::string out = "[";
+  for (size_t i = 0; i < count; ++i) {
+    out += fmt::format(
+        R"({}{{"id": {}, "name": "record {} with a longer plain description",)"
+        R"( "score": {}.5, "tags": ["alpha", "beta \"{}\""], "ok": {}}})",
+        i ? ",\n " : "", i, i, i % 1000, i % 10, i % 2 ? "true" : "false");
+  }
+  out += "]";
+  return out;
+}
+
+// JSON with a plain combinator grammar, reading strings a char at a time,
+// against json::parse_text, which scans them a word at a time.
+void bench_json() {
+  std::string input = json_records(50000);
+  auto ws = parse_opt_ws();
+  auto token = [ws](char ch) { return parse_literal(ch).skip(ws); };
+  auto chars = parse_count(parse_none_of("\"\\").or_else(
+                               parse_literal('\\').and_then(
+                                   parse_any_of("\"\\/bfnrt"))))
+                   .span();
+  auto string = parse_literal('"')
+                    .and_then(chars)
+                    .skip(parse_literal('"'))
+                    .transform([](std::string_view text) {
+                      return std::string(text);
+                    })
+                    .skip(ws);
+  auto value = parse_recursive<json::Value>([=](const Parser<json::Value>&
+                                                    value) {
+    auto wrap = [](auto data) { return json::Value{.data = std::move(data)}; };
+    auto member = string.skip(token(':')).and_then([value](std::string name) {
+      return value.transform([name](json::Value value) {
+        return std::pair(name, std::move(value));
+      });
+    });
+    auto object = token('{').and_then(
+        token('}').as(json::Object()).or_else(parse_delimited_by(
+            member, token(','), parse_literal('}')).skip(token('}'))));
+    auto array = token('[').and_then(
+        token(']').as(json::Array()).or_else(
+            parse_delimited_by(value, token(','), parse_literal(']'))
+                .skip(token(']'))));
+    return object.transform(wrap)
+        .or_else(array.transform(wrap))
+        .or_else(string.transform(wrap))
+        .or_else(parse_float<double>().skip(ws).transform(wrap))
+        .or_else(parse_str("true").as(json::Value{.data = true}).skip(ws))
+        .or_else(parse_str("false").as(json::Value{.data = false}).skip(ws))
+        .or_else(parse_str("null").as(json::Value{.data = nullptr}).skip(ws));
+  });
+  auto combinators = ws.and_then(value).skip(parse_end());
+  auto text = json::parse_text();
+  run_bench("json/combinators", input.size(), 5, [&] { combinators(input); });
+  run_bench("json/parse_text", input.size(), 5, [&] { text(input); });
+  run_bench("json/recognize", input.size(), 5,
+            [&] { recognize(text, input); });
+  run_bench("json/tokens", input.size(), 5, [&] { tokenize_json(input); });
+}
+
+}  // namespace
+
+int main() {
+  bench_numbers();
+  bench_colors();
+  bench_names();
+  bench_lines();
+  bench_binary();
+  bench_style_sheets();
+  bench_construction();
+  bench_threads();
+  bench_parallel();
+  bench_recognize();
+  bench_json();
+}
@@ -0,0 +1,266 @@
+//
+// Copyright 2025 John R. Burkhardt
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the “Software”), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#ifndef __BINARY_H__
+#define __BINARY_H__
+
+// Primitives for framed binary messages over a ByteSpan. Values are read
+// straight from the input with memcpy, so a fixed width integer is one load
+// (plus a byte swap when the order differs from the host's), and slices
+// are returned as spans into the input rather than copies.
+
+#include "parser.h"
+#include <bit>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <utility>
+
+template <class T>
+using ByteParser = Parser<T, ByteSpan>;
+
+namespace detail {
+
+template <size_t Size>
+using uint_of_size_t = std::conditional_t<
+    Size == 1, uint8_t,
+    std::conditional_t<Size == 2, uint16_t,
+                       std::conditional_t<Size == 4, uint32_t, uint64_t>>>;
+
+template <typename T, std::endian Order>
+  requires std::integral<T> || std::floating_point<T>
+ByteParser<T> parse_fixed() {
+  return ByteParser<T>([](ByteSpan input) {
+    if (input.size() < sizeof(T)) {
+      return empty_parse_result<T>(
+          input, fmt::format("Error: expected {} bytes but saw {}", sizeof(T),
+                             input.size()));
+    }
+    using Bits = uint_of_size_t<sizeof(T)>;
+    Bits bits;
+    std::memcpy(&bits, input.data(), sizeof(T));
+    if constexpr (sizeof(T) > 1 && Order != std::endian::native) {
+      bits = std::byteswap(bits);
+    }
+    return make_parse_result(std::bit_cast<T>(bits),
+                             input.subspan(sizeof(T)));
+  });
+}
+
+// The start of the innermost frame parse_framed is running a body over on
+// this thread, or null outside any frame.
+const std::byte*& current_frame() {
+  static thread_local const std::byte* frame = nullptr;
+  return frame;
+}
+
+ParseResult<unit, ByteSpan> skip_padding(ByteSpan input, size_t offset,
+                                         size_t alignment) {
+  size_t padding = (alignment - offset % alignment) % alignment;
+  if (input.size() < padding) {
+    return empty_parse_result<unit>(input, "Error: truncated padding");
+  }
+  return make_parse_result(unit{}, input.subspan(padding));
+}
+
+}  // namespace detail
+
+// Fixed width little endian integer or IEEE float.
+template <typename T>
+  requires std::integral<T> || std::floating_point<T>
+ByteParser<T> parse_le() {
+  return detail::parse_fixed<T, std::endian::little>();
+}
+
+// Fixed width big endian (network order) integer or IEEE float.
+template <typename T>
+  requires std::integral<T> || std::floating_point<T>
+ByteParser<T> parse_be() {
+  return detail::parse_fixed<T, std::endian::big>();
+}
+
+// Unsigned LEB128 varint. Fails on truncated input and on values that
+// don't fit in T.
+template <typename T = uint64_t>
+  requires std::unsigned_integral<T>
+ByteParser<T> parse_uleb128() {
+  return ByteParser<T>([](ByteSpan input) {
+    // Most varints in practice are a single byte.
+    if (!input.empty() && input[0] < std::byte{0x80}) {
+      return make_parse_result(static_cast<T>(input[0]), input.subspan(1));
+    }
+    constexpr size_t max_bytes = (std::numeric_limits<T>::digits + 6) / 7;
+    T value = 0;
+    for (size_t i = 0; i < input.size() && i < max_bytes; ++i) {
+      uint8_t byte = std::to_integer<uint8_t>(input[i]);
+      T bits = byte & 0x7F;
+      unsigned shift = static_cast<unsigned>(i * 7);
+      if (shift > 0 &&
+          (bits >> (std::numeric_limits<T>::digits - shift)) != 0) {
+        return empty_parse_result<T>(input, "Error: varint out of range");
+      }
+      value |= bits << shift;
+      if ((byte & 0x80) == 0) {
+        return make_parse_result(value, input.subspan(i + 1));
+      }
+    }
+    return empty_parse_result<T>(
+        input, input.size() < max_bytes ? "Error: truncated varint"
+                                        : "Error: varint out of range");
+  });
+}
+
+// Signed LEB128 varint.
+template <typename T = int64_t>
+  requires std::signed_integral<T>
+ByteParser<T> parse_sleb128() {
+  using U = std::make_unsigned_t<T>;
+  return ByteParser<T>([](ByteSpan input) {
+    constexpr unsigned bits = std::numeric_limits<U>::digits;
+    constexpr size_t max_bytes = (bits + 6) / 7;
+    U value = 0;
+    for (size_t i = 0; i < input.size() && i < max_bytes; ++i) {
+      uint8_t byte = std::to_integer<uint8_t>(input[i]);
+      unsigned shift = static_cast<unsigned>(i * 7);
+      value |= static_cast<U>(byte & 0x7F) << shift;
+      if ((byte & 0x80) != 0) {
+        continue;
+      }
+      if (shift + 7 < bits) {
+        // Sign extend from the last bit read.
+        if ((byte & 0x40) != 0) {
+          value |= ~U{0} << (shift + 7);
+        }
+      } else {
+        // Bits of the last byte past the width of T must copy its sign.
+        unsigned used = bits - shift;
+        unsigned sign = (byte >> (used - 1)) & 1;
+        unsigned rest = (byte & 0x7F) >> used;
+        if (rest != (sign ? (0x7Fu >> used) : 0u)) {
+          return empty_parse_result<T>(input, "Error: varint out of range");
+        }
+      }
+      return make_parse_result(static_cast<T>(value), input.subspan(i + 1));
+    }
+    return empty_parse_result<T>(
+        input, input.size() < max_bytes ? "Error: truncated varint"
+                                        : "Error: varint out of range");
+  });
+}
+
+// Exactly count bytes.
+ByteParser<ByteSpan> parse_bytes(size_t count) {
+  return ByteParser<ByteSpan>([count](ByteSpan input) {
+    if (input.size() < count) {
+      return empty_parse_result<ByteSpan>(
+          input, fmt::format("Error: expected {} bytes but saw {}", count,
+                             input.size()));
+    }
+    return make_parse_result(input.first(count), input.subspan(count));
+  });
+}
+
+// A length followed by that many bytes, such as
+// parse_length_prefixed(parse_be<uint16_t>()).
+template <typename N>
+  requires std::integral<N>
+ByteParser<ByteSpan> parse_length_prefixed(const ByteParser<N>& length) {
+  return ByteParser<ByteSpan>([length](ByteSpan input) {
+    auto count = length(input);
+    if (!count) {
+      return empty_parse_result<ByteSpan>(input, count.error);
+    }
+    ByteSpan rest = count.input;
+    if (std::cmp_less(count.value(), 0) ||
+        std::cmp_greater(count.value(), rest.size())) {
+      return empty_parse_result<ByteSpan>(
+          input, fmt::format("Error: frame of {} bytes but only {} left",
+                             count.value(), rest.size()));
+    }
+    size_t size = static_cast<size_t>(count.value());
+    return make_parse_result(rest.first(size), rest.subspan(size));
+  });
+}
+
+// Runs body over exactly the bytes of a length-prefixed frame. Fails if
+// body doesn't consume the whole frame. Inside body, parse_align counts
+// from the start of the frame's length field.
+template <typename T, typename N>
+ByteParser<T> parse_framed(const ByteParser<N>& length,
+                           const ByteParser<T>& body) {
+  auto frame = parse_length_prefixed(length);
+  return ByteParser<T>([frame, body](ByteSpan input) {
+    auto bytes = frame(input);
+    if (!bytes) {
+      return empty_parse_result<T>(input, bytes.error);
+    }
+    struct restore {
+      const std::byte* saved;
+      ~restore() { detail::current_frame() = saved; }
+    } guard{.saved = std::exchange(detail::current_frame(), input.data())};
+    auto result = body(bytes.value());
+    if (!result) {
+      return empty_parse_result<T>(result.input, result.error);
+    }
+    if (!result.input.empty()) {
+      return empty_parse_result<T>(
+          result.input, fmt::format("Error: {} unread bytes in frame",
+                                    result.input.size()));
+    }
+    return make_parse_result(std::move(result.value()), bytes.input);
+  });
+}
+
+// Skips padding up to the next multiple of alignment, counted from the
+// start of the innermost enclosing parse_framed frame. The grammar holds no
+// buffer, so it can be reused for every message. Fails outside a frame.
+ByteParser<unit> parse_align(size_t alignment) {
+  return ByteParser<unit>([alignment](ByteSpan input) {
+    auto frame = reinterpret_cast<uintptr_t>(detail::current_frame());
+    auto at = reinterpret_cast<uintptr_t>(input.data());
+    if (frame == 0 || at < frame) {
+      return empty_parse_result<unit>(input,
+                                      "Error: parse_align outside a frame");
+    }
+    return detail::skip_padding(input, at - frame, alignment);
+  });
+}
+
+// Like parse_align, counting from the start of message instead, for
+// messages without a length field. Fails if the input isn't inside message.
+ByteParser<unit> parse_align(ByteSpan message, size_t alignment) {
+  return ByteParser<unit>([message, alignment](ByteSpan input) {
+    // Compared as integers, since pointers into different buffers aren't
+    // ordered.
+    auto begin = reinterpret_cast<uintptr_t>(message.data());
+    auto at = reinterpret_cast<uintptr_t>(input.data());
+    if (at < begin || at + input.size() > begin + message.size()) {
+      return empty_parse_result<unit>(input,
+                                      "Error: input outside the message");
+    }
+    return detail::skip_padding(input, at - begin, alignment);
+  });
+}
+
+#endif  // __BINARY_H__
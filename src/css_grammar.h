@@ -0,0 +1,60 @@
+//
+// Copyright 2025 John R. Burkhardt
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the “Software”), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#ifndef __CSS_GRAMMAR_H__
+#define __CSS_GRAMMAR_H__
+
+// The style sheet grammar as PEG patterns, shared by the VM, the generated
+// recognizer and the benchmarks so it is only written down once. Beyond
+// what main.cpp accepts it allows a byte order mark, comments, and a last
+// declaration without a trailing ';'.
+
+#include "peg.h"
+
+namespace peg {
+
+enum CssCapture {
+  kCssSelector = 1,
+  kCssProperty = 2,
+  kCssValue = 3,
+};
+
+Grammar css_grammar() {
+  auto ws = star(choice({space(), ref("comment")}));
+  auto name = plus(choice({alnum(), any_of("_.#-")}));
+  auto rule_end = choice({lit(';') >> ws, and_(lit('}'))});
+  Grammar grammar;
+  grammar
+      .define("sheet", seq({opt(lit("\xEF\xBB\xBF")), ws, plus(ref("block")),
+                            not_(any())}))
+      .define("block", seq({capture(kCssSelector, name), ws, lit('{'), ws,
+                            star(ref("rule")), lit('}'), ws}))
+      .define("rule", seq({capture(kCssProperty, name), ws, lit(':'), ws,
+                           capture(kCssValue, plus(none_of(";}"))), rule_end}))
+      .define("comment",
+              seq({lit("/*"), star(seq({not_(lit("*/")), any()})), lit("*/")}));
+  return grammar;
+}
+
+}  // namespace peg
+
+#endif  // __CSS_GRAMMAR_H__
@@ -0,0 +1,491 @@
+//
+// Copyright 2025 John R. Burkhardt
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the “Software”), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#ifndef __JSON_H__
+#define __JSON_H__
+
+// A JSON parser (RFC 8259) built from the combinators, yielding a
+// json::Value tree.
+//
+// Values are picked by their first char, so nothing is parsed twice. The
+// insides of strings are scanned 8 bytes at a time for the closing quote, a
+// backslash or a control char with the lexer's SWAR helpers. A string
+// without escapes is copied out in one go, and only one with escapes is
+// decoded char by char from its first backslash. recognize skips strings
+// without decoding them at all.
+//
+// Numbers are doubles, as RFC 8259 suggests for interoperability. Text is
+// taken to be UTF-8 and passed through unchecked; \u escapes are encoded as
+// UTF-8, with unpaired surrogates replaced by U+FFFD.
+
+#include "lexer.h"
+#include "parser.h"
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace json {
+
+struct Value;
+using Array = std::vector<Value>;
+// Members in document order. Duplicate names are kept, since RFC 8259
+// leaves what they mean to the application.
+using Object = std::vector<std::pair<std::string, Value>>;
+
+struct Value {
+  std::variant<std::nullptr_t, bool, double, std::string, Array, Object> data;
+
+  template <typename T>
+  bool is() const {
+    return std::holds_alternative<T>(data);
+  }
+
+  template <typename T>
+  const T& as() const {
+    return std::get<T>(data);
+  }
+
+  // The first member named name of an object, or null if there is none or
+  // this isn't an object.
+  const Value* find(std::string_view name) const {
+    if (const Object* object = std::get_if<Object>(&data)) {
+      for (const auto& [member, value] : *object) {
+        if (member == name) {
+          return &value;
+        }
+      }
+    }
+    return nullptr;
+  }
+
+  bool operator==(const Value&) const = default;
+};
+
+}  // namespace json
+
+namespace detail {
+void append_utf8(std::string& out, uint32_t code) {
+  if (code < 0x80) {
+    out += static_cast<char>(code);
+  } else if (code < 0x800) {
+    out += static_cast<char>(0xC0 | (code >> 6));
+    out += static_cast<char>(0x80 | (code & 0x3F));
+  } else if (code < 0x10000) {
+    out += static_cast<char>(0xE0 | (code >> 12));
+    out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+    out += static_cast<char>(0x80 | (code & 0x3F));
+  } else {
+    out += static_cast<char>(0xF0 | (code >> 18));
+    out += static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+    out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+    out += static_cast<char>(0x80 | (code & 0x3F));
+  }
+}
+
+// Decodes the \u escape at pos, and the low surrogate escape after it if it
+// is a high surrogate, appending the char. Returns the position after the
+// escapes, or npos if the hex digits are bad.
+size_t decode_json_unicode(std::string_view input, size_t pos,
+                           std::string& out) {
+  uint32_t code;
+  if (input.size() - pos < 6 || !decode_hex(input.data() + pos + 2, 4, code)) {
+    return std::string_view::npos;
+  }
+  pos += 6;
+  if (code >= 0xD800 && code < 0xDC00) {
+    uint32_t low;
+    if (input.size() - pos >= 6 && input[pos] == '\\' &&
+        input[pos + 1] == 'u' && decode_hex(input.data() + pos + 2, 4, low) &&
+        low >= 0xDC00 && low < 0xE000) {
+      code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+      pos += 6;
+    } else {
+      code = 0xFFFD;
+    }
+  } else if (code >= 0xDC00 && code < 0xE000) {
+    code = 0xFFFD;
+  }
+  append_utf8(out, code);
+  return pos;
+}
+
+// A quoted JSON string, yielding its decoded contents.
+ParseResult<std::string> parse_json_string(std::string_view input) {
+  if (input.empty() || input.front() != '"') {
+    return empty_parse_result<std::string>(
+        input, fmt::format("Error: expected string but saw {}",
+                           describe_front(input)));
+  }
+  size_t pos = find_string_special(input, 1, '"', true);
+  if (pos < input.size() && input[pos] == '"') {
+    return make_parse_result(std::string(input.substr(1, pos - 1)),
+                             input.substr(pos + 1));
+  }
+
+  std::string out(input.substr(1, pos - 1));
+  for (;;) {
+    if (pos == input.size()) {
+      return empty_parse_result<std::string>(input,
+                                             "Error: unterminated string");
+    }
+    char ch = input[pos];
+    if (ch == '"') {
+      return make_parse_result(std::move(out), input.substr(pos + 1));
+    }
+    if (ch != '\\') {
+      return empty_parse_result<std::string>(
+          input.substr(pos),
+          fmt::format("Error: control char {:#04x} in string",
+                      static_cast<unsigned char>(ch)));
+    }
+    char escape = pos + 1 < input.size() ? input[pos + 1] : '\0';
+    size_t next = pos + 2;
+    switch (escape) {
+      case '"':
+      case '\\':
+      case '/':
+        out += escape;
+        break;
+      case 'b':
+        out += '\b';
+        break;
+      case 'f':
+        out += '\f';
+        break;
+      case 'n':
+        out += '\n';
+        break;
+      case 'r':
+        out += '\r';
+        break;
+      case 't':
+        out += '\t';
+        break;
+      case 'u':
+        next = decode_json_unicode(input, pos, out);
+        break;
+      default:
+        next = std::string_view::npos;
+    }
+    if (next == std::string_view::npos) {
+      return empty_parse_result<std::string>(
+          input.substr(pos),
+          fmt::format(
+              "Error: bad escape in string {}",
+              input.substr(pos, std::min<size_t>(6, input.size() - pos))));
+    }
+    pos = find_string_special(input, next, '"', true);
+    out.append(input.substr(next, pos - next));
+  }
+}
+
+// Matches an array or object from its opening char through the closing one
+// and the whitespace after it. item matches one item and the whitespace
+// after it, returning ParseResult<unit>. Each item is tried once: a comma
+// commits to another, so nothing backtracks however deeply containers nest.
+// Errors are reported where they occur rather than at the opening char.
+template <typename F>
+ParseResult<unit> match_json_items(std::string_view input, char open,
+                                   char close, const F& item) {
+  auto after = [](std::string_view input) {
+    return make_parse_result(
+        unit{}, input.substr(skip_spaces(input, 1, kJsonSpace)));
+  };
+  if (input.empty() || input.front() != open) {
+    return empty_parse_result<unit>(
+        input, fmt::format("Error: expected {} but saw {}", open,
+                           describe_front(input)));
+  }
+  input = after(input).input;
+  if (!input.empty() && input.front() == close) {
+    return after(input);
+  }
+  for (;;) {
+    auto next = item(input);
+    if (!next) {
+      return next;
+    }
+    input = next.input;
+    if (input.empty() || (input.front() != ',' && input.front() != close)) {
+      return empty_parse_result<unit>(
+          input, fmt::format("Error: expected , or {} but saw {}", close,
+                             describe_front(input)));
+    }
+    if (input.front() == close) {
+      return after(input);
+    }
+    input = after(input).input;
+  }
+}
+
+// An array or object of items as a json::Value holding a std::vector<T>.
+template <typename T>
+Parser<json::Value> parse_json_items(const Parser<T>& item, char open,
+                                     char close) {
+  return Parser<json::Value>(
+      [item, open, close](std::string_view input) {
+        std::vector<T> items;
+        auto result =
+            match_json_items(input, open, close, [&](std::string_view input) {
+              auto next = item(input);
+              if (next) {
+                items.push_back(std::move(next.value()));
+              }
+              return outcome(next);
+            });
+        if (!result) {
+          return empty_parse_result<json::Value>(result.input, result.error);
+        }
+        return make_parse_result(json::Value{.data = std::move(items)},
+                                 result.input);
+      },
+      [item, open, close](std::string_view input) {
+        return match_json_items(
+            input, open, close,
+            [&](std::string_view input) { return item.check(input); });
+      });
+}
+
+void write_json_string(std::ostream& out, std::string_view text) {
+  out << '"';
+  size_t pos = 0;
+  while (pos < text.size()) {
+    size_t next = find_string_special(text, pos, '"', true);
+    out << text.substr(pos, next - pos);
+    if (next == text.size()) {
+      break;
+    }
+    char ch = text[next];
+    switch (ch) {
+      case '"':
+        out << "\\\"";
+        break;
+      case '\\':
+        out << "\\\\";
+        break;
+      case '\n':
+        out << "\\n";
+        break;
+      case '\r':
+        out << "\\r";
+        break;
+      case '\t':
+        out << "\\t";
+        break;
+      default:
+        out << fmt::format("\\u{:04x}", static_cast<unsigned char>(ch));
+    }
+    pos = next + 1;
+  }
+  out << '"';
+}
+}  // namespace detail
+
+namespace json {
+
+// Whitespace as RFC 8259 defines it: space, tab, newline and carriage
+// return.
+Parser<unit> parse_space() {
+  static const Parser<unit> parser([](std::string_view input) {
+    size_t pos = detail::skip_spaces(input, 0, detail::kJsonSpace);
+    return make_parse_result(unit{}, input.substr(pos));
+  });
+  return parser;
+}
+
+// A quoted string, yielding its decoded contents.
+Parser<std::string> parse_string() {
+  static const Parser<std::string> parser(
+      [](std::string_view input) { return detail::parse_json_string(input); },
+      [](std::string_view input) {
+        size_t end = input.empty() || input.front() != '"'
+                         ? std::string_view::npos
+                         : detail::skip_json_string(input, 0);
+        if (end == std::string_view::npos) {
+          // Decoded only for the error.
+          return detail::outcome(detail::parse_json_string(input));
+        }
+        return make_parse_result(unit{}, input.substr(end));
+      });
+  return parser;
+}
+
+// Any value, and the whitespace after it. Nesting is limited to max_depth
+// levels like any parse_recursive grammar.
+Parser<Value> parse_value() {
+  static const Parser<Value> parser = parse_recursive<Value>(
+      [](const Parser<Value>& value) {
+        auto ws = parse_space();
+        auto keyword = [ws](std::string_view name, Value result) {
+          return parse_str(name).as(std::move(result)).skip(ws);
+        };
+
+        auto string = parse_string().skip(ws);
+        auto name = string.skip(parse_literal(':').skip(ws));
+        using Member = std::pair<std::string, Value>;
+        auto member = Parser<Member>(
+            [name, value](std::string_view input) {
+              auto key = name(input);
+              if (!key) {
+                return empty_parse_result<Member>(key.input, key.error);
+              }
+              auto member_value = value(key.input);
+              if (!member_value) {
+                return empty_parse_result<Member>(member_value.input,
+                                                  member_value.error);
+              }
+              return make_parse_result(
+                  Member(std::move(key.value()),
+                         std::move(member_value.value())),
+                  member_value.input);
+            },
+            [name, value](std::string_view input) {
+              auto key = name.check(input);
+              if (!key) {
+                return key;
+              }
+              return value.check(key.input);
+            });
+
+        auto object = detail::parse_json_items(member, '{', '}');
+        auto array = detail::parse_json_items(value, '[', ']');
+        auto string_value = string.transform([](std::string text) {
+          return Value{.data = std::move(text)};
+        });
+        auto number = parse_float<double>().skip(ws).transform(
+            [](double number) { return Value{.data = number}; });
+        auto true_value = keyword("true", Value{.data = true});
+        auto false_value = keyword("false", Value{.data = false});
+        auto null_value = keyword("null", Value{.data = nullptr});
+
+        auto pick = [object, array, string_value, number, true_value,
+                     false_value, null_value](
+                        std::string_view input) -> const Parser<Value>* {
+          switch (input.empty() ? '\0' : input.front()) {
+            case '{':
+              return &object;
+            case '[':
+              return &array;
+            case '"':
+              return &string_value;
+            case 't':
+              return &true_value;
+            case 'f':
+              return &false_value;
+            case 'n':
+              return &null_value;
+            case '-':
+              return &number;
+            default:
+              return !input.empty() && detail::is_digit(input.front())
+                         ? &number
+                         : nullptr;
+          }
+        };
+        auto fail = [](std::string_view input) {
+          return fmt::format("Error: expected value but saw {}",
+                             detail::describe_front(input));
+        };
+        return Parser<Value>(
+            [pick, fail](std::string_view input) {
+              const Parser<Value>* parser = pick(input);
+              if (!parser) {
+                return empty_parse_result<Value>(input, fail(input));
+              }
+              return (*parser)(input);
+            },
+            [pick, fail](std::string_view input) {
+              const Parser<Value>* parser = pick(input);
+              if (!parser) {
+                return empty_parse_result<unit>(input, fail(input));
+              }
+              return parser->check(input);
+            });
+      });
+  return parser;
+}
+
+// A whole JSON text: one value with optional whitespace around it. Unlike
+// the combinators, which fail at the input they started on, a bad text fails
+// where the error is.
+Parser<Value> parse_text() {
+  static const Parser<Value> parser(
+      [](std::string_view input) {
+        auto value = parse_value()(parse_space()(input).input);
+        if (value && !value.input.empty()) {
+          return empty_parse_result<Value>(value.input,
+                                           "Error: input not empty");
+        }
+        return value;
+      },
+      [](std::string_view input) {
+        auto value = parse_value().check(parse_space()(input).input);
+        if (value && !value.input.empty()) {
+          return empty_parse_result<unit>(value.input,
+                                          "Error: input not empty");
+        }
+        return value;
+      });
+  return parser;
+}
+
+// Writes value as compact JSON.
+std::ostream& operator<<(std::ostream& out, const Value& value) {
+  std::visit(
+      [&out](const auto& data) {
+        using T = std::decay_t<decltype(data)>;
+        if constexpr (std::is_same_v<T, std::nullptr_t>) {
+          out << "null";
+        } else if constexpr (std::is_same_v<T, bool>) {
+          out << (data ? "true" : "false");
+        } else if constexpr (std::is_same_v<T, double>) {
+          out << fmt::format("{}", data);
+        } else if constexpr (std::is_same_v<T, std::string>) {
+          detail::write_json_string(out, data);
+        } else if constexpr (std::is_same_v<T, Array>) {
+          out << '[';
+          for (size_t i = 0; i < data.size(); ++i) {
+            out << (i ? "," : "") << data[i];
+          }
+          out << ']';
+        } else {
+          out << '{';
+          for (size_t i = 0; i < data.size(); ++i) {
+            out << (i ? "," : "");
+            detail::write_json_string(out, data[i].first);
+            out << ':' << data[i].second;
+          }
+          out << '}';
+        }
+      },
+      value.data);
+  return out;
+}
+
+}  // namespace json
+
+#endif  // __JSON_H__
@@ -0,0 +1,435 @@
+//
+// Copyright 2025 John R. Burkhardt
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the “Software”), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#ifndef __LEXER_H__
+#define __LEXER_H__
+
+// A separate lexing stage. tokenize_css and tokenize_json split the input
+// into tokens in one pass, and grammars written as TokenParsers then run
+// over the tokens, so backtracking with or_else moves between tokens
+// instead of re-scanning the same chars. Every combinator that only moves
+// through its input works over tokens unchanged; parse_token replaces the
+// char primitives.
+//
+// Runs of spaces and the insides of strings are scanned 8 bytes at a time
+// with SWAR word operations, which need no target-specific intrinsics.
+
+#include "parser.h"
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+enum class TokenKind : uint8_t {
+  kIdent,       // a name, or a keyword such as true
+  kNumber,      // 12, -1.5e3
+  kPercentage,  // 50%
+  kDimension,   // 10px
+  kString,      // a quoted string, including its quotes
+  kHash,        // #name
+  kPunct,       // any other single char
+  kError,       // input that can't start a token
+};
+
+struct Token {
+  TokenKind kind;
+  std::string_view text;  // points into the tokenized input
+};
+
+using TokenSpan = std::span<const Token>;
+
+template <class T>
+using TokenParser = Parser<T, TokenSpan>;
+
+std::string_view token_kind_name(TokenKind kind) {
+  static constexpr std::string_view names[] = {
+      "identifier", "number", "percentage", "dimension",
+      "string",     "hash",   "punctuation", "invalid input",
+  };
+  return names[static_cast<int>(kind)];
+}
+
+namespace detail {
+
+enum : uint8_t {
+  kCssSpace = 1,
+  kJsonSpace = 2,
+  kNameStart = 4,
+  kName = 8,
+};
+
+constexpr std::array<uint8_t, 256> char_classes = [] {
+  std::array<uint8_t, 256> classes{};
+  for (int ch = 0; ch < 256; ++ch) {
+    bool letter = (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') ||
+                  ch == '_' || ch >= 0x80;
+    if (letter) {
+      classes[ch] |= kNameStart | kName;
+    }
+    if ((ch >= '0' && ch <= '9') || ch == '-') {
+      classes[ch] |= kName;
+    }
+  }
+  for (char ch : std::string_view(" \t\n\r\f")) {
+    classes[static_cast<unsigned char>(ch)] |= kCssSpace;
+  }
+  for (char ch : std::string_view(" \t\n\r")) {
+    classes[static_cast<unsigned char>(ch)] |= kJsonSpace;
+  }
+  return classes;
+}();
+
+bool has_class(char ch, uint8_t mask) {
+  return (char_classes[static_cast<unsigned char>(ch)] & mask) != 0;
+}
+
+constexpr uint64_t ones = 0x0101010101010101;
+constexpr uint64_t highs = 0x8080808080808080;
+
+// Marks the high bit of bytes of word equal to ch. Bytes above the first
+// match may be marked spuriously, so only the lowest mark is meaningful.
+constexpr uint64_t bytes_equal(uint64_t word, uint8_t ch) {
+  uint64_t diff = word ^ (ones * ch);
+  return (diff - ones) & ~diff & highs;
+}
+
+// Marks the high bit of bytes of word below limit, which must be at most
+// 0x80. As above only the lowest mark is meaningful.
+constexpr uint64_t bytes_below(uint64_t word, uint8_t limit) {
+  return (word - ones * limit) & ~word & highs;
+}
+
+size_t skip_spaces(std::string_view input, size_t pos, uint8_t space) {
+  // Indentation is mostly runs of spaces, so those go 8 at a time.
+  while (pos < input.size()) {
+    if (input.size() - pos >= 8 &&
+        load_word(input.data() + pos) == ones * ' ') {
+      pos += 8;
+    } else if (has_class(input[pos], space)) {
+      ++pos;
+    } else {
+      break;
+    }
+  }
+  return pos;
+}
+
+size_t skip_name(std::string_view input, size_t pos) {
+  while (pos < input.size() && has_class(input[pos], kName)) {
+    ++pos;
+  }
+  return pos;
+}
+
+// Finds the next quote or backslash from pos, and with controls also the
+// next char below 0x20, or returns the input size.
+size_t find_string_special(std::string_view input, size_t pos, char quote,
+                           bool controls) {
+  while (input.size() - pos >= 8) {
+    uint64_t word = load_word(input.data() + pos);
+    uint64_t marks = bytes_equal(word, quote) | bytes_equal(word, '\\');
+    if (controls) {
+      marks |= bytes_below(word, 0x20);
+    }
+    if (marks != 0) {
+      return pos + std::countr_zero(marks) / 8;
+    }
+    pos += 8;
+  }
+  for (; pos < input.size(); ++pos) {
+    char ch = input[pos];
+    if (ch == quote || ch == '\\' ||
+        (controls && static_cast<unsigned char>(ch) < 0x20)) {
+      break;
+    }
+  }
+  return pos;
+}
+
+// Skips a CSS number at pos: an optional sign, digits with an optional
+// fraction, and an exponent only when digits follow the e so that units
+// such as em stay separate.
+size_t skip_css_number(std::string_view input, size_t pos) {
+  const char* ptr = input.data() + pos;
+  const char* end = input.data() + input.size();
+  if (*ptr == '+' || *ptr == '-') {
+    ++ptr;
+  }
+  skip_digits(ptr, end);
+  if (end - ptr >= 2 && *ptr == '.' && is_digit(ptr[1])) {
+    ++ptr;
+    skip_digits(ptr, end);
+  }
+  if (ptr != end && (*ptr == 'e' || *ptr == 'E')) {
+    const char* exp = ptr + 1;
+    if (exp != end && (*exp == '+' || *exp == '-')) {
+      ++exp;
+    }
+    if (exp != end && is_digit(*exp)) {
+      ptr = exp;
+      skip_digits(ptr, end);
+    }
+  }
+  return ptr - input.data();
+}
+
+bool starts_css_number(std::string_view input, size_t pos) {
+  auto digit_at = [&](size_t at) {
+    return at < input.size() && is_digit(input[at]);
+  };
+  auto number_at = [&](size_t at) {
+    return digit_at(at) ||
+           (at < input.size() && input[at] == '.' && digit_at(at + 1));
+  };
+  if (input[pos] == '+' || input[pos] == '-') {
+    return number_at(pos + 1);
+  }
+  return number_at(pos);
+}
+
+// Skips a JSON number at pos, returning npos if it is malformed.
+size_t skip_json_number(std::string_view input, size_t pos) {
+  const char* ptr = input.data() + pos;
+  const char* end = input.data() + input.size();
+  if (*ptr == '-') {
+    ++ptr;
+  }
+  if (ptr == end || !is_digit(*ptr)) {
+    return std::string_view::npos;
+  }
+  if (*ptr == '0') {
+    ++ptr;
+    if (ptr != end && is_digit(*ptr)) {
+      return std::string_view::npos;
+    }
+  } else {
+    skip_digits(ptr, end);
+  }
+  if (ptr != end && *ptr == '.') {
+    ++ptr;
+    if (skip_digits(ptr, end) == 0) {
+      return std::string_view::npos;
+    }
+  }
+  if (ptr != end && (*ptr == 'e' || *ptr == 'E')) {
+    ++ptr;
+    if (ptr != end && (*ptr == '+' || *ptr == '-')) {
+      ++ptr;
+    }
+    if (skip_digits(ptr, end) == 0) {
+      return std::string_view::npos;
+    }
+  }
+  return ptr - input.data();
+}
+
+// Skips a JSON string whose opening quote is at pos, returning npos if it
+// is unterminated or has a control char or bad escape.
+size_t skip_json_string(std::string_view input, size_t pos) {
+  ++pos;
+  for (;;) {
+    pos = find_string_special(input, pos, '"', true);
+    if (pos == input.size() || input[pos] != '\\') {
+      break;
+    }
+    if (pos + 1 == input.size()) {
+      return std::string_view::npos;
+    }
+    char escape = input[pos + 1];
+    if (escape == 'u') {
+      uint32_t unused;
+      if (input.size() - pos < 6 ||
+          !decode_hex(input.data() + pos + 2, 4, unused)) {
+        return std::string_view::npos;
+      }
+      pos += 6;
+    } else if (str_contains("\"\\/bfnrt", escape)) {
+      pos += 2;
+    } else {
+      return std::string_view::npos;
+    }
+  }
+  if (pos == input.size() || input[pos] != '"') {
+    return std::string_view::npos;
+  }
+  return pos + 1;
+}
+
+}  // namespace detail
+
+// Splits a style sheet into tokens, dropping whitespace and comments.
+// Unterminated strings and comments become a kError token running to the
+// end of input.
+std::vector<Token> tokenize_css(std::string_view input) {
+  std::vector<Token> tokens;
+  tokens.reserve(input.size() / 4);
+  size_t pos = 0;
+  auto emit = [&](TokenKind kind, size_t start) {
+    tokens.push_back(Token{.kind = kind,
+                           .text = input.substr(start, pos - start)});
+  };
+  for (;;) {
+    pos = detail::skip_spaces(input, pos, detail::kCssSpace);
+    if (pos == input.size()) {
+      break;
+    }
+    size_t start = pos;
+    char ch = input[pos];
+    char next = pos + 1 < input.size() ? input[pos + 1] : '\0';
+    if (ch == '/' && next == '*') {
+      size_t end = input.find("*/", pos + 2);
+      if (end == std::string_view::npos) {
+        pos = input.size();
+        emit(TokenKind::kError, start);
+        break;
+      }
+      pos = end + 2;
+    } else if (ch == '"' || ch == '\'') {
+      ++pos;
+      for (;;) {
+        pos = detail::find_string_special(input, pos, ch, false);
+        if (pos == input.size() || input[pos] == ch) {
+          break;
+        }
+        pos = std::min(pos + 2, input.size());
+      }
+      if (pos == input.size()) {
+        emit(TokenKind::kError, start);
+        break;
+      }
+      ++pos;
+      emit(TokenKind::kString, start);
+    } else if (detail::starts_css_number(input, pos)) {
+      pos = detail::skip_css_number(input, pos);
+      if (pos < input.size() && input[pos] == '%') {
+        ++pos;
+        emit(TokenKind::kPercentage, start);
+      } else if (pos < input.size() &&
+                 detail::has_class(input[pos], detail::kNameStart)) {
+        pos = detail::skip_name(input, pos);
+        emit(TokenKind::kDimension, start);
+      } else {
+        emit(TokenKind::kNumber, start);
+      }
+    } else if (ch == '#' && detail::has_class(next, detail::kName)) {
+      pos = detail::skip_name(input, pos + 1);
+      emit(TokenKind::kHash, start);
+    } else if (detail::has_class(ch, detail::kNameStart) ||
+               (ch == '-' &&
+                (next == '-' || detail::has_class(next, detail::kNameStart)))) {
+      pos = detail::skip_name(input, pos + 1);
+      emit(TokenKind::kIdent, start);
+    } else {
+      ++pos;
+      emit(TokenKind::kPunct, start);
+    }
+  }
+  return tokens;
+}
+
+// Splits a JSON document into tokens, dropping whitespace. Keywords come
+// out as kIdent for the grammar to check. A malformed number or string, or
+// a char that can't start a token, becomes a kError token.
+std::vector<Token> tokenize_json(std::string_view input) {
+  std::vector<Token> tokens;
+  tokens.reserve(input.size() / 4);
+  size_t pos = 0;
+  auto emit = [&](TokenKind kind, size_t start) {
+    tokens.push_back(Token{.kind = kind,
+                           .text = input.substr(start, pos - start)});
+  };
+  for (;;) {
+    pos = detail::skip_spaces(input, pos, detail::kJsonSpace);
+    if (pos == input.size()) {
+      break;
+    }
+    size_t start = pos;
+    char ch = input[pos];
+    size_t end = std::string_view::npos;
+    TokenKind kind = TokenKind::kError;
+    if (detail::str_contains("{}[]:,", ch)) {
+      end = pos + 1;
+      kind = TokenKind::kPunct;
+    } else if (ch == '"') {
+      end = detail::skip_json_string(input, pos);
+      kind = TokenKind::kString;
+    } else if (ch == '-' || detail::is_digit(ch)) {
+      end = detail::skip_json_number(input, pos);
+      kind = TokenKind::kNumber;
+    } else if (ch >= 'a' && ch <= 'z') {
+      end = pos;
+      while (end < input.size() && input[end] >= 'a' && input[end] <= 'z') {
+        ++end;
+      }
+      kind = TokenKind::kIdent;
+    }
+    if (end == std::string_view::npos) {
+      end = pos + 1;
+      kind = TokenKind::kError;
+    }
+    pos = end;
+    emit(kind, start);
+  }
+  return tokens;
+}
+
+namespace detail {
+std::string describe_token(TokenSpan input) {
+  if (input.empty()) {
+    return "end of input";
+  }
+  return fmt::format("{} {}", token_kind_name(input.front().kind),
+                     input.front().text);
+}
+}  // namespace detail
+
+// Matches one token of the given kind.
+TokenParser<Token> parse_token(TokenKind kind) {
+  return TokenParser<Token>([kind](TokenSpan input) {
+    if (input.empty() || input.front().kind != kind) {
+      return empty_parse_result<Token>(
+          input, fmt::format("Error: expected {} but saw {}",
+                             token_kind_name(kind),
+                             detail::describe_token(input)));
+    }
+    return make_parse_result(input.front(), input.subspan(1));
+  });
+}
+
+// Matches one token of the given kind and text, such as punctuation or a
+// keyword.
+TokenParser<Token> parse_token(TokenKind kind, std::string_view text) {
+  return TokenParser<Token>([kind, text](TokenSpan input) {
+    if (input.empty() || input.front().kind != kind ||
+        input.front().text != text) {
+      return empty_parse_result<Token>(
+          input, fmt::format("Error: expected {} but saw {}", text,
+                             detail::describe_token(input)));
+    }
+    return make_parse_result(input.front(), input.subspan(1));
+  });
+}
+
+#endif  // __LEXER_H__
@@ -1,51 +1,51 @@
 #include "parser.h"
+#include "peg.h"
 #include "style_sheet.h"
-#include "util.h"
+#include <algorithm>
+#include <atomic>
 #include <charconv>
+#include <chrono>
+#include <condition_variable>
 #include <cstdarg>
+#include <filesystem>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <mutex>
 #include <optional>
 #include <sstream>
 #include <string>
 #include <system_error>
+#include <thread>
 #include <variant>
 #include <vector>
+#include <fnmatch.h>
 
 // A parser for things
 // is a function from strings
 // to lists of pairs of strings and things.
 
-Parser<int> parse_number() {
-  auto positive_number = parse_digit(1, 9).and_then([](int val) {
-    return parse_some(parse_digit()).transform([val](std::vector<int> digits) {
-      int result = val;
-      for (auto d : digits) {
-        result = (result * 10) + d;
-      }
-      return result;
-    });
-  });
-
-  auto zero = parse_digit(0, 0).and_not(parse_digit(0, 9));
-
-  return positive_number.or_else(zero).or_else(
-      parse_literal('-').and_then(positive_number).transform([](int val) {
-        return -val;
-      }));
-}
-
 // For style sheet - esque sample.
 
+// The units are parsed by the same parser for every value rather than one
+// built around each number.
 Parser<Dimension> parse_dimension() {
-  auto dimension_parser = parse_number().and_then([](auto value) {
-    return parse_str("px")
-        .as(Dimension{.value = value, .units = Dimension::px})
-        .or_else(parse_literal('%').as(
-            Dimension{.value = value, .units = Dimension::pct}));
+  auto number = parse_float<double>();
+  auto units = parse_str("px")
+                   .as(Dimension::px)
+                   .or_else(parse_literal('%').as(Dimension::pct));
+  return Parser<Dimension>([number, units](std::string_view input) {
+    auto value = number(input);
+    if (!value) {
+      return empty_parse_result<Dimension>(input, value.error);
+    }
+    auto unit = units(value.input);
+    if (!unit) {
+      return empty_parse_result<Dimension>(unit.input, unit.error);
+    }
+    return make_parse_result(
+        Dimension{.value = value.value(), .units = unit.value()}, unit.input);
   });
-  return dimension_parser;
 }
 
 Parser<Spacing> parse_spacing() {
@@ -58,7 +58,6 @@ Parser<Spacing> parse_spacing() {
                 sp.top = sp.right = sp.bottom = sp.left = values[0];
                 return sp;
               case 2:
-                std::cout << "spacing " << sp << std::endl;
                 sp.top = sp.bottom = values[0];
                 sp.right = sp.left = values[1];
                 return sp;
@@ -79,49 +78,24 @@ Parser<Spacing> parse_spacing() {
   return spacing;
 }
 
-int decode_hex_str(std::string_view str) {
-  char buf[3] = {str[0], str[1], '\0'};
-  return (uint8_t)(std::strtoul(buf, nullptr, 16));
-}
-
-int combine_digits(const std::vector<int> digits) {
-  int val = 0;
-  for (auto d : digits) {
-    val = (val * 10) + d;
-  }
-  return val;
-}
-
-auto parse_hex_digit = detail::parse_char_class([](char ch) {
-  ch = toupper(ch);
-  return (ch >= '0' && ch <= '9') || (ch >= 'A' && ch <= 'F');
-});
-
 Parser<uint8_t> parse_byte() {
   auto parser =
       parse_str("0x")
           .or_else(parse_str("0X"))
-          .and_then(parse_n(parse_hex_digit, 2).transform(decode_hex_str))
-          .or_else(parse_n(parse_digit(), 1, 3).transform(combine_digits));
+          .and_then(parse_hex<2>().transform(
+              [](uint32_t val) { return static_cast<int>(val); }))
+          .or_else(parse_fold(
+              parse_digit(), 0, [](int val, int d) { return (val * 10) + d; },
+              1, 3));
   return parser.transform([](int val) { return static_cast<uint8_t>(val); });
 }
 
 Parser<Color> parse_color() {
-  auto is_hexit = [](char ch) {
-    ch = toupper(ch);
-    return (ch >= '0' && ch <= '9') || (ch >= 'A' && ch <= 'F');
-  };
-
-  auto parse_hex_digit(detail::parse_char_class(is_hexit));
-
-  auto hex_color_parser =
-      parse_literal('#')
-          .and_then(parse_n(parse_hex_digit, 6))
-          .transform([](std::string_view value) {
-            return Color{.r = decode_hex_str(value.substr(0, 2)),
-                         .g = decode_hex_str(value.substr(2, 4)),
-                         .b = decode_hex_str(value.substr(4, 6))};
-          });
+  auto hex_color_parser = parse_hex_color().transform([](uint32_t rgb) {
+    return Color{.r = static_cast<int>((rgb >> 16) & 0xFF),
+                 .g = static_cast<int>((rgb >> 8) & 0xFF),
+                 .b = static_cast<int>(rgb & 0xFF)};
+  });
 
   auto delimiter = parse_literal(',').trim();
   auto rgb_parser =
@@ -139,103 +113,178 @@ Parser<Color> parse_color() {
 
 template <typename T>
 Parser<Rule> parse_rule(std::string_view property, Parser<T> rule_value) {
-  return rule_value().transform([property](const T& value) {
-    return Rule{.property = std::string(property), .value = value};
-  });
+  return rule_value().transform(
+      [property = std::string(property)](const T& value) {
+        return Rule{.property = property, .value = value};
+      });
 }
 
 Parser<Rule> parse_dimension_rule(std::string_view property) {
-  return parse_dimension().transform([property](const Dimension& dim) {
-    return Rule{.property = std::string(property), .value = dim};
-  });
+  return parse_dimension().transform(
+      [property = std::string(property)](const Dimension& dim) {
+        return Rule{.property = property, .value = dim};
+      });
 }
 
 Parser<Rule> parse_color_rule(std::string_view property) {
-  return parse_color().transform([property](const Color& color) {
-    return Rule{.property = std::string(property), .value = color};
-  });
+  return parse_color().transform(
+      [property = std::string(property)](const Color& color) {
+        return Rule{.property = property, .value = color};
+      });
 }
 
 Parser<Rule> parse_spacing_rule(std::string_view property) {
-  return parse_spacing().transform([property](const Spacing& spacing) {
-    return Rule{.property = std::string(property), .value = spacing};
-  });
+  return parse_spacing().transform(
+      [property = std::string(property)](const Spacing& spacing) {
+        return Rule{.property = property, .value = spacing};
+      });
 }
 
-void print_stylesheet(const StyleSheet& ss) {
+void print_stylesheet(std::ostream& out, const StyleSheet& ss) {
   for (auto it = ss.selectors.begin(); it != ss.selectors.end(); ++it) {
-    std::cout << it->first << ":" << std::endl;
+    out << it->first << ":" << std::endl;
     for (auto rule : it->second) {
-      std::cout << "  " << rule.property << " = ";
-      std::visit([](auto&& arg) { std::cout << arg << std::endl; }, rule.value);
+      out << "  " << rule.property << " = ";
+      std::visit([&out](auto&& arg) { out << arg << std::endl; }, rule.value);
     }
   }
 }
 
+// The returned parser is cached per property name, so it keeps its own copy
+// of the name.
 Parser<Rule> GetRuleParser(std::string_view property) {
-  static std::unordered_map<std::string, Parser<Rule> (*)(std::string_view)>
+  static const std::unordered_map<std::string,
+                                  Parser<Rule> (*)(std::string_view)>
       prop_parsers = {
           {"padding", parse_spacing_rule},
           {"height", parse_dimension_rule},
           {"width", parse_dimension_rule},
           {"color", parse_color_rule},
       };
-  return prop_parsers[std::string(property)](property);
+  auto it = prop_parsers.find(std::string(property));
+  if (it == prop_parsers.end()) {
+    return Parser<Rule>([property = std::string(property)](
+                            std::string_view input) {
+      return empty_parse_result<Rule>(
+          input, fmt::format("Error: unknown property {}", property));
+    });
+  }
+  return it->second(property);
 }
 
-void ParseStyleSheet(std::string_view input) {
-  auto variable =
-      parse_sequence({parse_any_of("_.#").or_else(parse_alpha()),
-                      parse_n(parse_alnum(), 1).or_else(parse_any_of("-"))});
+Parser<StyleSheet> style_sheet_parser() {
+  // Names are a regular language, so they scan in one DFA pass.
+  auto name = peg::seq({peg::choice({peg::any_of("_.#"), peg::alpha()}),
+                        peg::choice({peg::plus(peg::alnum()), peg::lit('-')})});
+  auto variable = peg::to_parser(
+      std::make_shared<const peg::Dfa>(*peg::Dfa::compile(name)));
 
   auto rule = variable.skip(parse_opt_ws())
                   .skip(parse_literal(':'))
                   .skip(parse_opt_ws())
-                  .and_then([](std::string_view prop_name) {
+                  .and_then_cached([](std::string_view prop_name) {
                     return GetRuleParser(prop_name);
                   })
                   .skip(parse_literal(';'))
                   .skip(parse_opt_ws());
 
-  auto selector = variable.skip(parse_opt_ws())
-                      .skip(parse_literal('{'))
-                      .skip(parse_opt_ws())
-                      .and_then([rule](std::string_view sel_name) {
-                        return parse_some(rule).transform(
-                            [sel_name](const std::vector<Rule>& rules) {
-                              return make_pair(sel_name, rules);
-                            });
-                      })
-                      .skip(parse_opt_ws())
-                      .skip(parse_literal('}'))
+  // When recovering, a bad rule is skipped through its ';' (but not past the
+  // end of its block) and a bad block through its '}'.
+  auto rule_end = parse_literal(';')
+                      .or_else(parse_peek(parse_literal('}')))
                       .skip(parse_opt_ws());
+  auto block_rule = parse_peek(parse_not(parse_literal('}')))
+                        .and_then(recover_to(rule, rule_end));
 
-  auto styles = parse_n(selector, 1).transform([](auto selectors) {
-    StyleSheet ss;
-    for (auto [selector, rules] : selectors) {
-      ss.selectors[std::string(selector)] = rules;
-    }
-    return ss;
-  });
+  // Recovered rules and blocks come through as nullopt and are dropped.
+  auto rules = parse_fold(
+      block_rule, std::vector<Rule>(),
+      [](std::vector<Rule> rules, std::optional<Rule>&& rule) {
+        if (rule) {
+          rules.push_back(std::move(*rule));
+        }
+        return rules;
+      });
+
+  auto selector_name = variable.skip(parse_opt_ws())
+                           .skip(parse_literal('{'))
+                           .skip(parse_opt_ws());
+  auto selector_rules =
+      rules.skip(parse_opt_ws()).skip(parse_literal('}')).skip(parse_opt_ws());
+  auto selector = Parser<std::pair<std::string_view, std::vector<Rule>>>(
+      [selector_name, selector_rules](std::string_view input) {
+        using Selector = std::pair<std::string_view, std::vector<Rule>>;
+        auto name = selector_name(input);
+        if (!name) {
+          return empty_parse_result<Selector>(name.input, name.error);
+        }
+        auto parsed = selector_rules(name.input);
+        if (!parsed) {
+          return empty_parse_result<Selector>(parsed.input, parsed.error);
+        }
+        return make_parse_result(
+            Selector(name.value(), std::move(parsed.value())), parsed.input);
+      },
+      [selector_name, selector_rules](std::string_view input) {
+        auto name = selector_name.check(input);
+        if (!name) {
+          return name;
+        }
+        return selector_rules.check(name.input);
+      });
+
+  auto block = recover_to(selector, parse_literal('}').skip(parse_opt_ws()));
+
+  return parse_fold(
+      block, StyleSheet(),
+      [](StyleSheet ss, auto&& selector) {
+        if (selector) {
+          auto& [name, rules] = *selector;
+          ss.selectors[std::string(name)] = std::move(rules);
+        }
+        return ss;
+      },
+      1);
+}
 
-  auto result = styles(input);
+// Parses a style sheet with an already built grammar, printing it to out
+// and every error found along the way to err prefixed by name. Returns true
+// if there were none.
+bool ParseStyleSheet(const Parser<StyleSheet>& parser, std::string_view name,
+                     std::string_view input, std::ostream& out,
+                     std::ostream& err) {
+  auto [result, diagnostics] = parse_with_recovery(parser, input);
+  for (const auto& diagnostic : diagnostics) {
+    err << name << ":" << diagnostic << std::endl;
+  }
   if (result) {
     if (!result.input.empty()) {
-      std::cerr << "Stopped parsing at " << result.input << std::endl;
-    }
-    if (result.error.size()) {
-      std::cerr << "It says it worked but: " << result.error << std::endl;
+      err << name << ": stopped parsing at " << result.input << std::endl;
     }
-    print_stylesheet(result.value());
+    print_stylesheet(out, result.value());
   } else {
-    std::cerr << "failed at " << result.input << std::endl;
+    err << name << ": failed at " << result.input << std::endl;
+  }
+  return result && result.input.empty() && diagnostics.empty();
+}
+
+// Checks that a style sheet is valid without building it, printing the first
+// error to err prefixed by name. Returns true if there was none.
+bool CheckStyleSheet(const Parser<StyleSheet>& parser, std::string_view name,
+                     std::string_view input, std::ostream& err) {
+  auto result = recognize(parser, input);
+  if (!result) {
+    err << name << ": failed at " << result.input << std::endl;
+  } else if (!result.input.empty()) {
+    err << name << ": stopped parsing at " << result.input << std::endl;
   }
+  return result && result.input.empty();
 }
 
 std::string read_file(std::string_view filename) {
-  std::ifstream f(filename, 0);
+  std::ifstream f{std::string(filename)};
   if (!f) {
-    throw std::runtime_error("failed to open file");
+    throw std::runtime_error(fmt::format("failed to open {}", filename));
   }
 
   std::ostringstream ss;
@@ -243,13 +292,245 @@ std::string read_file(std::string_view filename) {
   return ss.str();
 }
 
+struct Options {
+  std::vector<std::string> paths;
+  std::vector<std::string> globs;
+  unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+  bool quiet = false;
+  bool check = false;
+  bool summary = false;
+};
+
+void print_usage(std::ostream& out) {
+  out << "usage: mparse [options] path...\n"
+         "  path          a style sheet, a directory to search recursively,\n"
+         "                or - to read paths from stdin, one per line\n"
+         "  -j N          parse with N threads (default: all cores)\n"
+         "  --glob PAT    file name pattern for directory searches, may be\n"
+         "                repeated (default: *.css)\n"
+         "  -q, --quiet   only print errors\n"
+         "  --check       only validate, stopping at the first error\n"
+         "  --summary     print timing even for a single file\n";
+}
+
+std::optional<Options> parse_args(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg = argv[i];
+    if ((arg == "-j" || arg == "--glob") && i + 1 >= argc) {
+      std::cerr << arg << " needs a value" << std::endl;
+      return std::nullopt;
+    }
+    if (arg == "-j") {
+      auto jobs = parse_int<unsigned>().skip(parse_end())(argv[++i]);
+      if (!jobs || jobs.value() == 0) {
+        std::cerr << "bad job count " << argv[i] << std::endl;
+        return std::nullopt;
+      }
+      options.jobs = jobs.value();
+    } else if (arg == "--glob") {
+      options.globs.emplace_back(argv[++i]);
+    } else if (arg == "-q" || arg == "--quiet") {
+      options.quiet = true;
+    } else if (arg == "--check") {
+      options.check = true;
+    } else if (arg == "--summary") {
+      options.summary = true;
+    } else if (arg == "-h" || arg == "--help") {
+      print_usage(std::cout);
+      std::exit(0);
+    } else if (arg.size() > 1 && arg.front() == '-') {
+      std::cerr << "unknown option " << arg << std::endl;
+      return std::nullopt;
+    } else {
+      options.paths.emplace_back(arg);
+    }
+  }
+  if (options.paths.empty()) {
+    return std::nullopt;
+  }
+  if (options.globs.empty()) {
+    options.globs.emplace_back("*.css");
+  }
+  return options;
+}
+
+// Expands the command line paths into the list of files to parse. Explicit
+// files are kept as given; directories are searched recursively for files
+// matching one of the globs, in sorted order so runs are repeatable.
+std::vector<std::string> collect_files(const Options& options) {
+  namespace fs = std::filesystem;
+  std::vector<std::string> files;
+  auto matches = [&options](const fs::path& path) {
+    std::string name = path.filename().string();
+    return std::any_of(options.globs.begin(), options.globs.end(),
+                       [&name](const std::string& glob) {
+                         return fnmatch(glob.c_str(), name.c_str(), 0) == 0;
+                       });
+  };
+  auto add = [&](const std::string& path) {
+    std::error_code ec;
+    if (!fs::is_directory(path, ec)) {
+      files.push_back(path);
+      return;
+    }
+    std::vector<std::string> found;
+    for (auto it = fs::recursive_directory_iterator(
+             path, fs::directory_options::skip_permission_denied, ec);
+         it != fs::recursive_directory_iterator(); it.increment(ec)) {
+      if (it->is_regular_file(ec) && matches(it->path())) {
+        found.push_back(it->path().string());
+      }
+    }
+    std::sort(found.begin(), found.end());
+    files.insert(files.end(), found.begin(), found.end());
+  };
+
+  for (const auto& path : options.paths) {
+    if (path == "-") {
+      std::string line;
+      while (std::getline(std::cin, line)) {
+        if (!line.empty()) {
+          add(line);
+        }
+      }
+    } else {
+      add(path);
+    }
+  }
+  return files;
+}
+
+struct FileResult {
+  std::string output;
+  std::string errors;
+  bool ok = false;
+  size_t bytes = 0;
+  double seconds = 0;
+};
+
+// Parses files on a pool of worker threads sharing one grammar. Each worker
+// pulls the next file index from a shared counter.
+// on_done is called on the calling thread for each file in input order as
+// soon as it and all files before it are finished.
+void parse_files(
+    const std::vector<std::string>& files, const Options& options,
+    const std::function<void(size_t, const FileResult&)>& on_done) {
+  std::vector<FileResult> results(files.size());
+  std::vector<bool> done(files.size(), false);
+  std::mutex mutex;
+  std::condition_variable finished;
+  std::atomic<size_t> next = 0;
+  auto parser = style_sheet_parser();
+
+  auto worker = [&] {
+    for (size_t index = next++; index < files.size(); index = next++) {
+      FileResult result;
+      std::ostringstream out;
+      std::ostringstream err;
+      auto start = std::chrono::steady_clock::now();
+      try {
+        std::string content = read_file(files[index]);
+        result.bytes = content.size();
+        std::ostringstream discard;
+        result.ok =
+            options.check
+                ? CheckStyleSheet(parser, files[index], content, err)
+                : ParseStyleSheet(parser, files[index], content,
+                                  options.quiet ? discard : out, err);
+      } catch (const std::exception& e) {
+        err << files[index] << ": " << e.what() << std::endl;
+      }
+      std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - start;
+      result.seconds = elapsed.count();
+      result.output = out.str();
+      result.errors = err.str();
+
+      std::lock_guard lock(mutex);
+      results[index] = std::move(result);
+      done[index] = true;
+      finished.notify_one();
+    }
+  };
+
+  std::vector<std::jthread> workers;
+  unsigned thread_count =
+      static_cast<unsigned>(std::min<size_t>(options.jobs, files.size()));
+  for (unsigned i = 0; i < thread_count; ++i) {
+    workers.emplace_back(worker);
+  }
+
+  for (size_t index = 0; index < files.size(); ++index) {
+    FileResult result;
+    {
+      std::unique_lock lock(mutex);
+      finished.wait(lock, [&] { return done[index]; });
+      result = std::move(results[index]);
+    }
+    on_done(index, result);
+  }
+}
+
 int main(int argc, char** argv) {
-  if (argc != 2) {
-    std::cerr << "enter a filename" << std::endl;
+  auto options = parse_args(argc, argv);
+  if (!options) {
+    print_usage(std::cerr);
+    return -1;
+  }
+
+  std::vector<std::string> files = collect_files(*options);
+  if (files.empty()) {
+    std::cerr << "no files to parse" << std::endl;
     return -1;
   }
 
-  std::string content = read_file(argv[1]);
+  struct Timing {
+    double seconds;
+    size_t index;
+  };
+  std::vector<Timing> timings;
+  size_t total_bytes = 0;
+  size_t failures = 0;
+  bool many = files.size() > 1;
+
+  auto start = std::chrono::steady_clock::now();
+  parse_files(files, *options, [&](size_t index, const FileResult& result) {
+    if (many && !result.output.empty()) {
+      std::cout << "== " << files[index] << std::endl;
+    }
+    std::cout << result.output;
+    std::cerr << result.errors;
+    total_bytes += result.bytes;
+    failures += result.ok ? 0 : 1;
+    timings.push_back({result.seconds, index});
+  });
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  if (many || options->summary) {
+    double seconds = std::max(elapsed.count(), 1e-9);
+    std::cerr << fmt::format(
+                     "{} files, {} failed, {} bytes in {:.3f}s "
+                     "({:.1f} files/s, {:.2f} MB/s, {} threads)",
+                     files.size(), failures, total_bytes, seconds,
+                     files.size() / seconds,
+                     total_bytes / seconds / (1024 * 1024),
+                     std::min<size_t>(options->jobs, files.size()))
+              << std::endl;
+
+    size_t slowest = std::min<size_t>(5, timings.size());
+    std::partial_sort(timings.begin(), timings.begin() + slowest,
+                      timings.end(), [](const Timing& a, const Timing& b) {
+                        return a.seconds > b.seconds;
+                      });
+    std::cerr << "slowest:" << std::endl;
+    for (size_t i = 0; i < slowest; ++i) {
+      std::cerr << fmt::format("  {:8.3f}ms  {}", timings[i].seconds * 1000,
+                               files[timings[i].index])
+                << std::endl;
+    }
+  }
 
-  ParseStyleSheet(content);
+  return failures == 0 ? 0 : 1;
 }
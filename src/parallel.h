@@ -0,0 +1,587 @@
+//
+// Copyright 2025 John R. Burkhardt
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the “Software”), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#ifndef __PARALLEL_H__
+#define __PARALLEL_H__
+
+// Parallel parsing of input that splits into independent pieces, such as
+// the blocks of a style sheet or the lines of a log.
+//
+// Pieces run as tasks on a ForkJoinPool. Every worker has its own deque of
+// tasks: it pushes and pops its own at the back and, when it runs out,
+// steals from the front of another worker's. A thread waiting for its tasks
+// to finish runs queued tasks itself, so a parallel parse inside a piece of
+// another one queues onto the same workers instead of starting more
+// threads. Once nothing is left to run or steal it sleeps until its last
+// task finishes.
+
+#include "parser.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stop_token>
+#include <thread>
+#include <vector>
+
+class ForkJoinPool {
+ public:
+  // The calling thread helps while it waits, so by default there is one
+  // worker fewer than there are cores.
+  explicit ForkJoinPool(
+      unsigned threads = std::max(1u, std::thread::hardware_concurrency()) -
+                         1)
+      : queues_(threads + 1) {
+    for (auto& queue : queues_) {
+      queue = std::make_unique<task_queue>();
+    }
+    for (unsigned i = 0; i < threads; ++i) {
+      workers_.emplace_back(
+          [this, i](std::stop_token stop) { work(i, stop); });
+    }
+  }
+
+  ~ForkJoinPool() {
+    for (auto& worker : workers_) {
+      worker.request_stop();
+    }
+    wake_.notify_all();
+  }
+
+  ForkJoinPool(const ForkJoinPool&) = delete;
+  ForkJoinPool& operator=(const ForkJoinPool&) = delete;
+
+  // The pool parse_parallel uses unless it is given another.
+  static ForkJoinPool& shared() {
+    static ForkJoinPool pool;
+    return pool;
+  }
+
+  size_t size() const { return workers_.size(); }
+
+  // Runs fn(0) ... fn(count - 1) and returns once all of them have
+  // finished. Index 0 runs on the calling thread and the rest are queued
+  // for the workers, with the caller running queued tasks until there are
+  // none left and then sleeping until its own are done. The first
+  // exception a task throws is rethrown here.
+  void run(size_t count, const std::function<void(size_t)>& fn) {
+    if (count == 0) {
+      return;
+    }
+    group tasks{.pending = count};
+    size_t self = current_queue();
+    if (count > 1) {
+      // Counted before they are queued so a thief never takes the count
+      // below zero.
+      {
+        std::lock_guard lock(sleep_mutex_);
+        queued_ += count - 1;
+      }
+      {
+        std::lock_guard lock(queues_[self]->mutex);
+        // Pushed last to first so the owner, popping from the back, runs
+        // them in order while thieves take the far end.
+        for (size_t index = count - 1; index > 0; --index) {
+          queues_[self]->tasks.push_back(
+              task{.fn = &fn, .index = index, .owner = &tasks});
+        }
+      }
+      wake_.notify_all();
+    }
+
+    execute(task{.fn = &fn, .index = 0, .owner = &tasks});
+    while (tasks.pending.load(std::memory_order_acquire) > 0 &&
+           run_one(self)) {
+    }
+    // Taken even if every task is done, so that the last one has finished
+    // with the group before it goes out of scope.
+    std::unique_lock lock(tasks.mutex);
+    tasks.finished.wait(lock, [&tasks] { return tasks.done; });
+    if (tasks.error) {
+      std::rethrow_exception(tasks.error);
+    }
+  }
+
+ private:
+  struct group {
+    std::atomic<size_t> pending;
+    std::mutex mutex;
+    std::condition_variable finished;
+    bool done = false;  // set by the last task, under mutex
+    std::exception_ptr error;
+  };
+
+  struct task {
+    const std::function<void(size_t)>* fn;
+    size_t index;
+    group* owner;
+  };
+
+  struct task_queue {
+    std::mutex mutex;
+    std::deque<task> tasks;
+  };
+
+  struct worker_id {
+    const ForkJoinPool* pool = nullptr;
+    size_t queue = 0;
+  };
+
+  static worker_id& current_worker() {
+    static thread_local worker_id id;
+    return id;
+  }
+
+  // Workers own a queue each. Threads outside the pool share the last one.
+  size_t current_queue() const {
+    const worker_id& id = current_worker();
+    return id.pool == this ? id.queue : queues_.size() - 1;
+  }
+
+  static void execute(const task& work) {
+    try {
+      (*work.fn)(work.index);
+    } catch (...) {
+      std::lock_guard lock(work.owner->mutex);
+      if (!work.owner->error) {
+        work.owner->error = std::current_exception();
+      }
+    }
+    // The last task wakes the thread in run(), which owns the group and
+    // returns once it sees done under the lock.
+    if (work.owner->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      std::lock_guard lock(work.owner->mutex);
+      work.owner->done = true;
+      work.owner->finished.notify_all();
+    }
+  }
+
+  // Runs one task from the back of queue self, or else one stolen from the
+  // front of another queue. Returns false if every queue was empty.
+  bool run_one(size_t self) {
+    std::optional<task> work;
+    {
+      std::lock_guard lock(queues_[self]->mutex);
+      if (!queues_[self]->tasks.empty()) {
+        work = queues_[self]->tasks.back();
+        queues_[self]->tasks.pop_back();
+      }
+    }
+    for (size_t i = 1; !work && i < queues_.size(); ++i) {
+      task_queue& victim = *queues_[(self + i) % queues_.size()];
+      std::lock_guard lock(victim.mutex);
+      if (!victim.tasks.empty()) {
+        work = victim.tasks.front();
+        victim.tasks.pop_front();
+      }
+    }
+    if (!work) {
+      return false;
+    }
+    queued_.fetch_sub(1, std::memory_order_relaxed);
+    execute(*work);
+    return true;
+  }
+
+  void work(size_t self, std::stop_token stop) {
+    current_worker() = worker_id{.pool = this, .queue = self};
+    while (!stop.stop_requested()) {
+      if (run_one(self)) {
+        continue;
+      }
+      std::unique_lock lock(sleep_mutex_);
+      wake_.wait(lock, stop, [this] { return queued_.load() > 0; });
+    }
+  }
+
+  std::vector<std::unique_ptr<task_queue>> queues_;
+  std::mutex sleep_mutex_;
+  std::condition_variable_any wake_;
+  std::atomic<size_t> queued_ = 0;
+  // Last, so the workers stop before the queues they use are destroyed.
+  std::vector<std::jthread> workers_;
+};
+
+// Splits input into consecutive pieces to parse separately.
+template <ParseInput Input>
+using Splitter = std::function<std::vector<Input>(Input)>;
+
+// Cuts input into pieces of about piece_size elements, each ending just
+// after a delimiter, so that a piece never stops part way through an item
+// that ends with one. The last piece takes whatever is left.
+template <typename E, ParseInput Input = detail::default_input_t<E>>
+Splitter<Input> split_after(E delimiter, size_t piece_size) {
+  piece_size = std::max<size_t>(piece_size, 1);
+  return [delimiter, piece_size](Input input) {
+    std::vector<Input> pieces;
+    const E* first = std::ranges::data(input);
+    const E* last = first + input.size();
+    const E* start = first;
+    while (start != last) {
+      const E* cut = start + std::min<size_t>(piece_size, last - start);
+      if (cut != last) {
+        cut = detail::find_element(cut - 1, last, delimiter);
+        cut = cut == last ? last : cut + 1;
+      }
+      pieces.push_back(detail::input_slice(input, start - first, cut - start));
+      start = cut;
+    }
+    return pieces;
+  };
+}
+
+namespace detail {
+// The deferred actions and recovered errors of one piece of a parallel
+// parse. Pieces run on other threads' contexts, so each records into its
+// own, which are merged into the enclosing parse's in input order.
+struct piece_state {
+  action_tape tape;
+  recovery_state recovery;
+};
+
+// Runs fn with this thread's context recording into piece, for a parse
+// whose own tape and recovery state are given (either may be null).
+template <typename F>
+void run_in_piece(piece_state& piece, action_tape* tape,
+                  recovery_state* recovery, F&& fn) {
+  parse_context& context = current_context();
+  struct restore {
+    parse_context& context;
+    parse_context saved;
+    ~restore() {
+      context.tape = saved.tape;
+      context.recovery = saved.recovery;
+    }
+  } guard{.context = context, .saved = context};
+  context.tape = tape ? &piece.tape : nullptr;
+  context.recovery = nullptr;
+  if (recovery) {
+    piece.recovery.document = recovery->document;
+    context.recovery = &piece.recovery;
+  }
+  fn();
+}
+
+void merge_diagnostics(piece_state& piece, recovery_state* recovery) {
+  if (recovery) {
+    auto& diagnostics = piece.recovery.diagnostics;
+    recovery->diagnostics.insert(recovery->diagnostics.end(),
+                                 diagnostics.begin(), diagnostics.end());
+  }
+}
+
+// Applies match to each piece split finds in input, as tasks on pool, and
+// passes the values to keep in input order. Yields where the last piece
+// ended, or the first failing piece's error.
+template <ParseInput Input, typename M, typename K>
+ParseResult<unit, Input> match_pieces(Input input,
+                                      const Splitter<Input>& split,
+                                      ForkJoinPool* pool, const M& match,
+                                      K&& keep) {
+  using Result = std::invoke_result_t<const M&, Input>;
+  std::vector<Input> pieces = split(input);
+  size_t count = pieces.size();
+
+  action_tape* tape = current_tape();
+  recovery_state* recovery = current_recovery();
+  std::vector<piece_state> states(count);
+  std::vector<Result> results(count);
+  (pool ? *pool : ForkJoinPool::shared()).run(count, [&](size_t index) {
+    run_in_piece(states[index], tape, recovery,
+                 [&] { results[index] = match(pieces[index]); });
+  });
+
+  for (size_t index = 0; index < count; ++index) {
+    merge_diagnostics(states[index], recovery);
+    auto& result = results[index];
+    if (!result) {
+      return empty_parse_result<unit>(result.input, result.error);
+    }
+    if (!result.input.empty()) {
+      return empty_parse_result<unit>(result.input,
+                                      "Error: piece not parsed to its end");
+    }
+    keep(std::move(result.value()));
+  }
+  if (tape) {
+    for (auto& state : states) {
+      tape->append(state.tape);
+    }
+  }
+
+  size_t consumed = count == 0
+                        ? 0
+                        : std::ranges::data(pieces.back()) +
+                              pieces.back().size() - std::ranges::data(input);
+  return make_parse_result(unit{}, input_slice(input, consumed));
+}
+}  // namespace detail
+
+// Parses each piece split finds in the input with parser, as tasks on pool
+// (the shared pool if null), and yields the values in input order. Every
+// piece must be parsed to its end. Deferred actions and recovered errors
+// from the pieces are added, in order, to those of the enclosing parse.
+// Fails with the first failing piece's error.
+template <typename T, ParseInput Input>
+Parser<std::vector<T>, Input> parse_parallel(
+    const Parser<T, Input>& parser, std::type_identity_t<Splitter<Input>> split,
+    ForkJoinPool* pool = nullptr) {
+  return Parser<std::vector<T>, Input>(
+      [parser, split, pool](Input input) {
+        std::vector<T> values;
+        auto matched = detail::match_pieces(
+            input, split, pool, parser,
+            [&values](T&& value) { values.push_back(std::move(value)); });
+        if (!matched) {
+          return empty_parse_result<std::vector<T>>(matched.input,
+                                                    matched.error);
+        }
+        return make_parse_result(std::move(values), matched.input);
+      },
+      [parser, split, pool](Input input) {
+        return detail::match_pieces(
+            input, split, pool,
+            [&parser](Input piece) { return parser.check(piece); },
+            [](unit) {});
+      });
+}
+
+// The piece size the parallel list parsers below split their input into by
+// default.
+constexpr size_t kDefaultPieceSize = 1 << 16;
+
+namespace detail {
+// The items of a parse_delimited_by_parallel parsed from one place.
+template <typename T, ParseInput Input>
+struct item_run {
+  std::vector<T> values;
+  Input rest;
+  // Whether the items reached the end of the piece, rather than stopping at
+  // one that failed.
+  bool complete = false;
+  piece_state state;
+};
+
+// Parses items, each followed by delimiter, from input until one fails or
+// the next would start at or past end. Items see all of the input after
+// them, not just up to end, so one that runs past the piece is parsed
+// whole.
+template <typename T, ParseInput Input, typename E>
+void parse_items(const Parser<T, Input>& parser, const E& delimiter,
+                 Input input, const E* end, item_run<T, Input>& run) {
+  run.rest = input;
+  while (std::ranges::data(run.rest) < end) {
+    backtrack_mark mark = mark_backtrack();
+    auto result = parser(run.rest);
+    if (!result || result.input.empty() ||
+        !(*std::ranges::begin(result.input) == delimiter)) {
+      backtrack(mark);
+      return;
+    }
+    run.values.push_back(std::move(result.value()));
+    run.rest = input_slice(result.input, 1);
+  }
+  run.complete = true;
+}
+
+// Parses the list from input as described for parse_delimited_by_parallel
+// below.
+template <typename T, typename E, typename S, ParseInput Input>
+ParseResult<std::vector<T>, Input> parse_delimited_pieces(
+    Input input, const Parser<T, Input>& parser, const E& delimiter,
+    const Parser<S, Input>& terminator, const Splitter<Input>& split,
+    ForkJoinPool* pool) {
+  using Run = item_run<T, Input>;
+  std::vector<Input> pieces = split(input);
+  size_t count = pieces.size();
+  const E* first = std::ranges::data(input);
+  auto end_of = [](const Input& piece) {
+    return std::ranges::data(piece) + piece.size();
+  };
+
+  action_tape* tape = current_tape();
+  recovery_state* recovery = current_recovery();
+  std::vector<Run> runs(count);
+  (pool ? *pool : ForkJoinPool::shared()).run(count, [&](size_t index) {
+    Input from = input_slice(input, std::ranges::data(pieces[index]) - first);
+    run_in_piece(runs[index].state, tape, recovery, [&] {
+      parse_items(parser, delimiter, from, end_of(pieces[index]), runs[index]);
+    });
+  });
+
+  std::vector<T> values;
+  Input rest = input;
+  for (size_t index = 0; index < count; ++index) {
+    const E* end = end_of(pieces[index]);
+    if (std::ranges::data(rest) >= end) {
+      // An item ran over the whole piece.
+      continue;
+    }
+    Run& run = runs[index];
+    if (std::ranges::data(pieces[index]) != std::ranges::data(rest)) {
+      // The piece was cut inside an item. Its actions are dropped but
+      // counted.
+      if (tape) {
+        run.state.tape.rewind(0);
+        tape->append(run.state.tape);
+      }
+      run = Run();
+      run_in_piece(run.state, tape, recovery,
+                   [&] { parse_items(parser, delimiter, rest, end, run); });
+    }
+    merge_diagnostics(run.state, recovery);
+    if (tape) {
+      tape->append(run.state.tape);
+    }
+    values.insert(values.end(), std::make_move_iterator(run.values.begin()),
+                  std::make_move_iterator(run.values.end()));
+    rest = run.rest;
+    if (!run.complete) {
+      break;
+    }
+  }
+
+  // The last item, which has no delimiter after it.
+  auto last = parser(rest);
+  if (!last) {
+    return empty_parse_result<std::vector<T>>(rest, last.error);
+  }
+  auto term = terminator.check(last.input);
+  if (!term) {
+    return empty_parse_result<std::vector<T>>(term.input, term.error);
+  }
+  values.push_back(std::move(last.value()));
+  return make_parse_result(std::move(values), last.input);
+}
+
+// Applies match to every line of piece and passes the values to keep.
+template <ParseInput Input, typename M, typename K>
+ParseResult<unit, Input> match_lines(Input piece, const M& match, K&& keep) {
+  using E = std::ranges::range_value_t<Input>;
+  const E* first = std::ranges::data(piece);
+  const E* last = first + piece.size();
+  for (const E* start = first; start != last;) {
+    const E* end = find_element(start, last, E('\n'));
+    auto result = match(input_slice(piece, start - first, end - start));
+    if (!result) {
+      return empty_parse_result<unit>(result.input, result.error);
+    }
+    if (!result.input.empty()) {
+      return empty_parse_result<unit>(result.input,
+                                      "Error: line not parsed to its end");
+    }
+    keep(std::move(result.value()));
+    start = end == last ? last : end + 1;
+  }
+  return make_parse_result(unit{}, input_slice(piece, piece.size()));
+}
+}  // namespace detail
+
+// Parses the same list as parse_delimited_by(parser, delimiter, terminator)
+// with the delimiter a single element, splitting it into pieces of about
+// piece_size elements parsed as tasks on pool (the shared pool if null).
+// Yields the items in input order.
+//
+// Pieces are cut just after a delimiter found by scanning for it, which
+// only guesses at where items end: the delimiter may be inside an item,
+// e.g. a quoted string. So each piece is parsed from its guess, and then
+// the pieces are checked in order. A piece is kept only if the items before
+// it ended exactly where it starts. Otherwise it is parsed again from where
+// they did end. The result, including errors and their positions, is the
+// same as a single-threaded parse.
+template <typename T, typename E, typename S, ParseInput Input>
+Parser<std::vector<T>, Input> parse_delimited_by_parallel(
+    const Parser<T, Input>& parser, E delimiter,
+    const Parser<S, Input>& terminator,
+    size_t piece_size = kDefaultPieceSize, ForkJoinPool* pool = nullptr) {
+  static_assert(std::is_same_v<std::ranges::range_value_t<Input>, E>);
+  Splitter<Input> split = split_after(delimiter, piece_size);
+  // Checks the same way, with items that have no value.
+  Parser<unit, Input> items(
+      [parser](Input input) { return parser.check(input); });
+  return Parser<std::vector<T>, Input>(
+      [parser, delimiter, terminator, split, pool](Input input) {
+        return detail::parse_delimited_pieces(input, parser, delimiter,
+                                              terminator, split, pool);
+      },
+      [items, delimiter, terminator, split, pool](Input input) {
+        return detail::outcome(detail::parse_delimited_pieces(
+            input, items, delimiter, terminator, split, pool));
+      });
+}
+
+// Parses input made of lines, each of which parser must parse to its end,
+// as pieces of about piece_size elements on pool (the shared pool if null),
+// and yields the values in input order. A final newline doesn't start an
+// empty line. Any newline ends a line, so unlike the delimited lists above
+// the pieces need no checking; records such as JSON texts can't have a raw
+// newline inside them.
+template <typename T, ParseInput Input>
+Parser<std::vector<T>, Input> parse_lines_parallel(
+    const Parser<T, Input>& parser, size_t piece_size = kDefaultPieceSize,
+    ForkJoinPool* pool = nullptr) {
+  using E = std::ranges::range_value_t<Input>;
+  Splitter<Input> split = split_after(E('\n'), piece_size);
+  return Parser<std::vector<T>, Input>(
+      [parser, split, pool](Input input) {
+        auto parse_lines = [&parser](Input piece) {
+          std::vector<T> values;
+          auto matched =
+              detail::match_lines(piece, parser, [&values](T&& value) {
+                values.push_back(std::move(value));
+              });
+          if (!matched) {
+            return empty_parse_result<std::vector<T>>(matched.input,
+                                                      matched.error);
+          }
+          return make_parse_result(std::move(values), matched.input);
+        };
+        std::vector<T> values;
+        auto keep = [&values](std::vector<T>&& piece) {
+          values.insert(values.end(), std::make_move_iterator(piece.begin()),
+                        std::make_move_iterator(piece.end()));
+        };
+        auto matched =
+            detail::match_pieces(input, split, pool, parse_lines, keep);
+        if (!matched) {
+          return empty_parse_result<std::vector<T>>(matched.input,
+                                                    matched.error);
+        }
+        return make_parse_result(std::move(values), matched.input);
+      },
+      [parser, split, pool](Input input) {
+        auto check_lines = [&parser](Input piece) {
+          return detail::match_lines(
+              piece, [&parser](Input line) { return parser.check(line); },
+              [](unit) {});
+        };
+        return detail::match_pieces(input, split, pool, check_lines,
+                                    [](unit) {});
+      });
+}
+
+#endif  // __PARALLEL_H__
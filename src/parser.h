@@ -25,60 +25,274 @@
 
 #include <fmt/format.h>
 #include <assert.h>
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <charconv>
+#include <concepts>
+#include <coroutine>
+#include <cstdint>
+#include <cstring>
+#include <exception>
 #include <functional>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
+#include <ranges>
+#include <shared_mutex>
+#include <span>
 #include <string>
 #include <string_view>
+#include <type_traits>
+#include <utility>
 #include <variant>
 #include <vector>
+#include <version>
+#if __has_include(<generator>)
+#include <generator>
+#endif
+#if __has_include(<ucontext.h>)
+#include <ucontext.h>
+#endif
+
+// ThreadSanitizer has to be told when the stack is switched.
+#if defined(__SANITIZE_THREAD__)
+#define MPARSE_TSAN 1
+#elif defined(__has_feature)
+#if __has_feature(thread_sanitizer)
+#define MPARSE_TSAN 1
+#endif
+#endif
+#if defined(MPARSE_TSAN)
+#include <sanitizer/tsan_interface.h>
+#endif
 
 using unit = std::monostate;
 
-template <class T>
+// Parsers run over a std::string_view of chars by default. Input can be any
+// view of contiguous elements that can be rebuilt from a pointer and a
+// length: std::u16string_view, a std::span of bytes or of tokens from a
+// lexer, or a user-defined view. The combinators that only move through the
+// input (and_then, or_else, parse_some, parse_fold, ...) work the same way
+// over any of them.
+template <class I>
+concept ParseInput =
+    std::ranges::view<I> && std::ranges::contiguous_range<I> &&
+    std::ranges::sized_range<I> && std::copyable<I> &&
+    std::constructible_from<I, const std::ranges::range_value_t<I>*,
+                            size_t>;
+
+template <class T, ParseInput Input = std::string_view>
 class Parser;
-template <class T>
-struct ParseResult {
-  std::optional<T> result;
-  std::string_view input;
-  std::string error;
+namespace detail {
+struct error_message {
+  std::atomic<size_t> refs;
+  std::string text;
+};
+}  // namespace detail
+
+// Why a parse failed. The message is kept out of line and shared by
+// copies, so it costs a result one pointer, which is null on success.
+class ParseError {
+ public:
+  ParseError() = default;
+  ParseError(std::string message)
+      : message_(new detail::error_message{.refs = 1,
+                                           .text = std::move(message)}) {}
+  ParseError(std::string_view message) : ParseError(std::string(message)) {}
+  ParseError(const char* message) : ParseError(std::string(message)) {}
+
+  ParseError(const ParseError& other) : message_(other.message_) {
+    if (message_) {
+      message_->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  ParseError(ParseError&& other) noexcept
+      : message_(std::exchange(other.message_, nullptr)) {}
+  ParseError& operator=(ParseError other) noexcept {
+    std::swap(message_, other.message_);
+    return *this;
+  }
+  ~ParseError() {
+    if (message_ &&
+        message_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      delete message_;
+    }
+  }
+
+  explicit operator bool() const { return message_ != nullptr; }
+
+  std::string_view message() const {
+    return message_ ? std::string_view(message_->text) : std::string_view();
+  }
+  operator std::string_view() const { return message(); }
+  operator std::string() const { return std::string(message()); }
+
+  friend bool operator==(const ParseError& error, std::string_view text) {
+    return error.message() == text;
+  }
+
+ private:
+  detail::error_message* message_ = nullptr;
+};
+
+std::ostream& operator<<(std::ostream& out, const ParseError& error) {
+  return out << error.message();
+}
+
+template <>
+struct fmt::formatter<ParseError> : fmt::formatter<std::string_view> {
+  auto format(const ParseError& error, format_context& ctx) const {
+    return fmt::formatter<std::string_view>::format(error.message(), ctx);
+  }
+};
+
+// The outcome of applying a parser: on success a value and the input left
+// after it, on failure the error and where it happened. Success is encoded
+// by the error being empty, so there is no separate flag, and the value is
+// only constructed when there is one.
+template <class T, ParseInput Input = std::string_view>
+class ParseResult {
+ public:
+  Input input;
+  ParseError error;
+
+  // A failure with a placeholder message, for filling containers of
+  // results.
+  ParseResult() : error("Error: no result") {}
 
-  operator bool() const { return result.has_value(); }
-  bool operator!() const { return !result.has_value(); }
-  bool has_value() const { return result.has_value(); }
-  T& value() { return *result; }
-  const T& value() const { return *result; }
+  static ParseResult success(T value, Input remaining) {
+    ParseResult result(remaining, ParseError());
+    std::construct_at(&result.value_, std::move(value));
+    return result;
+  }
+
+  static ParseResult failure(Input at, ParseError error) {
+    if (!error) {
+      error = ParseError(std::string());
+    }
+    return ParseResult(at, std::move(error));
+  }
+
+  ParseResult(const ParseResult& other)
+      : input(other.input), error(other.error) {
+    if (!error) {
+      std::construct_at(&value_, other.value_);
+    }
+  }
+  ParseResult(ParseResult&& other) noexcept(
+      std::is_nothrow_move_constructible_v<T>)
+      : input(other.input), error(other.error) {
+    if (!error) {
+      std::construct_at(&value_, std::move(other.value_));
+    }
+  }
+  ParseResult& operator=(const ParseResult& other) {
+    if (this != &other) {
+      assign(other);
+    }
+    return *this;
+  }
+  ParseResult& operator=(ParseResult&& other) noexcept(
+      std::is_nothrow_move_constructible_v<T> &&
+      std::is_nothrow_move_assignable_v<T>) {
+    if (this != &other) {
+      assign(std::move(other));
+    }
+    return *this;
+  }
+  ~ParseResult() {
+    if (!error) {
+      std::destroy_at(&value_);
+    }
+  }
+
+  operator bool() const { return !error; }
+  bool operator!() const { return static_cast<bool>(error); }
+  bool has_value() const { return !error; }
+  T& value() {
+    assert(has_value());
+    return value_;
+  }
+  const T& value() const {
+    assert(has_value());
+    return value_;
+  }
+
+ private:
+  ParseResult(Input at, ParseError error)
+      : input(at), error(std::move(error)) {}
+
+  // Takes on the state of other. The value is assigned when both hold one
+  // and only constructed or destroyed when that changes, and the error is
+  // set last, so if T's constructor or assignment throws *this is still a
+  // valid result.
+  template <typename R>
+  void assign(R&& other) {
+    ParseError other_error = other.error;
+    if (!other_error) {
+      if (!error) {
+        value_ = std::forward<R>(other).value_;
+      } else {
+        std::construct_at(&value_, std::forward<R>(other).value_);
+      }
+    } else if (!error) {
+      std::destroy_at(&value_);
+    }
+    input = other.input;
+    error = std::move(other_error);
+  }
+
+  union {
+    T value_;
+  };
 };
 
 // Helper functions for constructing ParseResults
-template <typename T>
-ParseResult<T> make_parse_result(T value, std::string_view remaining) {
-  return ParseResult<T>{.result = std::move(value), .input = remaining};
+template <typename T, typename Input>
+ParseResult<T, Input> make_parse_result(T value, Input remaining) {
+  return ParseResult<T, Input>::success(std::move(value), remaining);
 }
 
-template <typename T>
-ParseResult<T> empty_parse_result(std::string_view input,
-                                  const std::string& error) {
-  return ParseResult<T>{.result = std::nullopt, .input = input, .error = error};
+template <typename T, typename Input>
+ParseResult<T, Input> empty_parse_result(Input input, ParseError error) {
+  return ParseResult<T, Input>::failure(input, std::move(error));
 }
 
 namespace detail {
 template <typename T>
 struct parser_impl {
-  template <typename U>
-  static auto skip(const Parser<T>& parser, const Parser<U>& next) {
-    return Parser<T>([parser, next](std::string_view input) {
-      auto result = parser(input);
-      if (!result) {
-        return empty_parse_result<T>(input, result.error);
-      }
-      auto next_result = next(result.input);
-      if (!next_result) {
-        return empty_parse_result<T>(result.input, next_result.error);
-      }
-      return make_parse_result(result.value(), next_result.input);
-    });
+  template <typename U, typename Input>
+  static auto skip(const Parser<T, Input>& parser,
+                   const Parser<U, Input>& next) {
+    return Parser<T, Input>(
+        [parser, next](Input input) {
+          auto result = parser(input);
+          if (!result) {
+            return empty_parse_result<T>(input, result.error);
+          }
+          auto next_result = next(result.input);
+          if (!next_result) {
+            return empty_parse_result<T>(result.input, next_result.error);
+          }
+          return make_parse_result(std::move(result.value()),
+                                   next_result.input);
+        },
+        [parser, next](Input input) {
+          auto result = parser.check(input);
+          if (!result) {
+            return empty_parse_result<unit>(input, result.error);
+          }
+          auto next_result = next.check(result.input);
+          if (!next_result) {
+            return empty_parse_result<unit>(result.input, next_result.error);
+          }
+          return next_result;
+        });
   }
 };
 
@@ -101,100 +315,417 @@ using result_vector_t =
 
 }  // namespace detail
 
-// Some declarations needed inside the Parser class implementation.
-template <class T>
-class Parser;
+// The value of an action run by transform_deferred. It is set once the
+// action has run; copies share it.
+template <typename T>
+class Deferred {
+ public:
+  Deferred() : value_(std::make_shared<std::optional<T>>()) {}
+
+  bool ready() const { return value_->has_value(); }
+
+  const T& get() const {
+    assert(ready());
+    return **value_;
+  }
 
+  // Called by the action.
+  void set(T value) { *value_ = std::move(value); }
+
+ private:
+  std::shared_ptr<std::optional<T>> value_;
+};
+
+// Some declarations needed inside the Parser class implementation.
 Parser<unit> parse_opt_ws();
 Parser<unit> parse_ws();
 
-template <class T>
+// Per-call state.
+//
+// Parsers are never written to while they run, so one grammar can be shared
+// by any number of threads parsing at the same time. Whatever a parse does
+// change as it goes (its nesting depth, the action tape of
+// parse_with_actions, the diagnostics of a RecoveryScope) lives in the
+// parse_context of the thread running it. Entry points install their state
+// on the context for the length of the call and restore what was there
+// before, so parses on one thread nest and parses on different threads
+// never see each other.
+
+namespace detail {
+class action_tape;
+struct recovery_state;
+
+struct recursion_state {
+  size_t depth = 0;
+  uintptr_t stack_base = 0;
+  size_t stack_budget = 0;
+};
+
+struct parse_context {
+  recursion_state recursion;
+  action_tape* tape = nullptr;
+  recovery_state* recovery = nullptr;
+};
+
+parse_context& current_context() {
+  static thread_local parse_context context;
+  return context;
+}
+
+// What an alternative may leave behind, taken before it is tried: where
+// the tape of the current parse_with_actions ended and how many diagnostics
+// the current RecoveryScope held. backtrack drops the alternative's actions
+// and recovered errors if it is abandoned.
+struct backtrack_mark {
+  action_tape* tape;
+  size_t size;
+  recovery_state* recovery;
+  size_t diagnostics;
+};
+
+backtrack_mark mark_backtrack();
+void backtrack(const backtrack_mark& mark);
+void record_or_run(std::function<void()> action);
+
+size_t& nodes_constructed() {
+  static thread_local size_t count = 0;
+  return count;
+}
+
+// The outcome of a parse without its value.
+template <typename T, typename Input>
+ParseResult<unit, Input> outcome(const ParseResult<T, Input>& result) {
+  if (!result) {
+    return empty_parse_result<unit>(result.input, result.error);
+  }
+  return make_parse_result(unit{}, result.input);
+}
+
+// A grammar node. The closure is stored inline after the pointers to the
+// functions that call it, so building a node is a single allocation
+// whatever the size of its captures, and calling one is a single indirect
+// call without std::function's extra layer.
+//
+// check matches the same input as call without building a value. Nodes
+// that build values out of other parsers' (transforms, folds, containers)
+// give it a closure of its own that checks their children instead; for the
+// rest it calls the parse closure and drops the value.
+template <typename T, typename Input>
+struct parse_node {
+  using Call = ParseResult<T, Input> (*)(const parse_node*, Input);
+  using Check = ParseResult<unit, Input> (*)(const parse_node*, Input);
+  Call call;
+  Check check;
+};
+
+// The check closure of nodes that only have a parse closure.
+struct parse_and_drop {};
+
+template <typename T, typename Input, typename F, typename C = parse_and_drop>
+struct closure_node : parse_node<T, Input> {
+  closure_node(F f, C c)
+      : parse_node<T, Input>{&closure_node::invoke, &closure_node::recognize},
+        fn(std::move(f)),
+        recognizer(std::move(c)) {}
+
+  static ParseResult<T, Input> invoke(const parse_node<T, Input>* node,
+                                      Input input) {
+    return static_cast<const closure_node*>(node)->fn(input);
+  }
+
+  static ParseResult<unit, Input> recognize(const parse_node<T, Input>* node,
+                                            Input input) {
+    const auto* self = static_cast<const closure_node*>(node);
+    if constexpr (std::is_same_v<C, parse_and_drop>) {
+      return outcome(self->fn(input));
+    } else {
+      return self->recognizer(input);
+    }
+  }
+
+  F fn;
+  [[no_unique_address]] C recognizer;
+};
+
+// Continuations cached by and_then_cached are keyed by value. Views of
+// chars are keyed by a copy of their text, since the input they point into
+// doesn't outlive the parse.
+template <typename T>
+using cache_key_t =
+    std::conditional_t<std::is_convertible_v<T, std::string_view>,
+                       std::string, T>;
+}  // namespace detail
+
+// The number of grammar nodes constructed on this thread so far. Sampling
+// it around a parse shows whether the grammar builds parsers while parsing;
+// in steady state it shouldn't.
+size_t parser_nodes_constructed() { return detail::nodes_constructed(); }
+
+// A parser is an immutable node of the grammar graph. Copies share the
+// node, so a parser used in many places is stored once however many
+// combinators capture it. Once built, a parser and its copies can be called
+// concurrently from any number of threads; closures passed to combinators
+// must be safe to call concurrently too.
+template <class T, ParseInput Input>
 class Parser {
  public:
   using value_type = T;
-  using Parse = std::function<ParseResult<T>(std::string_view)>;
+  using input_type = Input;
+  using Parse = std::function<ParseResult<T, Input>(Input)>;
 
-  Parser(Parse parse) : parse_(parse) {}
+  // fn is called as a const function, possibly from several threads.
+  template <typename F>
+    requires(!std::is_same_v<std::remove_cvref_t<F>, Parser> &&
+             std::is_invocable_r_v<ParseResult<T, Input>, const F&, Input>)
+  Parser(F fn)
+      : node_(std::make_shared<const detail::closure_node<T, Input, F>>(
+            std::move(fn), detail::parse_and_drop{})) {
+    ++detail::nodes_constructed();
+  }
 
-  ParseResult<T> operator()(std::string_view input) const {
-    return parse_(input);
+  // check must accept exactly the input fn does, failing at the same place
+  // with the same error, but without building the value.
+  template <typename F, typename C>
+    requires(std::is_invocable_r_v<ParseResult<T, Input>, const F&, Input> &&
+             std::is_invocable_r_v<ParseResult<unit, Input>, const C&, Input>)
+  Parser(F fn, C check)
+      : node_(std::make_shared<const detail::closure_node<T, Input, F, C>>(
+            std::move(fn), std::move(check))) {
+    ++detail::nodes_constructed();
   }
 
-  Parser<T> or_else(Parser<T> parser) const {
-    Parse self = parse_;
-    return Parser<T>([self, parser](std::string_view input) {
-      auto result = self(input);
-      if (!result) {
-        return parser(input);
-      }
-      return result;
-    });
+  ParseResult<T, Input> operator()(Input input) const {
+    return node_->call(node_.get(), input);
+  }
+
+  // Matches like operator() but only yields where the match ended, or the
+  // error. See recognize.
+  ParseResult<unit, Input> check(Input input) const {
+    return node_->check(node_.get(), input);
+  }
+
+  // Identifies the shared node, e.g. to key memo tables on parsers. Copies
+  // have the same id.
+  const void* id() const { return node_.get(); }
+
+  Parser<T, Input> or_else(Parser<T, Input> parser) const {
+    Parser self = *this;
+    return Parser<T, Input>(
+        [self, parser](Input input) {
+          detail::backtrack_mark mark = detail::mark_backtrack();
+          auto result = self(input);
+          if (!result) {
+            detail::backtrack(mark);
+            return parser(input);
+          }
+          return result;
+        },
+        [self, parser](Input input) {
+          detail::backtrack_mark mark = detail::mark_backtrack();
+          auto result = self.check(input);
+          if (!result) {
+            detail::backtrack(mark);
+            return parser.check(input);
+          }
+          return result;
+        });
   }
 
   // fn is a function from T to a Parser<U>
   template <typename F>
     requires(!std::is_base_of_v<
-             Parser<typename std::invoke_result_t<F, T>::value_type>, F>)
+             Parser<typename std::invoke_result_t<F, T>::value_type, Input>,
+             F>)
   auto and_then(F&& fn) const {
     using ReturnParser = std::invoke_result_t<F, T>;
     using U = typename ReturnParser::value_type;  // Extract U from Parser<U>
-    Parser self = parse_;
-    return Parser<U>([self, fn](std::string_view input) {
-      auto result = self(input);
-      if (!result) {
-        return empty_parse_result<U>(input, result.error);
+    Parser self = *this;
+    // The value is needed to pick the next parser, so only that one is
+    // checked.
+    return Parser<U, Input>(
+        [self, fn](Input input) {
+          auto result = self(input);
+          if (!result) {
+            return empty_parse_result<U>(input, result.error);
+          }
+          ReturnParser then_parser = fn(result.value());
+          return then_parser(result.input);
+        },
+        [self, fn](Input input) {
+          auto result = self(input);
+          if (!result) {
+            return empty_parse_result<unit>(input, result.error);
+          }
+          ReturnParser then_parser = fn(result.value());
+          return then_parser.check(result.input);
+        });
+  }
+
+  // Like and_then, but the parser fn returns for a value is kept and reused
+  // whenever this parser yields an equal value again, so fn runs once per
+  // distinct value rather than once per match. Since it is reused on later
+  // inputs, the returned parser must not refer to the value's view of the
+  // input. T must be ordered. The cache is shared by threads, which only
+  // lock it exclusively to add a parser.
+  template <typename F>
+  auto and_then_cached(F&& fn) const {
+    using ReturnParser = std::invoke_result_t<F, T>;
+    using U = typename ReturnParser::value_type;
+    using Key = detail::cache_key_t<T>;
+    struct cache {
+      std::shared_mutex mutex;
+      std::map<Key, ReturnParser, std::less<>> parsers;
+    };
+    auto parsers = std::make_shared<cache>();
+    auto continuation = [fn, parsers](const T& value) {
+      const auto& key = [&]() -> decltype(auto) {
+        if constexpr (std::is_same_v<Key, std::string>) {
+          return std::string_view(value);
+        } else {
+          return value;
+        }
+      }();
+      {
+        std::shared_lock lock(parsers->mutex);
+        auto it = parsers->parsers.find(key);
+        if (it != parsers->parsers.end()) {
+          return it->second;
+        }
       }
-      ReturnParser then_parser = fn(result.value());
-      return then_parser(result.input);
-    });
+      ReturnParser then_parser = fn(value);
+      std::lock_guard lock(parsers->mutex);
+      parsers->parsers.emplace(Key(key), then_parser);
+      return then_parser;
+    };
+    Parser self = *this;
+    return Parser<U, Input>(
+        [self, continuation](Input input) {
+          auto result = self(input);
+          if (!result) {
+            return empty_parse_result<U>(input, result.error);
+          }
+          return continuation(result.value())(result.input);
+        },
+        [self, continuation](Input input) {
+          auto result = self(input);
+          if (!result) {
+            return empty_parse_result<unit>(input, result.error);
+          }
+          return continuation(result.value()).check(result.input);
+        });
   }
 
   template <typename U>
-  auto and_then(const Parser<U>& next) const {
-    Parser self = parse_;
-    return Parser<U>([self, next](std::string_view input) {
-      auto result = self(input);
-      if (!result) {
-        return empty_parse_result<U>(input, result.error);
-      }
-      return next(result.input);
-    });
+  auto and_then(const Parser<U, Input>& next) const {
+    Parser self = *this;
+    return Parser<U, Input>(
+        [self, next](Input input) {
+          auto result = self(input);
+          if (!result) {
+            return empty_parse_result<U>(input, result.error);
+          }
+          return next(result.input);
+        },
+        [self, next](Input input) {
+          auto result = self.check(input);
+          if (!result) {
+            return empty_parse_result<unit>(input, result.error);
+          }
+          return next.check(result.input);
+        });
   }
 
   template <typename U>
-  Parser<T> and_not(const Parser<U>& next) const {
-    Parser self = parse_;
-    return Parser<T>([self, next](std::string_view input) {
-      auto result = self(input);
-      if (!result) {
-        return empty_parse_result<T>(input, result.error);
-      }
-      auto next_result = next(result.input);
-      if (next_result) {
-        return empty_parse_result<T>(
-            input,
-            fmt::format("Expected failure but parsed {}", next_result.value()));
-      }
-      return result;
-    });
+  Parser<T, Input> and_not(const Parser<U, Input>& next) const {
+    Parser self = *this;
+    return Parser<T, Input>(
+        [self, next](Input input) {
+          auto result = self(input);
+          if (!result) {
+            return empty_parse_result<T>(input, result.error);
+          }
+          detail::backtrack_mark mark = detail::mark_backtrack();
+          auto next_result = next(result.input);
+          if (next_result) {
+            return empty_parse_result<T>(
+                input, fmt::format("Expected failure but parsed {}",
+                                   next_result.value()));
+          }
+          detail::backtrack(mark);
+          return result;
+        },
+        [self, next](Input input) {
+          auto result = self.check(input);
+          if (!result) {
+            return result;
+          }
+          detail::backtrack_mark mark = detail::mark_backtrack();
+          if (next.check(result.input)) {
+            // Parsed again only for the value in the message.
+            return empty_parse_result<unit>(
+                input, fmt::format("Expected failure but parsed {}",
+                                   next(result.input).value()));
+          }
+          detail::backtrack(mark);
+          return result;
+        });
   }
 
   template <typename U>
-  auto skip(const Parser<U>& next) const {
+  auto skip(const Parser<U, Input>& next) const {
     return detail::parser_impl<T>::skip(*this, next);
   }
 
   template <typename F>
   auto transform(F&& fn) const {
     using U = std::invoke_result_t<F, T>;
-    Parser self = parse_;
-    return Parser<U>([self, fn](std::string_view input) {
-      auto result = self(input);
-      if (!result) {
-        return empty_parse_result<U>(input, result.error);
-      }
-      return make_parse_result<U>(fn(result.value()), result.input);
-    });
+    Parser self = *this;
+    return Parser<U, Input>(
+        [self, fn](Input input) {
+          auto result = self(input);
+          if (!result) {
+            return empty_parse_result<U>(input, result.error);
+          }
+          return make_parse_result<U>(fn(std::move(result.value())),
+                                      result.input);
+        },
+        [self](Input input) {
+          auto result = self.check(input);
+          if (!result) {
+            return empty_parse_result<unit>(input, result.error);
+          }
+          return result;
+        });
+  }
+
+  // Like transform, but inside parse_with_actions fn only runs once the
+  // whole parse has succeeded, so no work is spent on values from
+  // alternatives that are later abandoned. The value is available from the
+  // Deferred after that. Outside parse_with_actions fn runs immediately.
+  template <typename F>
+  auto transform_deferred(F&& fn) const {
+    using U = std::invoke_result_t<F, T>;
+    Parser self = *this;
+    return Parser<Deferred<U>, Input>(
+        [self, fn](Input input) {
+          auto result = self(input);
+          if (!result) {
+            return empty_parse_result<Deferred<U>>(input, result.error);
+          }
+          Deferred<U> deferred;
+          detail::record_or_run(
+              [deferred, fn, value = std::move(result.value())]() mutable {
+                deferred.set(fn(value));
+              });
+          return make_parse_result(std::move(deferred), result.input);
+        },
+        [self](Input input) {
+          auto result = self.check(input);
+          if (!result) {
+            return empty_parse_result<unit>(input, result.error);
+          }
+          return result;
+        });
   }
 
   template <typename U>
@@ -202,21 +733,39 @@ class Parser {
     return transform([value](auto&&) -> U { return value; });
   }
 
-  auto trim() { return parse_opt_ws().and_then(*this).skip(parse_opt_ws()); }
+  auto trim() const {
+    return parse_opt_ws().and_then(*this).skip(parse_opt_ws());
+  }
+
+  // See parse_span.
+  auto span() const { return parse_span(*this); }
 
  private:
-  Parse parse_;
+  std::shared_ptr<const detail::parse_node<T, Input>> node_;
 };
 
+// Matches parser against input for validation, without building its value.
+// Combinators that compute values out of other parsers' (transforms, folds,
+// the containers of parse_some and parse_delimited_by) only check their
+// children, and deferred actions aren't recorded; only a parser that and_then
+// picks from a value is given it. Yields where the match ended, or the same
+// error the parse would have failed with.
+template <typename T, typename Input>
+ParseResult<unit, Input> recognize(const Parser<T, Input>& parser,
+                                   std::type_identity_t<Input> input) {
+  return parser.check(input);
+}
+
 using StringParser = Parser<std::string_view>;
 
 namespace detail {
 template <>
 struct parser_impl<std::string_view> {
   // When skipping over input the result becomes discontinuous
-  template <typename U>
-  static auto skip(const StringParser& parser, const Parser<U>& next) {
-    Parser<detail::discontinuous_string_view> to_dc = parser.transform(
+  template <typename U, typename Input>
+  static auto skip(const Parser<std::string_view, Input>& parser,
+                   const Parser<U, Input>& next) {
+    Parser<detail::discontinuous_string_view, Input> to_dc = parser.transform(
         [](auto value) { return detail::discontinuous_string_view(value); });
     return to_dc.skip(next);
   }
@@ -230,16 +779,16 @@ Parser<detail::discontinuous_string_view> to_discontinuous(
 
 }  // namespace detail
 
-template <typename T>
-Parser<T> parse_never() {
-  return Parser<T>([](std::string_view input) {
+template <typename T, typename Input = std::string_view>
+Parser<T, Input> parse_never() {
+  return Parser<T, Input>([](Input input) {
     return empty_parse_result<T>(input, "Error: never");
   });
 }
 
-template <typename T>
-Parser<T> pure(const T& value) {
-  return Parser<T>([value](std::string_view input) {
+template <typename T, typename Input = std::string_view>
+Parser<T, Input> pure(const T& value) {
+  return Parser<T, Input>([value](Input input) {
     return make_parse_result(
         value, input);  // Succeeds with value, doesn't consume input
   });
@@ -248,7 +797,11 @@ Parser<T> pure(const T& value) {
 template <typename T>
 Parser<T> parse_not(Parser<T> parser) {
   return Parser<T>([parser](std::string_view input) {
+    // The match only decides the outcome and is never kept, so neither are
+    // its deferred actions.
+    detail::backtrack_mark mark = detail::mark_backtrack();
     auto result = parser(input);
+    detail::backtrack(mark);
     if (result) {
       return empty_parse_result<T>(input, "Error: not");
     } else {
@@ -261,7 +814,8 @@ Parser<T> parse_not(Parser<T> parser) {
 namespace detail {
 
 // Helper for all the std::is* functions for chars.
-StringParser parse_char_class(std::function<int(int)> matcher) {
+template <typename F>
+StringParser parse_char_class(F matcher) {
   return StringParser([matcher](std::string_view input) {
     if (matcher(static_cast<int>(input.front())) != 0) {
       return make_parse_result<std::string_view>(input.substr(0, 1),
@@ -309,8 +863,12 @@ StringParser parse_str(std::string_view str) {
       return make_parse_result(input.substr(0, str.size()),
                                input.substr(str.size()));
     } else {
+      // Only as much of the input as str would have matched, so that an
+      // alternative failing near the start of a large input stays cheap.
       return empty_parse_result<std::string_view>(
-          input, fmt::format("Error: expected {} but saw {}", str, input));
+          input, fmt::format("Error: expected {} but saw {}", str,
+                             input.empty() ? std::string_view("end of input")
+                                           : input.substr(0, str.size())));
     }
   });
 }
@@ -358,51 +916,572 @@ Parser<int> parse_digit(int first = 0, int last = 9) {
       });
 }
 
+namespace detail {
+
+bool is_digit(char ch) { return ch >= '0' && ch <= '9'; }
+
+// Reads 8 bytes as a little endian word so the first char is the low byte.
+uint64_t load_word(const char* ptr) {
+  uint64_t word;
+  std::memcpy(&word, ptr, sizeof(word));
+  if constexpr (std::endian::native == std::endian::big) {
+    word = std::byteswap(word);
+  }
+  return word;
+}
+
+// SWAR check that all 8 bytes of word are in '0'..'9'.
+bool is_eight_digits(uint64_t word) {
+  return ((word & 0xF0F0F0F0F0F0F0F0) |
+          (((word + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) >> 4)) ==
+         0x3333333333333333;
+}
+
+// SWAR conversion of 8 ascii digits to their value in three multiplies.
+uint32_t parse_eight_digits(uint64_t word) {
+  constexpr uint64_t mask = 0x000000FF000000FF;
+  constexpr uint64_t mul1 = 100 + (1000000ULL << 32);
+  constexpr uint64_t mul2 = 1 + (10000ULL << 32);
+  word -= 0x3030303030303030;
+  word = (word * 10) + (word >> 8);
+  word = (((word & mask) * mul1) + (((word >> 16) & mask) * mul2)) >> 32;
+  return static_cast<uint32_t>(word);
+}
+
+// Consumes a run of digits from ptr, 8 at a time while possible, adding them
+// to value. Returns false if value would overflow 64 bits.
+bool scan_digits(const char*& ptr, const char* end, uint64_t& value) {
+  while (end - ptr >= 8) {
+    uint64_t word = load_word(ptr);
+    if (!is_eight_digits(word)) {
+      break;
+    }
+    if (__builtin_mul_overflow(value, uint64_t{100000000}, &value) ||
+        __builtin_add_overflow(value, uint64_t{parse_eight_digits(word)},
+                               &value)) {
+      return false;
+    }
+    ptr += 8;
+  }
+  for (; ptr != end && is_digit(*ptr); ++ptr) {
+    if (__builtin_mul_overflow(value, uint64_t{10}, &value) ||
+        __builtin_add_overflow(value, uint64_t(*ptr - '0'), &value)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Skips a run of digits without converting them, returning how many.
+size_t skip_digits(const char*& ptr, const char* end) {
+  const char* start = ptr;
+  while (end - ptr >= 8 && is_eight_digits(load_word(ptr))) {
+    ptr += 8;
+  }
+  while (ptr != end && is_digit(*ptr)) {
+    ++ptr;
+  }
+  return ptr - start;
+}
+
+// Marks the high bit of every byte of word that is in [lo, hi]. All bytes
+// must be below 0x80, which the caller guarantees by masking with ~word.
+constexpr uint64_t bytes_between(uint64_t word, uint8_t lo, uint8_t hi) {
+  constexpr uint64_t ones = 0x0101010101010101;
+  return (word + ones * (0x80 - lo)) & ~(word + ones * (0x7F - hi)) & ~word &
+         (ones * 0x80);
+}
+
+// Decodes count (at most 8) hex digits starting at ptr. Shorter inputs are
+// left padded with '0' so the same three steps validate, convert and pack
+// every width.
+bool decode_hex(const char* ptr, size_t count, uint32_t& value) {
+  char buf[8] = {'0', '0', '0', '0', '0', '0', '0', '0'};
+  std::memcpy(buf + (8 - count), ptr, count);
+  uint64_t word = load_word(buf);
+
+  uint64_t valid = bytes_between(word, '0', '9') |
+                   bytes_between(word | 0x2020202020202020, 'a', 'f');
+  if (valid != 0x8080808080808080) {
+    return false;
+  }
+
+  // '0'..'9' have bit 6 clear and letters have it set, so adding 9 for
+  // letters to the low nibble gives the digit value.
+  uint64_t nibbles =
+      (word & 0x0F0F0F0F0F0F0F0F) + ((word >> 6) & 0x0101010101010101) * 9;
+  // The first char is the most significant digit.
+  nibbles = std::byteswap(nibbles);
+  nibbles = (nibbles | (nibbles >> 4)) & 0x00FF00FF00FF00FF;
+  nibbles = (nibbles | (nibbles >> 8)) & 0x0000FFFF0000FFFF;
+  nibbles = (nibbles | (nibbles >> 16)) & 0x00000000FFFFFFFF;
+  value = static_cast<uint32_t>(nibbles);
+  return true;
+}
+
+// Decodes count (at most 8) decimal digits starting at ptr.
+bool decode_digits(const char* ptr, size_t count, uint32_t& value) {
+  char buf[8] = {'0', '0', '0', '0', '0', '0', '0', '0'};
+  std::memcpy(buf + (8 - count), ptr, count);
+  uint64_t word = load_word(buf);
+  if (!is_eight_digits(word)) {
+    return false;
+  }
+  value = parse_eight_digits(word);
+  return true;
+}
+
+template <size_t Bits>
+using uint_fitting_t = std::conditional_t<(Bits <= 32), uint32_t, uint64_t>;
+
+std::string describe_front(std::string_view input) {
+  return input.empty() ? std::string("end of input")
+                       : std::string(1, input.front());
+}
+
+// Limits for the exact fast path of decimal to binary conversion: a
+// mantissa that fits the significand times an exactly representable power
+// of ten rounds correctly with a single multiply or divide.
 template <typename T>
-Parser<std::optional<T>> parse_opt(Parser<T> parser) {
-  return Parser<std::optional<T>>([parser](std::string_view input) {
-    auto result = parser(input);
-    if (result) {
-      return make_parse_result(std::optional<T>(result.value()), result.input);
-    } else {
-      return make_parse_result<std::optional<T>>(std::nullopt, input);
+struct float_traits;
+
+template <>
+struct float_traits<double> {
+  static constexpr uint64_t max_mantissa = uint64_t{1} << 53;
+  static constexpr int max_exponent = 22;
+  static constexpr double powers[] = {
+      1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+      1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+};
+
+template <>
+struct float_traits<float> {
+  static constexpr uint64_t max_mantissa = uint64_t{1} << 24;
+  static constexpr int max_exponent = 10;
+  static constexpr float powers[] = {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f,
+                                     1e6f, 1e7f, 1e8f, 1e9f, 1e10f};
+};
+
+// Whether a well-formed number that std::from_chars found out of range is
+// too small rather than too large: its first significant digit, counted
+// from the decimal point and moved by the exponent, lies after the point.
+bool decimal_underflows(std::string_view number) {
+  size_t pos = !number.empty() && number.front() == '-' ? 1 : 0;
+  int64_t magnitude = 0;
+  if (pos < number.size() && number[pos] != '0') {
+    while (pos < number.size() && is_digit(number[pos])) {
+      ++pos;
+      ++magnitude;
     }
-  });
+  } else if (++pos < number.size() && number[pos] == '.') {
+    while (++pos < number.size() && number[pos] == '0') {
+      --magnitude;
+    }
+  }
+  size_t at = number.find_first_of("eE");
+  if (at != std::string_view::npos) {
+    bool negative = number[++at] == '-';
+    at += number[at] == '-' || number[at] == '+';
+    int64_t exponent = 0;
+    for (; at < number.size(); ++at) {
+      exponent = std::min<int64_t>(exponent * 10 + (number[at] - '0'),
+                                   int64_t{1} << 40);
+    }
+    magnitude += negative ? -exponent : exponent;
+  }
+  return magnitude < 0;
 }
 
-// Zero or more.
+}  // namespace detail
+
+// Parses a decimal integer: an optional '-' for signed types followed by
+// digits without leading zeros. Digits are converted 8 at a time and values
+// that don't fit in T are rejected rather than wrapped. Like the original
+// digit grammar "-0" is rejected since zero has no sign.
 template <typename T>
-Parser<std::vector<T>> parse_some(const Parser<T>& parser,
-                                  std::optional<size_t> max = std::nullopt) {
-  return Parser<std::vector<T>>([parser, max](std::string_view input) {
-    std::vector<T> results;
-    while (!input.empty()) {
-      auto result = parser(input);
-      if (!result) {
-        break;
+  requires std::is_integral_v<T>
+Parser<T> parse_int() {
+  return Parser<T>([](std::string_view input) {
+    const char* ptr = input.data();
+    const char* end = ptr + input.size();
+    bool negative = false;
+    if constexpr (std::is_signed_v<T>) {
+      if (ptr != end && *ptr == '-') {
+        negative = true;
+        ++ptr;
       }
-      if (max && results.size() == *max) {
-        return empty_parse_result<std::vector<T>>(
-            input, fmt::format("Error: parsed more than {} reults", *max));
+    }
+    if (ptr == end || !detail::is_digit(*ptr)) {
+      return empty_parse_result<T>(
+          input, fmt::format("Error: expected digit but saw {}",
+                             detail::describe_front(input.substr(
+                                 ptr - input.data()))));
+    }
+    if (*ptr == '0') {
+      ++ptr;
+      if (negative || (ptr != end && detail::is_digit(*ptr))) {
+        return empty_parse_result<T>(input,
+                                     "Error: invalid leading zero");
       }
-      results.push_back(result.value());
-      input = result.input;
+      return make_parse_result(T{0}, input.substr(ptr - input.data()));
+    }
+
+    uint64_t value = 0;
+    uint64_t limit = static_cast<uint64_t>(std::numeric_limits<T>::max()) +
+                     (negative ? 1 : 0);
+    if (!detail::scan_digits(ptr, end, value) || value > limit) {
+      return empty_parse_result<T>(
+          input, fmt::format("Error: {} out of range",
+                             input.substr(0, ptr - input.data())));
     }
-    return make_parse_result(results, input);
+    T result = negative ? static_cast<T>(0 - value) : static_cast<T>(value);
+    return make_parse_result(result, input.substr(ptr - input.data()));
   });
 }
 
+// Parses a decimal number in JSON syntax: -?(0|[1-9][0-9]*)(.[0-9]+)?
+// ([eE][+-]?[0-9]+)?. Digits are scanned 8 at a time. Numbers whose
+// mantissa and exponent are small enough are converted exactly with one
+// multiply or divide, the rest fall back to std::from_chars, which is
+// correctly rounded (an Eisel-Lemire implementation in recent standard
+// libraries). Numbers too small for T round to zero; only ones too large
+// are rejected.
 template <typename T>
-Parser<std::vector<T>> parse_n(const Parser<T>& parser, size_t min,
-                               std::optional<size_t> max = std::nullopt) {
-  return parse_some(parser, max).and_then([min](const auto& results) {
-    if (results.size() < min) {
-      return parse_never<std::vector<T>>();
+  requires std::is_floating_point_v<T>
+Parser<T> parse_float() {
+  return Parser<T>([](std::string_view input) {
+    const char* start = input.data();
+    const char* ptr = start;
+    const char* end = start + input.size();
+    auto fail = [&](std::string_view what) {
+      return empty_parse_result<T>(
+          input, fmt::format("Error: expected {} but saw {}", what,
+                             detail::describe_front(
+                                 input.substr(ptr - start))));
+    };
+
+    bool negative = ptr != end && *ptr == '-';
+    if (negative) {
+      ++ptr;
+    }
+    if (ptr == end || !detail::is_digit(*ptr)) {
+      return fail("digit");
+    }
+
+    // Accumulate up to 19 significant digits, then only count the rest.
+    uint64_t mantissa = 0;
+    int exponent = 0;
+    bool exact = true;
+    const char* int_start = ptr;
+    if (*ptr == '0') {
+      ++ptr;
+    } else if (!detail::scan_digits(ptr, end, mantissa)) {
+      exact = false;
+      ptr = int_start;
+      detail::skip_digits(ptr, end);
+    }
+    if (ptr != end && detail::is_digit(*ptr)) {
+      return fail("fraction or exponent");
+    }
+
+    if (ptr != end && *ptr == '.') {
+      ++ptr;
+      const char* frac_start = ptr;
+      if (exact && !detail::scan_digits(ptr, end, mantissa)) {
+        exact = false;
+      }
+      ptr = frac_start;
+      size_t frac_digits = detail::skip_digits(ptr, end);
+      if (frac_digits == 0) {
+        return fail("digit");
+      }
+      exponent -= static_cast<int>(frac_digits);
+    }
+
+    if (ptr != end && (*ptr == 'e' || *ptr == 'E')) {
+      ++ptr;
+      bool exp_negative = false;
+      if (ptr != end && (*ptr == '-' || *ptr == '+')) {
+        exp_negative = *ptr == '-';
+        ++ptr;
+      }
+      uint64_t exp_value = 0;
+      const char* exp_start = ptr;
+      if (!detail::scan_digits(ptr, end, exp_value) || exp_value > 100000) {
+        exact = false;
+        exp_value = 0;
+        detail::skip_digits(ptr, end);
+      }
+      if (ptr == exp_start) {
+        return fail("digit");
+      }
+      exponent += exp_negative ? -static_cast<int>(exp_value)
+                               : static_cast<int>(exp_value);
+    }
+
+    std::string_view rest = input.substr(ptr - start);
+    using traits = detail::float_traits<T>;
+    if (exact && mantissa <= traits::max_mantissa &&
+        exponent >= -traits::max_exponent &&
+        exponent <= traits::max_exponent) {
+      T value = static_cast<T>(mantissa);
+      value = exponent < 0 ? value / traits::powers[-exponent]
+                           : value * traits::powers[exponent];
+      return make_parse_result(negative ? -value : value, rest);
+    }
+
+    T value;
+    auto [parsed_end, ec] = std::from_chars(start, ptr, value);
+    if (ec == std::errc::result_out_of_range && parsed_end == ptr &&
+        detail::decimal_underflows(input.substr(0, ptr - start))) {
+      // Too small for any subnormal, so it rounds to zero.
+      return make_parse_result(negative ? -T{0} : T{0}, rest);
     }
-    return pure(results);
+    if (ec != std::errc() || parsed_end != ptr) {
+      return empty_parse_result<T>(
+          input, fmt::format("Error: {} out of range",
+                             input.substr(0, ptr - start)));
+    }
+    return make_parse_result(value, rest);
   });
 }
 
+// Parses exactly N hex digits, either case, validating and converting 8 at a
+// time.
+template <size_t N>
+  requires(N >= 1 && N <= 16)
+Parser<detail::uint_fitting_t<N * 4>> parse_hex() {
+  using T = detail::uint_fitting_t<N * 4>;
+  return Parser<T>([](std::string_view input) {
+    if (input.size() < N) {
+      return empty_parse_result<T>(
+          input, fmt::format("Error: expected {} hex digits", N));
+    }
+    T value = 0;
+    for (size_t pos = 0; pos < N;) {
+      size_t count = std::min<size_t>(N - pos, 8);
+      uint32_t chunk;
+      if (!detail::decode_hex(input.data() + pos, count, chunk)) {
+        return empty_parse_result<T>(
+            input, fmt::format("Error: expected {} hex digits but saw {}", N,
+                               input.substr(0, N)));
+      }
+      if constexpr (N > 8) {
+        value = (value << (count * 4)) | chunk;
+      } else {
+        value = chunk;
+      }
+      pos += count;
+    }
+    return make_parse_result(value, input.substr(N));
+  });
+}
+
+// Parses exactly N decimal digits, leading zeros allowed, 8 at a time.
+template <size_t N>
+  requires(N >= 1 && N <= 19)
+Parser<detail::uint_fitting_t<(N <= 9 ? 32 : 64)>> parse_digits() {
+  using T = detail::uint_fitting_t<(N <= 9 ? 32 : 64)>;
+  return Parser<T>([](std::string_view input) {
+    if (input.size() < N) {
+      return empty_parse_result<T>(
+          input, fmt::format("Error: expected {} digits", N));
+    }
+    T value = 0;
+    for (size_t pos = 0; pos < N;) {
+      size_t count = std::min<size_t>(N - pos, 8);
+      uint32_t chunk;
+      if (!detail::decode_digits(input.data() + pos, count, chunk)) {
+        return empty_parse_result<T>(
+            input, fmt::format("Error: expected {} digits but saw {}", N,
+                               input.substr(0, N)));
+      }
+      if constexpr (N > 8) {
+        constexpr T scale[] = {1,      10,      100,      1000,     10000,
+                               100000, 1000000, 10000000, 100000000};
+        value = value * scale[count] + chunk;
+      } else {
+        value = chunk;
+      }
+      pos += count;
+    }
+    return make_parse_result(value, input.substr(N));
+  });
+}
+
+// Parses a #rrggbb or #rgb color into 0xRRGGBB. The short form repeats each
+// digit, so #fa0 is 0xFFAA00.
+Parser<uint32_t> parse_hex_color() {
+  return Parser<uint32_t>([](std::string_view input) {
+    if (input.empty() || input.front() != '#') {
+      return empty_parse_result<uint32_t>(
+          input, fmt::format("Error: expected # but saw {}",
+                             detail::describe_front(input)));
+    }
+    std::string_view digits = input.substr(1);
+    // A form only matches if no hex digit follows it, so that #rgba and
+    // longer colors are rejected rather than read as a shorter one.
+    auto ends_after = [digits](size_t count) {
+      uint32_t next;
+      return digits.size() == count ||
+             !detail::decode_hex(digits.data() + count, 1, next);
+    };
+    uint32_t value;
+    if (digits.size() >= 6 && detail::decode_hex(digits.data(), 6, value) &&
+        ends_after(6)) {
+      return make_parse_result(value, digits.substr(6));
+    }
+    if (digits.size() >= 3 && detail::decode_hex(digits.data(), 3, value) &&
+        ends_after(3)) {
+      uint32_t r = (value >> 8) & 0xF;
+      uint32_t g = (value >> 4) & 0xF;
+      uint32_t b = value & 0xF;
+      value = (r * 0x11 << 16) | (g * 0x11 << 8) | (b * 0x11);
+      return make_parse_result(value, digits.substr(3));
+    }
+    return empty_parse_result<uint32_t>(
+        input, fmt::format("Error: expected hex color but saw {}",
+                           input.substr(0, std::min<size_t>(input.size(), 7))));
+  });
+}
+
+template <typename T, typename Input>
+Parser<std::optional<T>, Input> parse_opt(Parser<T, Input> parser) {
+  return Parser<std::optional<T>, Input>(
+      [parser](Input input) {
+        detail::backtrack_mark mark = detail::mark_backtrack();
+        auto result = parser(input);
+        if (result) {
+          return make_parse_result(std::optional<T>(std::move(result.value())),
+                                   result.input);
+        } else {
+          detail::backtrack(mark);
+          return make_parse_result<std::optional<T>>(std::nullopt, input);
+        }
+      },
+      [parser](Input input) {
+        detail::backtrack_mark mark = detail::mark_backtrack();
+        auto result = parser.check(input);
+        if (!result) {
+          detail::backtrack(mark);
+          return make_parse_result(unit{}, input);
+        }
+        return result;
+      });
+}
+
+namespace detail {
+// Applies match from input until it fails, passing each value to on_match.
+// Yields where the matches ended, or an error if there were fewer than min
+// or more than max.
+template <typename Input, typename M, typename F>
+ParseResult<unit, Input> repeat(Input input, const M& match, F&& on_match,
+                                size_t min, std::optional<size_t> max) {
+  size_t count = 0;
+  Input inp = input;
+  std::string error;
+  while (!inp.empty()) {
+    backtrack_mark mark = mark_backtrack();
+    auto result = match(inp);
+    if (!result) {
+      backtrack(mark);
+      error = result.error;
+      break;
+    }
+    if (max && count == *max) {
+      return empty_parse_result<unit>(
+          inp, fmt::format("Error: parsed more than {} results", *max));
+    }
+    on_match(std::move(result.value()));
+    ++count;
+    // A parser that succeeds without consuming would match forever.
+    if (result.input.size() == inp.size()) {
+      break;
+    }
+    inp = result.input;
+  }
+  if (count < min) {
+    return empty_parse_result<unit>(
+        inp, fmt::format(
+                 "Error: expected {} occurences but only saw {}\n\tInner: {}",
+                 min, count, error));
+  }
+  return make_parse_result(unit{}, inp);
+}
+}  // namespace detail
+
+// Runs parser repeatedly, combining each result into an accumulator with
+// fn(acc, value) -> acc as it is produced rather than collecting them. Like
+// parse_n, fails if there are fewer than min results or more than max.
+template <typename T, typename Input, typename A, typename F>
+Parser<A, Input> parse_fold(const Parser<T, Input>& parser, A init, F fn,
+                            size_t min = 0,
+                            std::optional<size_t> max = std::nullopt) {
+  return Parser<A, Input>(
+      [parser, init, fn, min, max](Input input) {
+        A acc = init;
+        auto matched = detail::repeat(
+            input, parser,
+            [&](T&& value) { acc = fn(std::move(acc), std::move(value)); },
+            min, max);
+        if (!matched) {
+          return empty_parse_result<A>(matched.input, matched.error);
+        }
+        return make_parse_result(std::move(acc), matched.input);
+      },
+      [parser, min, max](Input input) {
+        return detail::repeat(
+            input, [&parser](Input inp) { return parser.check(inp); },
+            [](unit) {}, min, max);
+      });
+}
+
+// Counts matches of parser without keeping their values.
+template <typename T, typename Input>
+Parser<size_t, Input> parse_count(const Parser<T, Input>& parser,
+                                  size_t min = 0,
+                                  std::optional<size_t> max = std::nullopt) {
+  return parse_fold(
+      parser, size_t{0}, [](size_t count, const T&) { return count + 1; },
+      min, max);
+}
+
+// Passes each match of parser to sink as it is parsed and yields the number
+// of matches. sink sees values from a parse that may later be abandoned by
+// an enclosing alternative.
+template <typename T, typename Input, typename F>
+Parser<size_t, Input> parse_for_each(const Parser<T, Input>& parser, F sink,
+                                     size_t min = 0,
+                                     std::optional<size_t> max = std::nullopt) {
+  return parse_fold(
+      parser, size_t{0},
+      [sink](size_t count, T&& value) {
+        sink(std::move(value));
+        return count + 1;
+      },
+      min, max);
+}
+
+template <typename T, typename Input>
+Parser<std::vector<T>, Input> parse_n(
+    const Parser<T, Input>& parser, size_t min,
+    std::optional<size_t> max = std::nullopt) {
+  return parse_fold(
+      parser, std::vector<T>(),
+      [](std::vector<T> results, T&& value) {
+        results.push_back(std::move(value));
+        return results;
+      },
+      min, max);
+}
+
+// Zero or more.
+template <typename T, typename Input>
+Parser<std::vector<T>, Input> parse_some(
+    const Parser<T, Input>& parser, std::optional<size_t> max = std::nullopt) {
+  return parse_n(parser, 0, max);
+}
+
 StringParser parse_some(const StringParser& parser,
                         std::optional<size_t> max = std::nullopt) {
   return StringParser([parser, max](std::string_view input) {
@@ -410,8 +1489,10 @@ StringParser parse_some(const StringParser& parser,
     size_t count = 0;
     std::string_view inp = input;
     while (!inp.empty()) {
+      detail::backtrack_mark mark = detail::mark_backtrack();
       auto result = parser(inp);
       if (!result) {
+        detail::backtrack(mark);
         break;
       }
       if (max && count == *max) {
@@ -436,8 +1517,10 @@ StringParser parse_n(const StringParser& parser, size_t min,
     std::string_view inp = input;
     std::string error;
     while (!inp.empty()) {
+      detail::backtrack_mark mark = detail::mark_backtrack();
       auto result = parser(inp);
       if (!result) {
+        detail::backtrack(mark);
         error = result.error;
         break;
       }
@@ -463,8 +1546,9 @@ StringParser parse_n(const StringParser& parser, size_t min,
   });
 }
 
-Parser<unit> parse_end() {
-  return Parser<unit>([](std::string_view input) {
+template <typename Input = std::string_view>
+Parser<unit, Input> parse_end() {
+  return Parser<unit, Input>([](Input input) {
     if (!input.empty()) {
       return empty_parse_result<unit>(input, "Error: input not empty");
     }
@@ -494,13 +1578,14 @@ StringParser parse_sequence(std::initializer_list<StringParser> parsers) {
   });
 }
 
-template <typename T, typename D, typename S>
-Parser<detail::result_vector_t<T>> parse_delimited_by(
-    const Parser<T>& parser, const Parser<D>& delimiter,
-    const Parser<S>& terminator, std::optional<int> max = std::nullopt) {
+template <typename T, typename D, typename S, typename Input>
+Parser<detail::result_vector_t<T>, Input> parse_delimited_by(
+    const Parser<T, Input>& parser, const Parser<D, Input>& delimiter,
+    const Parser<S, Input>& terminator, std::optional<int> max = std::nullopt) {
   using ResultType = detail::result_vector_t<T>;
-  return Parser<ResultType>([=](std::string_view input) {
-    auto tokens_result = parse_some(parser.skip(delimiter))(input);
+  auto leading = parse_some(parser.skip(delimiter));
+  auto parse = [leading, parser, terminator](Input input) {
+    auto tokens_result = leading(input);
 
     if (!tokens_result) {
       return empty_parse_result<ResultType>(input, tokens_result.error);
@@ -519,11 +1604,28 @@ Parser<detail::result_vector_t<T>> parse_delimited_by(
                                             term_result.error);
     }
 
-    auto results = tokens_result.value();
-    results.push_back(last_token_result.value());
+    auto results = std::move(tokens_result.value());
+    results.push_back(std::move(last_token_result.value()));
 
-    return make_parse_result(results, last_token_result.input);
-  });
+    return make_parse_result(std::move(results), last_token_result.input);
+  };
+  auto check = [leading, parser, terminator](Input input) {
+    auto tokens_result = leading.check(input);
+    if (!tokens_result) {
+      return empty_parse_result<unit>(input, tokens_result.error);
+    }
+    auto last_token_result = parser.check(tokens_result.input);
+    if (!last_token_result) {
+      return empty_parse_result<unit>(tokens_result.input,
+                                      last_token_result.error);
+    }
+    auto term_result = terminator.check(last_token_result.input);
+    if (!term_result) {
+      return term_result;
+    }
+    return last_token_result;
+  };
+  return Parser<ResultType, Input>(parse, check);
 }
 
 StringParser parse_alpha() {
@@ -538,12 +1640,21 @@ StringParser parse_space() {
   return detail::parse_char_class(static_cast<int (*)(int)>(&std::isspace));
 }
 
-Parser<unit> parse_opt_ws() { return parse_some(parse_space()).as(unit{}); }
+// Whitespace skips are used all over a grammar, so they are built once and
+// shared by every use.
+Parser<unit> parse_opt_ws() {
+  static const Parser<unit> parser = parse_count(parse_space()).as(unit{});
+  return parser;
+}
 
-Parser<unit> parse_ws() { return parse_n(parse_space(), 1).as(unit{}); }
+Parser<unit> parse_ws() {
+  static const Parser<unit> parser = parse_count(parse_space(), 1).as(unit{});
+  return parser;
+}
 
-template <typename T, typename U>
-Parser<T> parse_ignoring(const Parser<T>& parser, const Parser<U>& ignore) {
+template <typename T, typename U, typename Input>
+Parser<T, Input> parse_ignoring(const Parser<T, Input>& parser,
+                                const Parser<U, Input>& ignore) {
   return parser.skip(ignore).or_else(ignore.and_then(parser).skip(ignore));
 }
 
@@ -553,21 +1664,764 @@ Parser<detail::discontinuous_string_view> parse_ignoring(
   return parse_ignoring(detail::to_discontinuous(parser), ignore);
 }
 
+// Refers to parser rather than copying it, so it can be used before parser
+// is assigned. parser must outlive the result and must not be assigned
+// while another thread is parsing with it.
+template <typename T, typename Input>
+Parser<T, Input> parse_ref(const Parser<T, Input>& parser) {
+  return Parser<T, Input>(
+      [&parser](Input input) { return parser(input); },
+      [&parser](Input input) { return parser.check(input); });
+}
+
+// Recursion.
+//
+// Every level of a recursive grammar is a native call through several
+// closures, so deeply nested input would overflow the stack. Recursive
+// parsers count nesting per thread and fail once it passes their max_depth.
+// After recursion has used kNativeStackBudget bytes of the thread's own
+// stack, each further stretch of it runs on a heap-allocated stack segment,
+// so stack usage stays flat however deep the document goes.
+
+constexpr size_t kDefaultMaxDepth = 100000;
+
+namespace detail {
+constexpr size_t kNativeStackBudget = 256 << 10;
+constexpr size_t kStackSegmentSize = 1 << 20;
+// Room left at the end of a segment for the frames between two levels.
+constexpr size_t kStackSegmentReserve = 128 << 10;
+
+recursion_state& current_recursion() { return current_context().recursion; }
+
+#if __has_include(<ucontext.h>)
+// Runs fn to completion on a new stack of size bytes. Exceptions are carried
+// back across the switch and rethrown on the caller's stack.
+void run_on_stack_segment(size_t size, const std::function<void()>& fn) {
+  struct call {
+    const std::function<void()>* fn;
+    std::exception_ptr error;
+    ucontext_t* caller;
+    void* caller_fiber;
+  };
+  static thread_local call* pending = nullptr;
+  std::unique_ptr<char[]> stack(new char[size]);
+  ucontext_t caller;
+  ucontext_t callee;
+  getcontext(&callee);
+  callee.uc_stack.ss_sp = stack.get();
+  callee.uc_stack.ss_size = size;
+  callee.uc_link = &caller;
+  call current{
+      .fn = &fn, .error = nullptr, .caller = &caller, .caller_fiber = nullptr};
+  pending = &current;
+  makecontext(&callee,
+              +[] {
+                call* self = pending;
+                try {
+                  (*self->fn)();
+                } catch (...) {
+                  self->error = std::current_exception();
+                }
+#if defined(MPARSE_TSAN)
+                // Returning would pop this frame off the caller's shadow
+                // stack, so jump straight back instead.
+                __tsan_switch_to_fiber(self->caller_fiber, 0);
+                setcontext(self->caller);
+#endif
+              },
+              0);
+#if defined(MPARSE_TSAN)
+  current.caller_fiber = __tsan_get_current_fiber();
+  void* callee_fiber = __tsan_create_fiber(0);
+  __tsan_switch_to_fiber(callee_fiber, 0);
+#endif
+  swapcontext(&caller, &callee);
+#if defined(MPARSE_TSAN)
+  __tsan_destroy_fiber(callee_fiber);
+#endif
+  if (current.error) {
+    std::rethrow_exception(current.error);
+  }
+}
+#endif
+
+// Applies parser, a parser or a check yielding ParseResult<T, Input>, one
+// level deeper, checking the depth limit and moving to a new stack segment
+// when the current one is used up.
+template <typename T, typename Input, typename P>
+ParseResult<T, Input> parse_nested(const P& parser, Input input,
+                                   size_t max_depth) {
+  recursion_state& state = current_recursion();
+  if (state.depth >= max_depth) {
+    return empty_parse_result<T>(
+        input, fmt::format("Error: nesting deeper than {} levels", max_depth));
+  }
+  struct restore {
+    recursion_state& state;
+    recursion_state saved;
+    ~restore() { state = saved; }
+  } guard{.state = state, .saved = state};
+
+  char marker;
+  uintptr_t here = reinterpret_cast<uintptr_t>(&marker);
+  if (state.depth++ == 0) {
+    state.stack_base = here;
+    state.stack_budget = kNativeStackBudget;
+  }
+#if __has_include(<ucontext.h>)
+  size_t used = state.stack_base > here ? state.stack_base - here
+                                        : here - state.stack_base;
+  if (used > state.stack_budget) {
+    std::optional<ParseResult<T, Input>> result;
+    run_on_stack_segment(kStackSegmentSize, [&] {
+      char top;
+      state.stack_base = reinterpret_cast<uintptr_t>(&top);
+      state.stack_budget = kStackSegmentSize - kStackSegmentReserve;
+      result = parser(input);
+    });
+    return std::move(*result);
+  }
+#endif
+  return parser(input);
+}
+
+template <typename T, typename Input>
+struct recursive_parser {
+  Parser<T, Input> self = parse_never<T, Input>();
+  Parser<T, Input> body = parse_never<T, Input>();
+};
+}  // namespace detail
+
+// The parser passed to make_parser refers back to the one being built, so it
+// can be copied into other combinators as well as used through parse_ref. It
+// must not outlive the returned parser. Nesting deeper than max_depth fails.
+template <typename T, typename Input = std::string_view>
+Parser<T, Input> parse_recursive(
+    std::type_identity_t<
+        std::function<Parser<T, Input>(const Parser<T, Input>&)>>
+        make_parser,
+    size_t max_depth = kDefaultMaxDepth) {
+  auto recursive = std::make_shared<detail::recursive_parser<T, Input>>();
+  auto* node = recursive.get();
+  recursive->self = Parser<T, Input>(
+      [node, max_depth](Input input) {
+        return detail::parse_nested<T>(node->body, input, max_depth);
+      },
+      [node, max_depth](Input input) {
+        return detail::parse_nested<unit>(
+            [node](Input inp) { return node->body.check(inp); }, input,
+            max_depth);
+      });
+  recursive->body = make_parser(recursive->self);
+
+  // Nothing changes the nodes from here on, so the result can be shared by
+  // threads.
+  std::shared_ptr<const detail::recursive_parser<T, Input>> frozen =
+      std::move(recursive);
+  // Holds the shared state alive for every copy of self inside body.
+  return Parser<T, Input>(
+      [frozen](Input input) { return frozen->self(input); },
+      [frozen](Input input) { return frozen->self.check(input); });
+}
+
+// Succeeds with the result of parser without consuming any input.
+template <typename T, typename Input>
+Parser<T, Input> parse_peek(const Parser<T, Input>& parser) {
+  return Parser<T, Input>(
+      [parser](Input input) {
+        // Lookahead commits nothing, so its deferred actions are always
+        // dropped; the parse that consumes the input records its own.
+        detail::backtrack_mark mark = detail::mark_backtrack();
+        auto result = parser(input);
+        detail::backtrack(mark);
+        if (!result) {
+          return empty_parse_result<T>(input, result.error);
+        }
+        return make_parse_result(std::move(result.value()), input);
+      },
+      [parser](Input input) {
+        detail::backtrack_mark mark = detail::mark_backtrack();
+        auto result = parser.check(input);
+        detail::backtrack(mark);
+        if (!result) {
+          return empty_parse_result<unit>(input, result.error);
+        }
+        return make_parse_result(unit{}, input);
+      });
+}
+
+// Generic inputs.
+//
+// The char primitives above only work on std::string_view. These work on
+// any ParseInput by element, yielding the matched slice of the input. When
+// the input type isn't given it follows from the element type:
+// std::basic_string_view for character types and std::span<const E> for
+// everything else, such as std::byte.
+
+using ByteSpan = std::span<const std::byte>;
+
+namespace detail {
+
+template <typename E>
+using default_input_t =
+    std::conditional_t<std::is_same_v<E, char> || std::is_same_v<E, wchar_t> ||
+                           std::is_same_v<E, char8_t> ||
+                           std::is_same_v<E, char16_t> ||
+                           std::is_same_v<E, char32_t>,
+                       std::basic_string_view<E>, std::span<const E>>;
+
+// count elements of input starting at pos, clamped to its end.
+template <ParseInput Input>
+Input input_slice(const Input& input, size_t pos,
+                  size_t count = std::numeric_limits<size_t>::max()) {
+  pos = std::min<size_t>(pos, input.size());
+  count = std::min<size_t>(count, input.size() - pos);
+  return Input(std::ranges::data(input) + pos, count);
+}
+
+template <typename E>
+std::string describe_element(const E& value) {
+  if constexpr (std::is_same_v<E, char>) {
+    return std::string(1, value);
+  } else if constexpr (std::is_integral_v<E> || std::is_enum_v<E>) {
+    return fmt::format("{:#x}", static_cast<uint64_t>(value));
+  } else {
+    return "element";
+  }
+}
+
+template <ParseInput Input>
+std::string describe_input_front(const Input& input) {
+  return input.empty() ? std::string("end of input")
+                       : describe_element(*std::ranges::begin(input));
+}
+
+// The first element equal to value in [first, last), or last. Byte sized
+// elements use memchr, which libc vectorizes, and 16 bit elements are
+// compared four at a time in a word.
+template <typename E>
+const E* find_element(const E* first, const E* last, const E& value) {
+  constexpr bool scalar = std::is_integral_v<E> || std::is_enum_v<E>;
+  if constexpr (scalar && sizeof(E) == 1) {
+    const void* found = std::memchr(first, std::bit_cast<uint8_t>(value),
+                                    static_cast<size_t>(last - first));
+    return found != nullptr ? static_cast<const E*>(found) : last;
+  } else if constexpr (scalar && sizeof(E) == 2 &&
+                       std::endian::native == std::endian::little) {
+    constexpr uint64_t lanes = 0x0001000100010001;
+    constexpr uint64_t highs = 0x8000800080008000;
+    uint64_t pattern = lanes * std::bit_cast<uint16_t>(value);
+    while (last - first >= 4) {
+      uint64_t word;
+      std::memcpy(&word, first, sizeof(word));
+      uint64_t diff = word ^ pattern;
+      // Only the lowest mark is exact, which is the one we want.
+      uint64_t marks = (diff - lanes) & ~diff & highs;
+      if (marks != 0) {
+        return first + std::countr_zero(marks) / 16;
+      }
+      first += 4;
+    }
+    return std::find(first, last, value);
+  } else {
+    return std::find(first, last, value);
+  }
+}
+
+}  // namespace detail
+
+// Matches one element equal to value.
+template <typename E, ParseInput Input = detail::default_input_t<E>>
+Parser<Input, Input> parse_element(E value) {
+  return Parser<Input, Input>([value](Input input) {
+    if (input.empty() || !(*std::ranges::begin(input) == value)) {
+      return empty_parse_result<Input>(
+          input, fmt::format("Error: expected {} but saw {}",
+                             detail::describe_element(value),
+                             detail::describe_input_front(input)));
+    }
+    return make_parse_result(detail::input_slice(input, 0, 1),
+                             detail::input_slice(input, 1));
+  });
+}
+
+// Matches one element for which pred is true.
+template <ParseInput Input, typename F>
+Parser<Input, Input> parse_element_if(F pred) {
+  return Parser<Input, Input>([pred](Input input) {
+    if (input.empty() || !pred(*std::ranges::begin(input))) {
+      return empty_parse_result<Input>(
+          input, fmt::format("Error: unexpected {}",
+                             detail::describe_input_front(input)));
+    }
+    return make_parse_result(detail::input_slice(input, 0, 1),
+                             detail::input_slice(input, 1));
+  });
+}
+
+// Matches the elements of expected in order.
+template <ParseInput Input>
+Parser<Input, Input> parse_elements(Input expected) {
+  return Parser<Input, Input>([expected](Input input) {
+    if (input.size() < expected.size() ||
+        !std::ranges::equal(detail::input_slice(input, 0, expected.size()),
+                            expected)) {
+      return empty_parse_result<Input>(
+          input, fmt::format("Error: expected a sequence of {} elements",
+                             expected.size()));
+    }
+    return make_parse_result(detail::input_slice(input, 0, expected.size()),
+                             detail::input_slice(input, expected.size()));
+  });
+}
+
+// Matches the longest run, possibly empty, of elements for which pred is
+// true.
+template <ParseInput Input, typename F>
+Parser<Input, Input> parse_while(F pred) {
+  return Parser<Input, Input>([pred](Input input) {
+    auto first = std::ranges::begin(input);
+    size_t count =
+        std::find_if_not(first, std::ranges::end(input), pred) - first;
+    return make_parse_result(detail::input_slice(input, 0, count),
+                             detail::input_slice(input, count));
+  });
+}
+
+// Matches everything up to, but not including, the first element equal to
+// value, or the rest of the input if there is none.
+template <typename E, ParseInput Input = detail::default_input_t<E>>
+Parser<Input, Input> parse_until(E value) {
+  static_assert(std::is_same_v<std::ranges::range_value_t<Input>, E>);
+  return Parser<Input, Input>([value](Input input) {
+    const E* first = std::ranges::data(input);
+    size_t count =
+        detail::find_element(first, first + input.size(), value) - first;
+    return make_parse_result(detail::input_slice(input, 0, count),
+                             detail::input_slice(input, count));
+  });
+}
+
+// Yields the slice of the input parser consumes in place of its value. The
+// value is never built: the match is made as by recognize. Unlike skip on
+// string parsers, the slice is always contiguous, covering everything in
+// between as well.
+template <typename T, ParseInput Input>
+Parser<Input, Input> parse_span(const Parser<T, Input>& parser) {
+  return Parser<Input, Input>(
+      [parser](Input input) {
+        auto result = parser.check(input);
+        if (!result) {
+          return empty_parse_result<Input>(result.input, result.error);
+        }
+        size_t count = input.size() - result.input.size();
+        return make_parse_result(detail::input_slice(input, 0, count),
+                                 result.input);
+      },
+      [parser](Input input) { return parser.check(input); });
+}
+
+// Lazy iteration.
+//
+// parse_iter yields values through std::generator where the standard library
+// has it. Older libraries get a minimal input-range generator with the same
+// interface for range-for loops.
+
+namespace detail {
+template <typename T>
+class generator {
+ public:
+  struct promise_type {
+    std::optional<T> value;
+    std::exception_ptr exception;
+
+    generator get_return_object() {
+      return generator(
+          std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    template <typename U>
+    std::suspend_always yield_value(U&& val) {
+      value.emplace(std::forward<U>(val));
+      return {};
+    }
+    void return_void() {}
+    void unhandled_exception() { exception = std::current_exception(); }
+  };
+
+  class iterator {
+   public:
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+
+    iterator() = default;
+    explicit iterator(std::coroutine_handle<promise_type> handle)
+        : handle_(handle) {}
+
+    T&& operator*() const { return std::move(*handle_.promise().value); }
+    iterator& operator++() {
+      resume(handle_);
+      return *this;
+    }
+    void operator++(int) { ++*this; }
+    bool operator==(std::default_sentinel_t) const {
+      return !handle_ || handle_.done();
+    }
+
+   private:
+    std::coroutine_handle<promise_type> handle_;
+  };
+
+  generator(generator&& other) noexcept
+      : handle_(std::exchange(other.handle_, {})) {}
+  generator& operator=(generator&& other) noexcept {
+    std::swap(handle_, other.handle_);
+    return *this;
+  }
+  ~generator() {
+    if (handle_) {
+      handle_.destroy();
+    }
+  }
+
+  iterator begin() {
+    resume(handle_);
+    return iterator(handle_);
+  }
+  std::default_sentinel_t end() const { return {}; }
+
+ private:
+  explicit generator(std::coroutine_handle<promise_type> handle)
+      : handle_(handle) {}
+
+  static void resume(std::coroutine_handle<promise_type> handle) {
+    handle.promise().value.reset();
+    handle.resume();
+    if (handle.promise().exception) {
+      std::rethrow_exception(handle.promise().exception);
+    }
+  }
+
+  std::coroutine_handle<promise_type> handle_;
+};
+}  // namespace detail
+
+#if defined(__cpp_lib_generator)
 template <typename T>
-Parser<T> parse_ref(const Parser<T>& parser) {
-  return Parser<T>([&](std::string_view input) { return parser(input); });
+using Generator = std::generator<T>;
+#else
+template <typename T>
+using Generator = detail::generator<T>;
+#endif
+
+// Applies parser repeatedly to input, yielding each value as soon as it is
+// parsed. Only the current value and position are held, so consumers can
+// stream results somewhere else or stop early. Iteration ends at the first
+// failure or at the end of input; if remaining is given it is updated to the
+// unparsed input as each value is produced. input must outlive the
+// generator.
+template <typename T, typename Input>
+Generator<T> parse_iter(Parser<T, Input> parser,
+                        std::type_identity_t<Input> input,
+                        std::type_identity_t<Input>* remaining = nullptr) {
+  if (remaining) {
+    *remaining = input;
+  }
+  while (!input.empty()) {
+    auto result = parser(input);
+    if (!result) {
+      break;
+    }
+    bool progressed = result.input.size() != input.size();
+    input = result.input;
+    if (remaining) {
+      *remaining = input;
+    }
+    co_yield std::move(result.value());
+    if (!progressed) {
+      break;
+    }
+  }
 }
 
+// Deferred actions.
+//
+// transform runs its function as soon as its parser succeeds, even inside
+// an alternative that is abandoned later, which wastes the construction of
+// whatever it builds. Under parse_with_actions, transform_deferred appends
+// its action to a tape instead. When an alternative fails, or_else,
+// parse_opt, parse_some, parse_n, parse_fold, and_not and recover_to cut
+// the tape back to where it was when the alternative started, and
+// parse_peek and parse_not always do. Once the
+// whole parse succeeds, the actions that are left run in the order they
+// were recorded, so an action always runs after the actions for the values
+// it was given.
+
+struct ActionStats {
+  size_t recorded = 0;   // actions appended to the tape
+  size_t discarded = 0;  // actions dropped with an abandoned alternative
+};
+
+namespace detail {
+class action_tape {
+ public:
+  size_t size() const { return actions_.size(); }
+
+  void record(std::function<void()> action) {
+    actions_.push_back(std::move(action));
+    ++stats_.recorded;
+  }
+
+  void rewind(size_t size) {
+    stats_.discarded += actions_.size() - size;
+    actions_.resize(size);
+  }
+
+  // Moves the actions of a sub-parse's tape onto the end of this one.
+  void append(action_tape& other) {
+    actions_.insert(actions_.end(),
+                    std::make_move_iterator(other.actions_.begin()),
+                    std::make_move_iterator(other.actions_.end()));
+    other.actions_.clear();
+    stats_.recorded += other.stats_.recorded;
+    stats_.discarded += other.stats_.discarded;
+  }
+
+  void run() {
+    for (auto& action : actions_) {
+      action();
+    }
+    actions_.clear();
+  }
+
+  const ActionStats& stats() const { return stats_; }
+
+ private:
+  std::vector<std::function<void()>> actions_;
+  ActionStats stats_;
+};
+
+action_tape*& current_tape() { return current_context().tape; }
+
+void record_or_run(std::function<void()> action) {
+  if (action_tape* tape = current_tape()) {
+    tape->record(std::move(action));
+  } else {
+    action();
+  }
+}
+}  // namespace detail
+
+// Runs parser over input recording deferred actions, then runs the actions
+// if the parse succeeded. If stats isn't null it reports how many actions
+// were recorded and how many were skipped because their alternative was
+// abandoned.
+template <typename T, typename Input>
+ParseResult<T, Input> parse_with_actions(const Parser<T, Input>& parser,
+                                         std::type_identity_t<Input> input,
+                                         ActionStats* stats = nullptr) {
+  detail::action_tape tape;
+  detail::action_tape* previous = detail::current_tape();
+  detail::current_tape() = &tape;
+  struct restore {
+    detail::action_tape* previous;
+    ~restore() { detail::current_tape() = previous; }
+  } guard{.previous = previous};
+
+  auto result = parser(input);
+  detail::current_tape() = previous;
+  if (result) {
+    tape.run();
+  }
+  if (stats != nullptr) {
+    *stats = tape.stats();
+  }
+  return result;
+}
+
+// Error recovery.
+//
+// Normally a parse stops at the first error. Wrapping part of a grammar in
+// recover_to marks a point where, if a RecoveryScope is active, the error is
+// recorded and parsing resumes after the next match of a sync parser.
+
+// An error found outside the scope's document, such as in a buffer parsed
+// by a nested grammar, has no position: its offset is npos and its line and
+// column are 0.
+struct Diagnostic {
+  size_t offset;
+  size_t line;    // 1 based
+  size_t column;  // 1 based
+  std::string message;
+};
+
+std::ostream& operator<<(std::ostream& out, const Diagnostic& diag) {
+  if (diag.line != 0) {
+    out << diag.line << ":" << diag.column << ": ";
+  }
+  return out << diag.message;
+}
+
+namespace detail {
+struct recovery_state {
+  std::string_view document;
+  std::vector<Diagnostic> diagnostics;
+};
+
+recovery_state*& current_recovery() { return current_context().recovery; }
+
+void record_diagnostic(recovery_state& state, std::string_view at,
+                       const std::string& message) {
+  // Compared as integers, since pointers into different buffers aren't
+  // ordered.
+  auto begin = reinterpret_cast<uintptr_t>(state.document.data());
+  auto where = reinterpret_cast<uintptr_t>(at.data());
+  if (where < begin || where > begin + state.document.size()) {
+    state.diagnostics.push_back(Diagnostic{.offset = std::string_view::npos,
+                                           .line = 0,
+                                           .column = 0,
+                                           .message = message});
+    return;
+  }
+  size_t offset = where - begin;
+  std::string_view before = state.document.substr(0, offset);
+  size_t line = std::count(before.begin(), before.end(), '\n') + 1;
+  size_t line_start = before.rfind('\n');
+  size_t column =
+      offset - (line_start == std::string_view::npos ? 0 : line_start + 1) + 1;
+  state.diagnostics.push_back(Diagnostic{
+      .offset = offset, .line = line, .column = column, .message = message});
+}
+
+backtrack_mark mark_backtrack() {
+  action_tape* tape = current_tape();
+  recovery_state* recovery = current_recovery();
+  return backtrack_mark{
+      .tape = tape,
+      .size = tape ? tape->size() : 0,
+      .recovery = recovery,
+      .diagnostics = recovery ? recovery->diagnostics.size() : 0};
+}
+
+void backtrack(const backtrack_mark& mark) {
+  if (mark.tape) {
+    mark.tape->rewind(mark.size);
+  }
+  if (mark.recovery) {
+    mark.recovery->diagnostics.resize(mark.diagnostics);
+  }
+}
+}  // namespace detail
+
+// Enables recovery for parses of document on this thread while alive.
+// Scopes nest; the innermost one collects the diagnostics.
+class RecoveryScope {
+ public:
+  explicit RecoveryScope(std::string_view document)
+      : previous_(detail::current_recovery()) {
+    state_.document = document;
+    detail::current_recovery() = &state_;
+  }
+  ~RecoveryScope() { detail::current_recovery() = previous_; }
+
+  RecoveryScope(const RecoveryScope&) = delete;
+  RecoveryScope& operator=(const RecoveryScope&) = delete;
+
+  const std::vector<Diagnostic>& diagnostics() const {
+    return state_.diagnostics;
+  }
+
+ private:
+  detail::recovery_state state_;
+  detail::recovery_state* previous_;
+};
+
 template <typename T>
-Parser<T> parse_recursive(
-    std::function<Parser<T>(const Parser<T>&)> make_parser) {
-  auto parser_ptr = std::make_shared<Parser<T>>(parse_never<T>());
-  *parser_ptr = make_parser(*parser_ptr);
-
-  return Parser<T>([parser_ptr](std::string_view input) {
-    // Copies shared_ptr by value which then holds the reference.
-    return (*parser_ptr)(input);
-  });
+struct RecoveryResult {
+  ParseResult<T> result;
+  std::vector<Diagnostic> diagnostics;
+};
+
+// Runs parser over input with recovery enabled, returning the (possibly
+// partial) result along with every error that was recovered from.
+template <typename T>
+RecoveryResult<T> parse_with_recovery(const Parser<T>& parser,
+                                      std::string_view input) {
+  RecoveryScope scope(input);
+  auto result = parser(input);
+  return RecoveryResult<T>{.result = std::move(result),
+                           .diagnostics = scope.diagnostics()};
+}
+
+namespace detail {
+// Records the error of a parse that failed from input and skips past the
+// next match of sync. Yields where to resume, or nothing if recovery isn't
+// enabled.
+template <typename S>
+std::optional<std::string_view> recover(std::string_view input,
+                                        std::string_view at,
+                                        const ParseError& error,
+                                        const Parser<S>& sync) {
+  recovery_state* state = current_recovery();
+  if (state == nullptr) {
+    return std::nullopt;
+  }
+
+  // Resume from wherever the error was found, if the failing parser
+  // reported a position past the start.
+  if (at.data() < input.data() || at.data() > input.data() + input.size()) {
+    at = input;
+  }
+  record_diagnostic(*state, at, std::string(error));
+
+  std::string_view rest = at;
+  while (!rest.empty()) {
+    auto sync_result = sync.check(rest);
+    if (sync_result) {
+      return sync_result.input;
+    }
+    rest.remove_prefix(1);
+  }
+  return rest;
+}
+}  // namespace detail
+
+// On success yields the value of parser. On failure inside a RecoveryScope
+// the error is recorded and input is skipped up to and including the next
+// match of sync, yielding nullopt. If sync is never found the rest of the
+// input is skipped. Outside a RecoveryScope failures propagate as usual.
+template <typename T, typename S>
+Parser<std::optional<T>> recover_to(const Parser<T>& parser,
+                                    const Parser<S>& sync) {
+  return Parser<std::optional<T>>(
+      [parser, sync](std::string_view input) {
+        detail::backtrack_mark mark = detail::mark_backtrack();
+        auto result = parser(input);
+        if (result) {
+          return make_parse_result(std::optional<T>(std::move(result.value())),
+                                   result.input);
+        }
+        detail::backtrack(mark);
+        auto resume = detail::recover(input, result.input, result.error, sync);
+        if (!resume) {
+          return empty_parse_result<std::optional<T>>(input, result.error);
+        }
+        return make_parse_result(std::optional<T>(), *resume);
+      },
+      [parser, sync](std::string_view input) {
+        detail::backtrack_mark mark = detail::mark_backtrack();
+        auto result = parser.check(input);
+        if (result) {
+          return result;
+        }
+        detail::backtrack(mark);
+        auto resume = detail::recover(input, result.input, result.error, sync);
+        if (!resume) {
+          return empty_parse_result<unit>(input, result.error);
+        }
+        return make_parse_result(unit{}, *resume);
+      });
 }
 
 #endif  // __PARSER_H__
\ No newline at end of file
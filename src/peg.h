@@ -0,0 +1,1410 @@
+//
+// Copyright 2025 John R. Burkhardt
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the “Software”), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#ifndef __PEG_H__
+#define __PEG_H__
+
+// A PEG backend that compiles grammars to bytecode for a small virtual
+// machine, in the style of LPeg.
+//
+// Parser<T> graphs are opaque closures, so grammars for this backend are
+// built from the Pattern primitives below instead. The VM keeps its own
+// backtrack and call stack, so deep nesting doesn't grow the native stack,
+// and values come back as a list of captured spans rather than by running
+// actions during the parse. to_parser() turns a compiled program back into
+// a StringParser so it can be mixed with the combinators.
+
+#include "parser.h"
+#include <array>
+#include <bitset>
+#include <map>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace peg {
+
+using CharSet = std::bitset<256>;
+
+enum class NodeKind {
+  kChar,      // text[0]
+  kString,    // text
+  kSet,       // set
+  kAny,       // any single char
+  kSequence,  // children in order
+  kChoice,    // first child that matches
+  kStar,      // zero or more of children[0]
+  kPlus,      // one or more of children[0]
+  kOptional,  // zero or one of children[0]
+  kNot,       // children[0] doesn't match here, consumes nothing
+  kAnd,       // children[0] matches here, consumes nothing
+  kCapture,   // children[0], recording its span under capture
+  kRule,      // reference to the rule named text
+};
+
+struct Node {
+  NodeKind kind;
+  std::string text;
+  CharSet set;
+  int capture = 0;
+  std::vector<std::shared_ptr<const Node>> children;
+};
+
+using NodePtr = std::shared_ptr<const Node>;
+
+// Interns pattern nodes so that structurally equal patterns share a single
+// node. Children are interned before their parents, so two nodes are equal
+// exactly when their own fields and child pointers are, and a lookup never
+// walks a subtree. Passes over a grammar can then memoize on node identity.
+// The store only holds weak references, so nodes are freed with the last
+// pattern that uses them.
+class NodeStore {
+ public:
+  NodePtr intern(Node node) {
+    size_t hash = hash_node(node);
+    auto [begin, end] = nodes_.equal_range(hash);
+    for (auto it = begin; it != end; ++it) {
+      NodePtr existing = it->second.lock();
+      if (existing && shallow_equal(*existing, node)) {
+        return existing;
+      }
+    }
+    if (nodes_.size() >= prune_at_) {
+      std::erase_if(nodes_,
+                    [](const auto& entry) { return entry.second.expired(); });
+      prune_at_ = std::max<size_t>(kMinPrune, 2 * nodes_.size());
+    }
+    auto ptr = std::make_shared<const Node>(std::move(node));
+    nodes_.emplace(hash, ptr);
+    return ptr;
+  }
+
+  // Entries held, including ones for nodes that have since been freed.
+  size_t size() const { return nodes_.size(); }
+
+ private:
+  static constexpr size_t kMinPrune = 1024;
+
+  static size_t hash_node(const Node& node) {
+    size_t hash = static_cast<size_t>(node.kind);
+    auto combine = [&hash](size_t value) {
+      hash ^= value + 0x9e3779b97f4a7c15 + (hash << 6) + (hash >> 2);
+    };
+    combine(std::hash<std::string>()(node.text));
+    combine(std::hash<CharSet>()(node.set));
+    combine(static_cast<size_t>(node.capture));
+    for (const auto& child : node.children) {
+      combine(std::hash<const Node*>()(child.get()));
+    }
+    return hash;
+  }
+
+  static bool shallow_equal(const Node& lhs, const Node& rhs) {
+    return lhs.kind == rhs.kind && lhs.text == rhs.text &&
+           lhs.set == rhs.set && lhs.capture == rhs.capture &&
+           lhs.children == rhs.children;
+  }
+
+  std::unordered_multimap<size_t, std::weak_ptr<const Node>> nodes_;
+  size_t prune_at_ = kMinPrune;
+};
+
+// The store patterns built on this thread are interned in. Nodes are
+// immutable, so finished patterns can be shared with other threads.
+NodeStore& node_store() {
+  static thread_local NodeStore store;
+  return store;
+}
+
+class Pattern {
+ public:
+  explicit Pattern(NodePtr node) : node_(std::move(node)) {}
+
+  const Node& node() const { return *node_; }
+  const NodePtr& ptr() const { return node_; }
+
+ private:
+  NodePtr node_;
+};
+
+namespace detail {
+Pattern make_node(Node node) {
+  return Pattern(node_store().intern(std::move(node)));
+}
+
+Pattern make_node(NodeKind kind, std::vector<Pattern> children) {
+  Node node{.kind = kind};
+  for (auto& child : children) {
+    node.children.push_back(child.ptr());
+  }
+  return make_node(std::move(node));
+}
+}  // namespace detail
+
+Pattern lit(char ch) {
+  return detail::make_node(Node{.kind = NodeKind::kChar, .text = {ch}});
+}
+
+Pattern lit(std::string_view str) {
+  if (str.size() == 1) {
+    return lit(str.front());
+  }
+  return detail::make_node(
+      Node{.kind = NodeKind::kString, .text = std::string(str)});
+}
+
+Pattern set(const CharSet& chars) {
+  return detail::make_node(Node{.kind = NodeKind::kSet, .set = chars});
+}
+
+Pattern range(char first, char last) {
+  CharSet chars;
+  for (int ch = static_cast<unsigned char>(first);
+       ch <= static_cast<unsigned char>(last); ++ch) {
+    chars.set(ch);
+  }
+  return set(chars);
+}
+
+Pattern any_of(std::string_view str) {
+  CharSet chars;
+  for (char ch : str) {
+    chars.set(static_cast<unsigned char>(ch));
+  }
+  return set(chars);
+}
+
+Pattern none_of(std::string_view str) {
+  CharSet chars;
+  for (char ch : str) {
+    chars.set(static_cast<unsigned char>(ch));
+  }
+  return set(~chars);
+}
+
+Pattern any() { return detail::make_node(Node{.kind = NodeKind::kAny}); }
+
+Pattern digit() { return range('0', '9'); }
+
+Pattern alpha() {
+  return set(range('a', 'z').node().set | range('A', 'Z').node().set);
+}
+
+Pattern alnum() { return set(alpha().node().set | digit().node().set); }
+
+Pattern space() { return any_of(" \t\n\r\f\v"); }
+
+Pattern seq(std::initializer_list<Pattern> patterns) {
+  return detail::make_node(NodeKind::kSequence, patterns);
+}
+
+Pattern choice(std::initializer_list<Pattern> patterns) {
+  return detail::make_node(NodeKind::kChoice, patterns);
+}
+
+Pattern star(Pattern pattern) {
+  return detail::make_node(NodeKind::kStar, {pattern});
+}
+
+Pattern plus(Pattern pattern) {
+  return detail::make_node(NodeKind::kPlus, {pattern});
+}
+
+Pattern opt(Pattern pattern) {
+  return detail::make_node(NodeKind::kOptional, {pattern});
+}
+
+Pattern not_(Pattern pattern) {
+  return detail::make_node(NodeKind::kNot, {pattern});
+}
+
+Pattern and_(Pattern pattern) {
+  return detail::make_node(NodeKind::kAnd, {pattern});
+}
+
+Pattern capture(int id, Pattern pattern) {
+  Node node{.kind = NodeKind::kCapture, .capture = id};
+  node.children.push_back(pattern.ptr());
+  return detail::make_node(std::move(node));
+}
+
+Pattern ref(std::string_view rule) {
+  return detail::make_node(
+      Node{.kind = NodeKind::kRule, .text = std::string(rule)});
+}
+
+Pattern operator>>(Pattern lhs, Pattern rhs) { return seq({lhs, rhs}); }
+Pattern operator|(Pattern lhs, Pattern rhs) { return choice({lhs, rhs}); }
+Pattern operator!(Pattern pattern) { return not_(pattern); }
+
+// A set of named, possibly mutually recursive rules. The first rule defined
+// is where matching starts.
+class Grammar {
+ public:
+  Grammar& define(std::string_view name, Pattern pattern) {
+    rules_.emplace_back(std::string(name), std::move(pattern));
+    return *this;
+  }
+
+  const std::vector<std::pair<std::string, Pattern>>& rules() const {
+    return rules_;
+  }
+
+  const Pattern* find(std::string_view name) const {
+    for (const auto& [rule_name, pattern] : rules_) {
+      if (rule_name == name) {
+        return &pattern;
+      }
+    }
+    return nullptr;
+  }
+
+ private:
+  std::vector<std::pair<std::string, Pattern>> rules_;
+};
+
+namespace detail {
+std::string dump_char(unsigned char ch, std::string_view specials) {
+  switch (ch) {
+    case '\t':
+      return "\\t";
+    case '\n':
+      return "\\n";
+    case '\r':
+      return "\\r";
+    case '\\':
+      return "\\\\";
+  }
+  if (specials.find(static_cast<char>(ch)) != std::string_view::npos) {
+    return fmt::format("\\{}", static_cast<char>(ch));
+  }
+  if (ch < 0x20 || ch >= 0x7f) {
+    return fmt::format("\\x{:02x}", ch);
+  }
+  return std::string(1, static_cast<char>(ch));
+}
+
+// Runs of three or more chars are written as ranges. Sets with more than
+// half of the chars are written negated.
+std::string dump_set(const CharSet& set) {
+  bool negated = set.count() > 128;
+  CharSet chars = negated ? ~set : set;
+  std::string out = negated ? "[^" : "[";
+  for (int ch = 0; ch < 256;) {
+    if (!chars.test(ch)) {
+      ++ch;
+      continue;
+    }
+    int last = ch;
+    while (last + 1 < 256 && chars.test(last + 1)) {
+      ++last;
+    }
+    if (last - ch >= 2) {
+      out += dump_char(ch, "]-^") + "-" + dump_char(last, "]-^");
+    } else {
+      for (int i = ch; i <= last; ++i) {
+        out += dump_char(i, "]-^");
+      }
+    }
+    ch = last + 1;
+  }
+  return out + "]";
+}
+
+// Precedence, loosest first: choice, sequence, prefix (! &), suffix (* + ?).
+void dump_node(const Node& node, int precedence, std::string& out) {
+  auto dump_children = [&](std::string_view separator, int inner) {
+    for (size_t i = 0; i < node.children.size(); ++i) {
+      if (i > 0) {
+        out += separator;
+      }
+      dump_node(*node.children[i], inner, out);
+    }
+  };
+  switch (node.kind) {
+    case NodeKind::kChar:
+      out += "'" + dump_char(node.text[0], "'") + "'";
+      break;
+    case NodeKind::kString:
+      out += '"';
+      for (char ch : node.text) {
+        out += dump_char(ch, "\"");
+      }
+      out += '"';
+      break;
+    case NodeKind::kSet:
+      out += dump_set(node.set);
+      break;
+    case NodeKind::kAny:
+      out += ".";
+      break;
+    case NodeKind::kSequence:
+    case NodeKind::kChoice: {
+      bool sequence = node.kind == NodeKind::kSequence;
+      if (node.children.empty()) {
+        out += sequence ? "\"\"" : "!\"\"";
+        break;
+      }
+      int own = sequence ? 1 : 0;
+      if (precedence > own) {
+        out += "(";
+      }
+      dump_children(sequence ? " " : " / ", own + 1);
+      if (precedence > own) {
+        out += ")";
+      }
+      break;
+    }
+    case NodeKind::kStar:
+    case NodeKind::kPlus:
+    case NodeKind::kOptional:
+      dump_node(*node.children[0], 3, out);
+      out += node.kind == NodeKind::kStar   ? "*"
+             : node.kind == NodeKind::kPlus ? "+"
+                                            : "?";
+      break;
+    case NodeKind::kNot:
+    case NodeKind::kAnd:
+      if (precedence > 2) {
+        out += "(";
+      }
+      out += node.kind == NodeKind::kNot ? "!" : "&";
+      dump_node(*node.children[0], 2, out);
+      if (precedence > 2) {
+        out += ")";
+      }
+      break;
+    case NodeKind::kCapture:
+      out += fmt::format("{{{}: ", node.capture);
+      dump_node(*node.children[0], 0, out);
+      out += "}";
+      break;
+    case NodeKind::kRule:
+      out += node.text;
+      break;
+  }
+}
+}  // namespace detail
+
+// PEG notation for pattern, for debugging and tests. Captures are written
+// {id: pattern}.
+std::string dump(const Pattern& pattern) {
+  std::string out;
+  detail::dump_node(pattern.node(), 0, out);
+  return out;
+}
+
+// One "name <- pattern" line per rule.
+std::string dump(const Grammar& grammar) {
+  std::string out;
+  for (const auto& [name, pattern] : grammar.rules()) {
+    out += name + " <- " + dump(pattern) + "\n";
+  }
+  return out;
+}
+
+namespace detail {
+class DfaBuilder;
+}
+
+// A table-driven automaton for a regular pattern: one without rules,
+// captures or lookahead. It scans forward one char at a time and never
+// backtracks.
+//
+// PEG choice is ordered and repetition is greedy, which in general is not
+// the longest-match rule an automaton implements. compile() only accepts
+// patterns where the two agree: the alternatives of a choice start with
+// different chars and only the last can match empty, and nothing that can
+// follow an optional or repeated part starts the way that part does. Under
+// those (LL(1)) conditions the pattern matches exactly the longest prefix
+// the automaton accepts.
+class Dfa {
+ public:
+  // Returns nullopt if node isn't regular, breaks the conditions above or
+  // needs more than max_states states.
+  static std::optional<Dfa> compile(const Node& node, size_t max_states = 256);
+
+  static std::optional<Dfa> compile(const Pattern& pattern,
+                                    size_t max_states = 256) {
+    return compile(pattern.node(), max_states);
+  }
+
+  // Length of the longest prefix of input the pattern matches. If stop isn't
+  // null it's set to where the scan ended: the first char with no
+  // transition, or the end of input.
+  std::optional<size_t> match(std::string_view input,
+                              size_t* stop = nullptr) const {
+    const unsigned char* str =
+        reinterpret_cast<const unsigned char*>(input.data());
+    std::optional<size_t> end;
+    if (accepting_[0]) {
+      end = 0;
+    }
+    // States are stored premultiplied by the class count.
+    int32_t state = 0;
+    size_t pos = 0;
+    for (; pos < input.size(); ++pos) {
+      state = next_[state + classes_[str[pos]]];
+      if (state < 0) {
+        break;
+      }
+      if (accepting_[state / class_count_]) {
+        end = pos + 1;
+      }
+    }
+    if (stop != nullptr) {
+      *stop = pos;
+    }
+    return end;
+  }
+
+  size_t states() const { return accepting_.size(); }
+
+ private:
+  friend class detail::DfaBuilder;
+
+  std::array<uint8_t, 256> classes_{};
+  int32_t class_count_ = 0;
+  std::vector<int32_t> next_;  // -1 when there is no transition
+  std::vector<uint8_t> accepting_;
+};
+
+namespace detail {
+
+bool regular(const Node& node) {
+  switch (node.kind) {
+    case NodeKind::kNot:
+    case NodeKind::kAnd:
+    case NodeKind::kCapture:
+    case NodeKind::kRule:
+      return false;
+    default:
+      return std::all_of(node.children.begin(), node.children.end(),
+                         [](const NodePtr& child) { return regular(*child); });
+  }
+}
+
+struct FirstSet {
+  CharSet chars;
+  bool nullable = false;
+};
+
+// The chars a match of node can start with, and whether it can be empty.
+FirstSet first(const Node& node) {
+  switch (node.kind) {
+    case NodeKind::kChar:
+    case NodeKind::kString:
+      if (node.text.empty()) {
+        return {.nullable = true};
+      }
+      return {.chars =
+                  CharSet().set(static_cast<unsigned char>(node.text[0]))};
+    case NodeKind::kSet:
+      return {.chars = node.set};
+    case NodeKind::kAny:
+      return {.chars = ~CharSet()};
+    case NodeKind::kSequence: {
+      FirstSet result{.nullable = true};
+      for (const auto& child : node.children) {
+        FirstSet child_first = first(*child);
+        result.chars |= child_first.chars;
+        if (!child_first.nullable) {
+          result.nullable = false;
+          break;
+        }
+      }
+      return result;
+    }
+    case NodeKind::kChoice: {
+      FirstSet result;
+      for (const auto& child : node.children) {
+        FirstSet child_first = first(*child);
+        result.chars |= child_first.chars;
+        result.nullable |= child_first.nullable;
+      }
+      return result;
+    }
+    case NodeKind::kStar:
+    case NodeKind::kOptional:
+      return {.chars = first(*node.children[0]).chars, .nullable = true};
+    default:
+      return first(*node.children[0]);
+  }
+}
+
+// Checks the conditions under which ordered choice and greedy repetition
+// agree with longest match, given the chars that can follow node.
+bool deterministic(const Node& node, const CharSet& follow) {
+  switch (node.kind) {
+    case NodeKind::kSequence: {
+      CharSet next = follow;
+      for (auto it = node.children.rbegin(); it != node.children.rend();
+           ++it) {
+        if (!deterministic(**it, next)) {
+          return false;
+        }
+        FirstSet child_first = first(**it);
+        next = child_first.nullable ? next | child_first.chars
+                                    : child_first.chars;
+      }
+      return true;
+    }
+    case NodeKind::kChoice: {
+      CharSet seen;
+      for (size_t i = 0; i < node.children.size(); ++i) {
+        FirstSet child_first = first(*node.children[i]);
+        if ((seen & child_first.chars).any() ||
+            (child_first.nullable && i + 1 != node.children.size()) ||
+            (child_first.nullable &&
+             (follow & (seen | child_first.chars)).any()) ||
+            !deterministic(*node.children[i], follow)) {
+          return false;
+        }
+        seen |= child_first.chars;
+      }
+      return true;
+    }
+    case NodeKind::kStar:
+    case NodeKind::kPlus: {
+      FirstSet body = first(*node.children[0]);
+      if (body.nullable || (body.chars & follow).any()) {
+        return false;
+      }
+      return deterministic(*node.children[0], body.chars | follow);
+    }
+    case NodeKind::kOptional: {
+      FirstSet body = first(*node.children[0]);
+      if ((body.chars & follow).any()) {
+        return false;
+      }
+      return deterministic(*node.children[0], follow);
+    }
+    default:
+      return true;
+  }
+}
+
+// Thompson construction to an NFA, then subset construction over classes
+// of bytes that no set in the pattern tells apart.
+class DfaBuilder {
+ public:
+  std::optional<Dfa> build(const Node& node, size_t max_states) {
+    if (!regular(node) || !deterministic(node, CharSet())) {
+      return std::nullopt;
+    }
+    int32_t start = add_state();
+    int32_t accept = add_nfa(node, start);
+    compute_classes();
+
+    Dfa dfa;
+    dfa.classes_ = classes_;
+    dfa.class_count_ = class_count_;
+    std::map<std::vector<int32_t>, int32_t> ids;
+    std::vector<std::vector<int32_t>> pending{closure({start})};
+    ids[pending[0]] = 0;
+    for (size_t i = 0; i < pending.size(); ++i) {
+      std::vector<int32_t> current = pending[i];
+      dfa.accepting_.push_back(
+          std::binary_search(current.begin(), current.end(), accept));
+      for (int32_t cls = 0; cls < class_count_; ++cls) {
+        std::vector<int32_t> moved;
+        for (int32_t state : current) {
+          const NfaState& nfa_state = states_[state];
+          if (nfa_state.target >= 0 &&
+              nfa_state.chars.test(representatives_[cls])) {
+            moved.push_back(nfa_state.target);
+          }
+        }
+        if (moved.empty()) {
+          dfa.next_.push_back(-1);
+          continue;
+        }
+        moved = closure(std::move(moved));
+        auto [it, inserted] =
+            ids.emplace(moved, static_cast<int32_t>(pending.size()));
+        if (inserted) {
+          if (pending.size() == max_states) {
+            return std::nullopt;
+          }
+          pending.push_back(std::move(moved));
+        }
+        dfa.next_.push_back(it->second * class_count_);
+      }
+    }
+    return dfa;
+  }
+
+ private:
+  // Each state has epsilon edges and at most one edge on a set of chars.
+  struct NfaState {
+    std::vector<int32_t> epsilon;
+    CharSet chars;
+    int32_t target = -1;
+  };
+
+  int32_t add_state() {
+    states_.emplace_back();
+    return static_cast<int32_t>(states_.size() - 1);
+  }
+
+  int32_t add_chars(const CharSet& chars, int32_t in) {
+    int32_t from = add_state();
+    int32_t to = add_state();
+    states_[in].epsilon.push_back(from);
+    states_[from].chars = chars;
+    states_[from].target = to;
+    return to;
+  }
+
+  // Adds node starting from in and returns the state it ends in.
+  int32_t add_nfa(const Node& node, int32_t in) {
+    switch (node.kind) {
+      case NodeKind::kChar:
+      case NodeKind::kSet:
+      case NodeKind::kAny:
+        return add_chars(first(node).chars, in);
+      case NodeKind::kString:
+        for (char ch : node.text) {
+          in = add_chars(CharSet().set(static_cast<unsigned char>(ch)), in);
+        }
+        return in;
+      case NodeKind::kSequence:
+        for (const auto& child : node.children) {
+          in = add_nfa(*child, in);
+        }
+        return in;
+      case NodeKind::kChoice: {
+        int32_t out = add_state();
+        for (const auto& child : node.children) {
+          states_[add_nfa(*child, in)].epsilon.push_back(out);
+        }
+        return out;
+      }
+      case NodeKind::kStar:
+        return add_loop(*node.children[0], in);
+      case NodeKind::kPlus:
+        return add_loop(*node.children[0], add_nfa(*node.children[0], in));
+      case NodeKind::kOptional: {
+        int32_t out = add_nfa(*node.children[0], in);
+        states_[in].epsilon.push_back(out);
+        return out;
+      }
+      default:
+        return in;
+    }
+  }
+
+  int32_t add_loop(const Node& body, int32_t in) {
+    int32_t loop = add_state();
+    states_[in].epsilon.push_back(loop);
+    states_[add_nfa(body, loop)].epsilon.push_back(loop);
+    return loop;
+  }
+
+  // The sorted set of states reachable from states by epsilon edges.
+  std::vector<int32_t> closure(std::vector<int32_t> states) const {
+    std::vector<bool> seen(states_.size());
+    std::vector<int32_t> result;
+    while (!states.empty()) {
+      int32_t state = states.back();
+      states.pop_back();
+      if (seen[state]) {
+        continue;
+      }
+      seen[state] = true;
+      result.push_back(state);
+      for (int32_t next : states_[state].epsilon) {
+        states.push_back(next);
+      }
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+  }
+
+  void compute_classes() {
+    std::vector<const CharSet*> sets;
+    for (const auto& state : states_) {
+      if (state.target >= 0) {
+        sets.push_back(&state.chars);
+      }
+    }
+    std::map<std::vector<bool>, int32_t> ids;
+    for (int byte = 0; byte < 256; ++byte) {
+      std::vector<bool> signature;
+      for (const CharSet* chars : sets) {
+        signature.push_back(chars->test(byte));
+      }
+      auto [it, inserted] = ids.emplace(signature, class_count_);
+      if (inserted) {
+        representatives_.push_back(byte);
+        ++class_count_;
+      }
+      classes_[byte] = static_cast<uint8_t>(it->second);
+    }
+  }
+
+  std::vector<NfaState> states_;
+  std::array<uint8_t, 256> classes_{};
+  std::vector<int> representatives_;
+  int32_t class_count_ = 0;
+};
+
+}  // namespace detail
+
+std::optional<Dfa> Dfa::compile(const Node& node, size_t max_states) {
+  return detail::DfaBuilder().build(node, max_states);
+}
+
+// Adapts an automaton to a StringParser yielding the matched text.
+StringParser to_parser(std::shared_ptr<const Dfa> dfa) {
+  return StringParser([dfa](std::string_view input) {
+    size_t stop = 0;
+    auto end = dfa->match(input, &stop);
+    if (!end) {
+      return empty_parse_result<std::string_view>(
+          input, fmt::format("Error: unexpected {} at offset {}",
+                             ::detail::describe_front(input.substr(stop)),
+                             stop));
+    }
+    return make_parse_result(input.substr(0, *end), input.substr(*end));
+  });
+}
+
+enum class Opcode : uint8_t {
+  kChar,           // match char arg
+  kSet,            // match a char in sets[arg]
+  kAny,            // match any char
+  kString,         // match strings[arg]
+  kSpan,           // match zero or more chars in sets[arg]
+  kChoice,         // push a backtrack entry resuming at arg
+  kCommit,         // pop the backtrack entry and jump to arg
+  kPartialCommit,  // update the backtrack entry to here and jump to arg
+  kBackCommit,     // pop the backtrack entry, restoring its position
+  kFail,           // backtrack
+  kFailTwice,      // pop the backtrack entry then backtrack
+  kCall,           // push a return address and jump to arg
+  kReturn,         // pop the return address and jump to it
+  kJump,           // jump to arg
+  kOpenCapture,    // start capture arg
+  kCloseCapture,   // end the innermost open capture
+  kEnd,            // match succeeded
+  kDfa,            // match the longest prefix accepted by dfas[arg]
+};
+
+struct Instruction {
+  Opcode op;
+  int32_t arg = 0;
+};
+
+struct Capture {
+  int id;
+  std::string_view text;
+};
+
+struct Match {
+  bool ok = false;
+  size_t end = 0;  // length of the match, or the farthest failure
+  std::vector<Capture> captures;
+  std::string error;
+
+  operator bool() const { return ok; }
+};
+
+class Program;
+
+namespace detail {
+class Compiler;
+}
+
+// A compiled grammar. Programs are immutable after compilation and match()
+// keeps all of its state on the heap, so one program can be shared between
+// threads and nesting depth is bounded only by max_stack.
+class Program {
+ public:
+  static Program compile(const Grammar& grammar);
+
+  static Program compile(const Pattern& pattern) {
+    return compile(Grammar().define("start", pattern));
+  }
+
+  Match match(std::string_view input) const;
+
+  // Maximum backtrack and call entries before a match fails rather than
+  // running out of memory on runaway nesting.
+  void set_max_stack(size_t max_stack) { max_stack_ = max_stack; }
+
+  const std::vector<Instruction>& code() const { return code_; }
+
+  // One instruction per line, for debugging and tests.
+  std::string disassemble() const;
+
+ private:
+  friend class detail::Compiler;
+
+  std::vector<Instruction> code_;
+  std::vector<CharSet> sets_;
+  std::vector<std::string> strings_;
+  std::vector<Dfa> dfas_;
+  size_t max_stack_ = 1 << 20;
+};
+
+namespace detail {
+
+const Pattern& find_rule(const Grammar& grammar, const std::string& name) {
+  const Pattern* pattern = grammar.find(name);
+  if (pattern == nullptr) {
+    throw std::invalid_argument(fmt::format("undefined rule {}", name));
+  }
+  return *pattern;
+}
+
+// True if node can succeed without consuming input. Rules being visited are
+// assumed not to be, which is the least fixed point for the recursion.
+bool nullable(const Grammar& grammar, const Node& node,
+              std::vector<std::string>& visiting) {
+  switch (node.kind) {
+    case NodeKind::kChar:
+    case NodeKind::kSet:
+    case NodeKind::kAny:
+      return false;
+    case NodeKind::kString:
+      return node.text.empty();
+    case NodeKind::kStar:
+    case NodeKind::kOptional:
+    case NodeKind::kNot:
+    case NodeKind::kAnd:
+      return true;
+    case NodeKind::kPlus:
+    case NodeKind::kCapture:
+      return nullable(grammar, *node.children[0], visiting);
+    case NodeKind::kSequence:
+      for (const auto& child : node.children) {
+        if (!nullable(grammar, *child, visiting)) {
+          return false;
+        }
+      }
+      return true;
+    case NodeKind::kChoice:
+      for (const auto& child : node.children) {
+        if (nullable(grammar, *child, visiting)) {
+          return true;
+        }
+      }
+      return false;
+    case NodeKind::kRule: {
+      if (std::find(visiting.begin(), visiting.end(), node.text) !=
+          visiting.end()) {
+        return false;
+      }
+      visiting.push_back(node.text);
+      bool result =
+          nullable(grammar, find_rule(grammar, node.text).node(), visiting);
+      visiting.pop_back();
+      return result;
+    }
+  }
+  return false;
+}
+
+class Compiler {
+ public:
+  Compiler(const Grammar& grammar, Program& program)
+      : grammar_(grammar), program_(program) {}
+
+  void compile() {
+    if (grammar_.rules().empty()) {
+      throw std::invalid_argument("grammar has no rules");
+    }
+    // Entry: call the start rule then stop. Rule bodies follow.
+    calls_.emplace_back(emit(Opcode::kCall), grammar_.rules().front().first);
+    emit(Opcode::kEnd);
+    for (const auto& [name, pattern] : grammar_.rules()) {
+      if (rule_addresses_.contains(name)) {
+        throw std::invalid_argument(fmt::format("rule {} defined twice", name));
+      }
+      rule_addresses_[name] = here();
+      compile_node(pattern.node());
+      emit(Opcode::kReturn);
+    }
+    for (const auto& [address, name] : calls_) {
+      auto it = rule_addresses_.find(name);
+      if (it == rule_addresses_.end()) {
+        throw std::invalid_argument(fmt::format("undefined rule {}", name));
+      }
+      program_.code_[address].arg = it->second;
+    }
+  }
+
+ private:
+  int32_t here() const { return static_cast<int32_t>(program_.code_.size()); }
+
+  int32_t emit(Opcode op, int32_t arg = 0) {
+    program_.code_.push_back(Instruction{.op = op, .arg = arg});
+    return here() - 1;
+  }
+
+  void patch(int32_t address) { program_.code_[address].arg = here(); }
+
+  int32_t add_set(const CharSet& chars) {
+    program_.sets_.push_back(chars);
+    return static_cast<int32_t>(program_.sets_.size() - 1);
+  }
+
+  static std::optional<CharSet> single_char_set(const Node& node) {
+    switch (node.kind) {
+      case NodeKind::kChar: {
+        CharSet chars;
+        chars.set(static_cast<unsigned char>(node.text[0]));
+        return chars;
+      }
+      case NodeKind::kSet:
+        return node.set;
+      case NodeKind::kAny:
+        return ~CharSet();
+      default:
+        return std::nullopt;
+    }
+  }
+
+  void check_repeatable(const Node& body) {
+    std::vector<std::string> visiting;
+    if (nullable(grammar_, body, visiting)) {
+      throw std::invalid_argument(
+          "repetition of a pattern that can match empty input never ends");
+    }
+  }
+
+  void compile_star(const Node& body) {
+    check_repeatable(body);
+    if (auto chars = single_char_set(body)) {
+      emit(Opcode::kSpan, add_set(*chars));
+      return;
+    }
+    //   L1: choice L2
+    //       body
+    //       partial_commit L1
+    //   L2:
+    int32_t loop = emit(Opcode::kChoice);
+    compile_node(body);
+    emit(Opcode::kPartialCommit, loop + 1);
+    patch(loop);
+  }
+
+  void compile_choice(const std::vector<NodePtr>& children, size_t first) {
+    if (first + 1 == children.size()) {
+      compile_node(*children[first]);
+      return;
+    }
+    //       choice L1
+    //       p1
+    //       commit L2
+    //   L1: rest
+    //   L2:
+    int32_t choice = emit(Opcode::kChoice);
+    compile_node(*children[first]);
+    int32_t commit = emit(Opcode::kCommit);
+    patch(choice);
+    compile_choice(children, first + 1);
+    patch(commit);
+  }
+
+  // Regular parts of the grammar that satisfy Dfa's conditions run as a
+  // single instruction. Repeated single chars are already a span.
+  bool compile_dfa(const Node& node) {
+    switch (node.kind) {
+      case NodeKind::kStar:
+      case NodeKind::kPlus:
+        if (single_char_set(*node.children[0])) {
+          return false;
+        }
+        break;
+      case NodeKind::kSequence:
+      case NodeKind::kChoice:
+      case NodeKind::kOptional:
+        break;
+      default:
+        return false;
+    }
+    // Interned subpatterns used in several places are compiled once.
+    auto [it, inserted] = dfa_ids_.try_emplace(&node, -1);
+    if (inserted) {
+      if (auto dfa = Dfa::compile(node)) {
+        program_.dfas_.push_back(std::move(*dfa));
+        it->second = static_cast<int32_t>(program_.dfas_.size() - 1);
+      }
+    }
+    if (it->second < 0) {
+      return false;
+    }
+    emit(Opcode::kDfa, it->second);
+    return true;
+  }
+
+  void compile_node(const Node& node) {
+    if (compile_dfa(node)) {
+      return;
+    }
+    switch (node.kind) {
+      case NodeKind::kChar:
+        emit(Opcode::kChar, static_cast<unsigned char>(node.text[0]));
+        break;
+      case NodeKind::kString:
+        program_.strings_.push_back(node.text);
+        emit(Opcode::kString,
+             static_cast<int32_t>(program_.strings_.size() - 1));
+        break;
+      case NodeKind::kSet:
+        emit(Opcode::kSet, add_set(node.set));
+        break;
+      case NodeKind::kAny:
+        emit(Opcode::kAny);
+        break;
+      case NodeKind::kSequence:
+        for (const auto& child : node.children) {
+          compile_node(*child);
+        }
+        break;
+      case NodeKind::kChoice:
+        if (node.children.empty()) {
+          emit(Opcode::kFail);
+        } else {
+          compile_choice(node.children, 0);
+        }
+        break;
+      case NodeKind::kStar:
+        compile_star(*node.children[0]);
+        break;
+      case NodeKind::kPlus:
+        compile_node(*node.children[0]);
+        compile_star(*node.children[0]);
+        break;
+      case NodeKind::kOptional: {
+        int32_t choice = emit(Opcode::kChoice);
+        compile_node(*node.children[0]);
+        int32_t commit = emit(Opcode::kCommit);
+        patch(choice);
+        patch(commit);
+        break;
+      }
+      case NodeKind::kNot: {
+        int32_t choice = emit(Opcode::kChoice);
+        compile_node(*node.children[0]);
+        emit(Opcode::kFailTwice);
+        patch(choice);
+        break;
+      }
+      case NodeKind::kAnd: {
+        //       choice L1
+        //       p
+        //       back_commit L2
+        //   L1: fail
+        //   L2:
+        int32_t choice = emit(Opcode::kChoice);
+        compile_node(*node.children[0]);
+        int32_t back_commit = emit(Opcode::kBackCommit);
+        patch(choice);
+        emit(Opcode::kFail);
+        patch(back_commit);
+        break;
+      }
+      case NodeKind::kCapture:
+        emit(Opcode::kOpenCapture, node.capture);
+        compile_node(*node.children[0]);
+        emit(Opcode::kCloseCapture);
+        break;
+      case NodeKind::kRule:
+        calls_.emplace_back(emit(Opcode::kCall), node.text);
+        break;
+    }
+  }
+
+  const Grammar& grammar_;
+  Program& program_;
+  std::unordered_map<std::string, int32_t> rule_addresses_;
+  std::vector<std::pair<int32_t, std::string>> calls_;
+  std::unordered_map<const Node*, int32_t> dfa_ids_;  // -1 if there is no DFA
+};
+
+}  // namespace detail
+
+Program Program::compile(const Grammar& grammar) {
+  Program program;
+  detail::Compiler(grammar, program).compile();
+  return program;
+}
+
+Match Program::match(std::string_view input) const {
+  // Backtrack entries have a position; call frames don't.
+  struct Frame {
+    int32_t pc;
+    int64_t pos;
+    size_t captures;
+  };
+  struct CaptureEvent {
+    int id;
+    size_t pos;
+    bool open;
+  };
+
+  std::vector<Frame> stack;
+  std::vector<CaptureEvent> events;
+  const unsigned char* str =
+      reinterpret_cast<const unsigned char*>(input.data());
+  size_t size = input.size();
+  size_t pos = 0;
+  size_t farthest = 0;
+  int32_t pc = 0;
+
+  auto overflow = [&]() {
+    return Match{.end = pos,
+                 .error = fmt::format("Error: stack limit of {} exceeded",
+                                      max_stack_)};
+  };
+
+  for (;;) {
+    const Instruction& instruction = code_[pc];
+    bool failed = false;
+    switch (instruction.op) {
+      case Opcode::kChar:
+        if (pos < size && str[pos] == instruction.arg) {
+          ++pos;
+          ++pc;
+        } else {
+          failed = true;
+        }
+        break;
+      case Opcode::kSet:
+        if (pos < size && sets_[instruction.arg].test(str[pos])) {
+          ++pos;
+          ++pc;
+        } else {
+          failed = true;
+        }
+        break;
+      case Opcode::kAny:
+        if (pos < size) {
+          ++pos;
+          ++pc;
+        } else {
+          failed = true;
+        }
+        break;
+      case Opcode::kString: {
+        const std::string& expected = strings_[instruction.arg];
+        if (input.substr(pos).starts_with(expected)) {
+          pos += expected.size();
+          ++pc;
+        } else {
+          failed = true;
+        }
+        break;
+      }
+      case Opcode::kSpan: {
+        const CharSet& chars = sets_[instruction.arg];
+        while (pos < size && chars.test(str[pos])) {
+          ++pos;
+        }
+        ++pc;
+        break;
+      }
+      case Opcode::kChoice:
+        if (stack.size() >= max_stack_) {
+          return overflow();
+        }
+        stack.push_back(Frame{.pc = instruction.arg,
+                              .pos = static_cast<int64_t>(pos),
+                              .captures = events.size()});
+        ++pc;
+        break;
+      case Opcode::kCommit:
+        stack.pop_back();
+        pc = instruction.arg;
+        break;
+      case Opcode::kPartialCommit:
+        stack.back().pos = static_cast<int64_t>(pos);
+        stack.back().captures = events.size();
+        pc = instruction.arg;
+        break;
+      case Opcode::kBackCommit:
+        pos = static_cast<size_t>(stack.back().pos);
+        events.resize(stack.back().captures);
+        stack.pop_back();
+        pc = instruction.arg;
+        break;
+      case Opcode::kFail:
+        failed = true;
+        break;
+      case Opcode::kFailTwice:
+        stack.pop_back();
+        failed = true;
+        break;
+      case Opcode::kCall:
+        if (stack.size() >= max_stack_) {
+          return overflow();
+        }
+        stack.push_back(Frame{.pc = pc + 1, .pos = -1, .captures = 0});
+        pc = instruction.arg;
+        break;
+      case Opcode::kReturn:
+        pc = stack.back().pc;
+        stack.pop_back();
+        break;
+      case Opcode::kJump:
+        pc = instruction.arg;
+        break;
+      case Opcode::kOpenCapture:
+        events.push_back(
+            CaptureEvent{.id = instruction.arg, .pos = pos, .open = true});
+        ++pc;
+        break;
+      case Opcode::kCloseCapture:
+        events.push_back(CaptureEvent{.id = 0, .pos = pos, .open = false});
+        ++pc;
+        break;
+      case Opcode::kDfa: {
+        // A scan that stops past the end of the match did so partway
+        // through a repetition or option, which the VM records as a failure
+        // there.
+        size_t stop = 0;
+        auto end = dfas_[instruction.arg].match(input.substr(pos), &stop);
+        if (end) {
+          if (stop > *end) {
+            farthest = std::max(farthest, pos + stop);
+          }
+          pos += *end;
+          ++pc;
+        } else {
+          pos += stop;
+          failed = true;
+        }
+        break;
+      }
+      case Opcode::kEnd: {
+        // Captures are listed in the order they were opened.
+        Match match{.ok = true, .end = pos};
+        std::vector<size_t> open;
+        for (const auto& event : events) {
+          if (event.open) {
+            open.push_back(match.captures.size());
+            match.captures.push_back(
+                Capture{.id = event.id, .text = input.substr(event.pos, 0)});
+          } else {
+            Capture& capture = match.captures[open.back()];
+            open.pop_back();
+            size_t start = capture.text.data() - input.data();
+            capture.text = input.substr(start, event.pos - start);
+          }
+        }
+        return match;
+      }
+    }
+
+    if (failed) {
+      farthest = std::max(farthest, pos);
+      while (!stack.empty() && stack.back().pos < 0) {
+        stack.pop_back();
+      }
+      if (stack.empty()) {
+        return Match{.end = farthest,
+                     .error = fmt::format("Error: no match at offset {}",
+                                          farthest)};
+      }
+      pc = stack.back().pc;
+      pos = static_cast<size_t>(stack.back().pos);
+      events.resize(stack.back().captures);
+      stack.pop_back();
+    }
+  }
+}
+
+std::string Program::disassemble() const {
+  static constexpr std::string_view names[] = {
+      "char",       "set",          "any",           "string",
+      "span",       "choice",       "commit",        "partial_commit",
+      "back_commit", "fail",        "fail_twice",    "call",
+      "return",     "jump",         "open_capture",  "close_capture",
+      "end",        "dfa",
+  };
+  std::string out;
+  for (size_t pc = 0; pc < code_.size(); ++pc) {
+    const Instruction& instruction = code_[pc];
+    out += fmt::format("{:4} {}", pc, names[static_cast<int>(instruction.op)]);
+    switch (instruction.op) {
+      case Opcode::kChar:
+        out += fmt::format(" '{}'", static_cast<char>(instruction.arg));
+        break;
+      case Opcode::kString:
+        out += fmt::format(" \"{}\"", strings_[instruction.arg]);
+        break;
+      case Opcode::kSet:
+      case Opcode::kSpan:
+      case Opcode::kChoice:
+      case Opcode::kCommit:
+      case Opcode::kPartialCommit:
+      case Opcode::kBackCommit:
+      case Opcode::kCall:
+      case Opcode::kJump:
+      case Opcode::kOpenCapture:
+      case Opcode::kDfa:
+        out += fmt::format(" {}", instruction.arg);
+        break;
+      default:
+        break;
+    }
+    out += "\n";
+  }
+  return out;
+}
+
+// Adapts a compiled program to a StringParser yielding the matched text.
+StringParser to_parser(std::shared_ptr<const Program> program) {
+  return StringParser([program](std::string_view input) {
+    Match match = program->match(input);
+    if (!match) {
+      return empty_parse_result<std::string_view>(input, match.error);
+    }
+    return make_parse_result(input.substr(0, match.end),
+                             input.substr(match.end));
+  });
+}
+
+// Adapts a compiled program to a parser yielding its captures.
+Parser<std::vector<Capture>> to_capture_parser(
+    std::shared_ptr<const Program> program) {
+  return Parser<std::vector<Capture>>([program](std::string_view input) {
+    Match match = program->match(input);
+    if (!match) {
+      return empty_parse_result<std::vector<Capture>>(input, match.error);
+    }
+    return make_parse_result(std::move(match.captures),
+                             input.substr(match.end));
+  });
+}
+
+}  // namespace peg
+
+#endif  // __PEG_H__
@@ -0,0 +1,405 @@
+//
+// Copyright 2025 John R. Burkhardt
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the “Software”), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#ifndef __PEG_CODEGEN_H__
+#define __PEG_CODEGEN_H__
+
+// Emits a grammar as a standalone recursive-descent recognizer in C++.
+//
+// The generated header depends only on the standard library and defines,
+// in its own namespace, Capture and Match types shaped like peg::Capture
+// and peg::Match and a match(std::string_view) function. Every pattern node
+// becomes a small inline function, so the compiler sees the whole grammar
+// and there is neither combinator nor bytecode dispatch left at run time.
+// Results are the same as Program::match, including the farthest failure
+// offset, except that nesting is bounded by the native stack rather than
+// by a configurable limit.
+
+#include "peg.h"
+#include <fmt/ranges.h>
+#include <cctype>
+#include <map>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace peg {
+
+namespace detail {
+
+// A C++ string literal for str. Octal escapes can't run into the following
+// char the way \x escapes can.
+std::string cpp_string_literal(std::string_view str) {
+  std::string out = "\"";
+  for (char ch : str) {
+    unsigned char byte = static_cast<unsigned char>(ch);
+    if (ch == '"' || ch == '\\') {
+      out += '\\';
+      out += ch;
+    } else if (std::isprint(byte)) {
+      out += ch;
+    } else {
+      out += fmt::format("\\{:03o}", byte);
+    }
+  }
+  return out + "\"";
+}
+
+class CodeGenerator {
+ public:
+  CodeGenerator(const Grammar& grammar, std::string_view name)
+      : grammar_(grammar), name_(name) {}
+
+  std::string generate() {
+    // Compiling checks the grammar the same way the VM would: undefined or
+    // duplicate rules and repetitions that never end are rejected here.
+    Program::compile(grammar_);
+
+    for (size_t i = 0; i < grammar_.rules().size(); ++i) {
+      rule_ids_[grammar_.rules()[i].first] = static_cast<int>(i);
+    }
+    std::string rules;
+    for (size_t i = 0; i < grammar_.rules().size(); ++i) {
+      const auto& [name, pattern] = grammar_.rules()[i];
+      rules += fmt::format(
+          "// {}\n"
+          "inline bool rule{}(State& s) {{ return n{}(s); }}\n\n",
+          name, i, node_id(pattern.node()));
+    }
+    // Generating a node can discover new ones, so this is a worklist.
+    std::string nodes;
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+      nodes += generate_node(static_cast<int>(i), *nodes_[i]);
+    }
+
+    std::string out = prologue();
+    for (size_t i = 0; i < sets_.size(); ++i) {
+      out += fmt::format("inline constexpr uint64_t kSet{}[4] = {{{}}};\n", i,
+                         sets_[i]);
+    }
+    out += "\n";
+    for (size_t i = 0; i < grammar_.rules().size(); ++i) {
+      out += fmt::format("inline bool rule{}(State& s);\n", i);
+    }
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+      out += fmt::format("inline bool n{}(State& s);\n", i);
+    }
+    out += "\n" + rules + nodes + epilogue();
+    return out;
+  }
+
+ private:
+  int node_id(const Node& node) {
+    auto [it, inserted] =
+        node_ids_.emplace(&node, static_cast<int>(nodes_.size()));
+    if (inserted) {
+      nodes_.push_back(&node);
+    }
+    return it->second;
+  }
+
+  int set_id(const CharSet& chars) {
+    uint64_t words[4] = {};
+    for (int ch = 0; ch < 256; ++ch) {
+      if (chars.test(ch)) {
+        words[ch / 64] |= uint64_t{1} << (ch % 64);
+      }
+    }
+    std::string key = fmt::format("0x{:x}u, 0x{:x}u, 0x{:x}u, 0x{:x}u",
+                                  words[0], words[1], words[2], words[3]);
+    auto [it, inserted] =
+        set_ids_.emplace(key, static_cast<int>(sets_.size()));
+    if (inserted) {
+      sets_.push_back(key);
+    }
+    return it->second;
+  }
+
+  static bool single_char(const Node& node) {
+    return node.kind == NodeKind::kChar || node.kind == NodeKind::kSet ||
+           node.kind == NodeKind::kAny;
+  }
+
+  // An expression testing the char at s.pos, which must be in range.
+  std::string char_test(const Node& node) {
+    switch (node.kind) {
+      case NodeKind::kChar:
+        return fmt::format("s.str[s.pos] == {}",
+                           static_cast<unsigned char>(node.text[0]));
+      case NodeKind::kSet:
+        return fmt::format("in_set(kSet{}, s.str[s.pos])", set_id(node.set));
+      default:
+        return "true";
+    }
+  }
+
+  // Statements that consume as many repetitions of body as possible.
+  std::string repeat(const Node& body) {
+    if (body.kind == NodeKind::kAny) {
+      return "  s.pos = s.size;\n";
+    }
+    if (single_char(body)) {
+      return fmt::format("  while (s.pos < s.size && {}) {{\n"
+                         "    ++s.pos;\n"
+                         "  }}\n",
+                         char_test(body));
+    }
+    return fmt::format(
+        "  for (;;) {{\n"
+        "    size_t pos = s.pos, events = s.events.size();\n"
+        "    if (!n{}(s)) {{\n"
+        "      s.restore(pos, events);\n"
+        "      break;\n"
+        "    }}\n"
+        "  }}\n",
+        node_id(body));
+  }
+
+  std::string generate_body(const Node& node) {
+    switch (node.kind) {
+      case NodeKind::kChar:
+      case NodeKind::kSet:
+      case NodeKind::kAny:
+        return fmt::format(
+            "  if (s.pos < s.size && {}) {{\n"
+            "    ++s.pos;\n"
+            "    return true;\n"
+            "  }}\n"
+            "  return s.fail();\n",
+            char_test(node));
+      case NodeKind::kString:
+        return fmt::format(
+            "  constexpr std::string_view text = {};\n"
+            "  if (s.input.substr(s.pos).starts_with(text)) {{\n"
+            "    s.pos += text.size();\n"
+            "    return true;\n"
+            "  }}\n"
+            "  return s.fail();\n",
+            cpp_string_literal(node.text));
+      case NodeKind::kSequence: {
+        if (node.children.empty()) {
+          return "  return true;\n";
+        }
+        std::vector<std::string> calls;
+        for (const auto& child : node.children) {
+          calls.push_back(fmt::format("n{}(s)", node_id(*child)));
+        }
+        return fmt::format("  return {};\n", fmt::join(calls, " && "));
+      }
+      case NodeKind::kChoice: {
+        if (node.children.empty()) {
+          return "  return s.fail();\n";
+        }
+        std::string out = "  size_t pos = s.pos, events = s.events.size();\n";
+        for (size_t i = 0; i + 1 < node.children.size(); ++i) {
+          out += fmt::format(
+              "  if (n{}(s)) {{\n"
+              "    return true;\n"
+              "  }}\n"
+              "  s.restore(pos, events);\n",
+              node_id(*node.children[i]));
+        }
+        out += fmt::format("  return n{}(s);\n",
+                           node_id(*node.children.back()));
+        return out;
+      }
+      case NodeKind::kStar:
+        return repeat(*node.children[0]) + "  return true;\n";
+      case NodeKind::kPlus:
+        return fmt::format("  if (!n{}(s)) {{\n"
+                           "    return false;\n"
+                           "  }}\n",
+                           node_id(*node.children[0])) +
+               repeat(*node.children[0]) + "  return true;\n";
+      case NodeKind::kOptional:
+        return fmt::format(
+            "  size_t pos = s.pos, events = s.events.size();\n"
+            "  if (!n{}(s)) {{\n"
+            "    s.restore(pos, events);\n"
+            "  }}\n"
+            "  return true;\n",
+            node_id(*node.children[0]));
+      case NodeKind::kNot:
+        return fmt::format(
+            "  size_t pos = s.pos, events = s.events.size();\n"
+            "  if (n{}(s)) {{\n"
+            "    return s.fail();\n"
+            "  }}\n"
+            "  s.restore(pos, events);\n"
+            "  return true;\n",
+            node_id(*node.children[0]));
+      case NodeKind::kAnd:
+        return fmt::format(
+            "  size_t pos = s.pos, events = s.events.size();\n"
+            "  bool ok = n{}(s);\n"
+            "  s.restore(pos, events);\n"
+            "  return ok ? true : s.fail();\n",
+            node_id(*node.children[0]));
+      case NodeKind::kCapture:
+        return fmt::format(
+            "  s.events.push_back(Event{{{}, s.pos, true}});\n"
+            "  if (!n{}(s)) {{\n"
+            "    return false;\n"
+            "  }}\n"
+            "  s.events.push_back(Event{{0, s.pos, false}});\n"
+            "  return true;\n",
+            node.capture, node_id(*node.children[0]));
+      case NodeKind::kRule:
+        return fmt::format("  return rule{}(s);\n", rule_ids_.at(node.text));
+    }
+    return "  return s.fail();\n";
+  }
+
+  std::string generate_node(int id, const Node& node) {
+    return fmt::format("inline bool n{}(State& s) {{\n{}}}\n\n", id,
+                       generate_body(node));
+  }
+
+  std::string prologue() const {
+    std::string guard = "__";
+    for (char ch : name_) {
+      guard += std::isalnum(static_cast<unsigned char>(ch))
+                   ? static_cast<char>(
+                         std::toupper(static_cast<unsigned char>(ch)))
+                   : '_';
+    }
+    guard += "_H__";
+    return fmt::format(R"(// Generated by mparse_codegen. Do not edit.
+
+#ifndef {0}
+#define {0}
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+namespace {1} {{
+
+struct Capture {{
+  int id;
+  std::string_view text;
+}};
+
+struct Match {{
+  bool ok = false;
+  size_t end = 0;  // length of the match, or the farthest failure
+  std::vector<Capture> captures;
+
+  operator bool() const {{ return ok; }}
+}};
+
+namespace internal {{
+
+struct Event {{
+  int id;
+  size_t pos;
+  bool open;
+}};
+
+struct State {{
+  std::string_view input;
+  const unsigned char* str;
+  size_t size;
+  size_t pos = 0;
+  size_t farthest = 0;
+  std::vector<Event> events;
+
+  bool fail() {{
+    if (pos > farthest) {{
+      farthest = pos;
+    }}
+    return false;
+  }}
+
+  void restore(size_t saved_pos, size_t saved_events) {{
+    pos = saved_pos;
+    events.resize(saved_events);
+  }}
+}};
+
+inline bool in_set(const uint64_t* set, unsigned char ch) {{
+  return (set[ch >> 6] >> (ch & 63)) & 1;
+}}
+
+)",
+                       guard, name_);
+  }
+
+  std::string epilogue() const {
+    return fmt::format(R"(}}  // namespace internal
+
+// Captures are listed in the order they were opened.
+inline Match match(std::string_view input) {{
+  internal::State s{{
+      .input = input,
+      .str = reinterpret_cast<const unsigned char*>(input.data()),
+      .size = input.size()}};
+  if (!internal::rule0(s)) {{
+    return Match{{.end = s.farthest}};
+  }}
+  Match match{{.ok = true, .end = s.pos}};
+  std::vector<size_t> open;
+  for (const auto& event : s.events) {{
+    if (event.open) {{
+      open.push_back(match.captures.size());
+      match.captures.push_back(
+          Capture{{.id = event.id, .text = input.substr(event.pos, 0)}});
+    }} else {{
+      Capture& capture = match.captures[open.back()];
+      open.pop_back();
+      size_t start = capture.text.data() - input.data();
+      capture.text = input.substr(start, event.pos - start);
+    }}
+  }}
+  return match;
+}}
+
+}}  // namespace {}
+
+#endif
+)",
+                       name_);
+  }
+
+  const Grammar& grammar_;
+  std::string name_;
+  std::unordered_map<std::string, int> rule_ids_;
+  std::unordered_map<const Node*, int> node_ids_;
+  std::vector<const Node*> nodes_;
+  std::map<std::string, int> set_ids_;
+  std::vector<std::string> sets_;
+};
+
+}  // namespace detail
+
+// Returns the source of a header defining namespace name with a recognizer
+// for grammar. Throws std::invalid_argument for grammars that
+// Program::compile would reject.
+std::string generate_cpp(const Grammar& grammar, std::string_view name) {
+  return detail::CodeGenerator(grammar, name).generate();
+}
+
+}  // namespace peg
+
+#endif  // __PEG_CODEGEN_H__
@@ -0,0 +1,470 @@
+//
+// Copyright 2025 John R. Burkhardt
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the “Software”), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+
+#ifndef __PEG_OPTIMIZER_H__
+#define __PEG_OPTIMIZER_H__
+
+// Rewrites patterns and grammars into equivalent ones that do less work.
+//
+//   "a" "b" "cd"            -> "abcd"
+//   'a' / ('b' / [0-9])     -> [0-9ab]
+//   "abc" / "abd"           -> "ab" [cd]
+//   x y / x z               -> x (y / z)
+//   [ \t]* [ ]*             -> [ \t]*
+//   (p+)?                   -> p*
+//   p* / q                  -> p*
+//   p / ""                  -> p?
+//
+// Small rules that don't refer to other rules are inlined at every use and
+// dropped once nothing refers to them. The optimized grammar matches the
+// same input with the same captures; only the offset reported for a failed
+// match may differ, since failures can be found at different points.
+
+#include "peg.h"
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace peg {
+
+namespace detail {
+
+// Rules up to this many nodes are inlined.
+constexpr size_t kInlineRuleNodes = 16;
+
+bool same(const Node& lhs, const Node& rhs) {
+  // Interned nodes that are equal are the same node.
+  if (&lhs == &rhs) {
+    return true;
+  }
+  if (lhs.kind != rhs.kind || lhs.text != rhs.text || lhs.set != rhs.set ||
+      lhs.capture != rhs.capture ||
+      lhs.children.size() != rhs.children.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < lhs.children.size(); ++i) {
+    if (!same(*lhs.children[i], *rhs.children[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+size_t node_count(const Node& node) {
+  size_t count = 1;
+  for (const auto& child : node.children) {
+    count += node_count(*child);
+  }
+  return count;
+}
+
+void collect_rules(const Node& node, std::set<std::string>& rules) {
+  if (node.kind == NodeKind::kRule) {
+    rules.insert(node.text);
+  }
+  for (const auto& child : node.children) {
+    collect_rules(*child, rules);
+  }
+}
+
+bool literal(const Node& node) {
+  return node.kind == NodeKind::kChar || node.kind == NodeKind::kString;
+}
+
+// True if node succeeds wherever it is tried.
+bool always_matches(const Node& node) {
+  switch (node.kind) {
+    case NodeKind::kString:
+      return node.text.empty();
+    case NodeKind::kStar:
+    case NodeKind::kOptional:
+      return true;
+    case NodeKind::kSequence:
+      return std::all_of(
+          node.children.begin(), node.children.end(),
+          [](const NodePtr& child) { return always_matches(*child); });
+    case NodeKind::kCapture:
+      return always_matches(*node.children[0]);
+    default:
+      return false;
+  }
+}
+
+// The chars node matches if it matches exactly one char.
+std::optional<CharSet> char_set(const Node& node) {
+  switch (node.kind) {
+    case NodeKind::kChar:
+      return CharSet().set(static_cast<unsigned char>(node.text[0]));
+    case NodeKind::kSet:
+      return node.set;
+    case NodeKind::kAny:
+      return ~CharSet();
+    default:
+      return std::nullopt;
+  }
+}
+
+NodePtr make_literal(std::string text) {
+  return lit(text).ptr();
+}
+
+NodePtr make_set(const CharSet& chars) {
+  if (chars.all()) {
+    return any().ptr();
+  }
+  if (chars.count() == 1) {
+    for (int ch = 0; ch < 256; ++ch) {
+      if (chars.test(ch)) {
+        return lit(static_cast<char>(ch)).ptr();
+      }
+    }
+  }
+  return set(chars).ptr();
+}
+
+NodePtr make_parent(NodeKind kind, std::vector<NodePtr> children) {
+  return node_store().intern(
+      Node{.kind = kind, .children = std::move(children)});
+}
+
+// The elements a sequence is made of; any other node is a sequence of one.
+std::vector<NodePtr> elements(const NodePtr& node) {
+  if (node->kind == NodeKind::kSequence) {
+    return node->children;
+  }
+  return {node};
+}
+
+class Optimizer {
+ public:
+  explicit Optimizer(const Grammar& grammar) {
+    for (const auto& [name, pattern] : grammar.rules()) {
+      rules_.emplace_back(name, pattern.ptr());
+    }
+  }
+
+  NodePtr optimize(const NodePtr& node) {
+    // Shared subpatterns, like a whitespace skip used all over a grammar,
+    // are only optimized once per round.
+    auto it = memo_.find(node);
+    if (it != memo_.end()) {
+      return it->second;
+    }
+    NodePtr result = optimize_node(node);
+    memo_.emplace(node, result);
+    return result;
+  }
+
+  // Optimizes every rule, inlining small rules until nothing changes, then
+  // drops the rules the start rule no longer reaches.
+  Grammar optimize_grammar() {
+    for (size_t round = 0; round <= rules_.size() + 1; ++round) {
+      // Inlining may have changed what a node optimizes to.
+      memo_.clear();
+      bool changed = false;
+      for (auto& [name, body] : rules_) {
+        NodePtr optimized = optimize(body);
+        changed = changed || !same(*optimized, *body);
+        body = optimized;
+      }
+      for (const auto& [name, body] : rules_) {
+        std::set<std::string> refs;
+        collect_rules(*body, refs);
+        if (refs.empty() && node_count(*body) <= kInlineRuleNodes &&
+            !inline_.contains(name)) {
+          inline_[name] = body;
+          changed = true;
+        }
+      }
+      if (!changed) {
+        break;
+      }
+    }
+
+    std::set<std::string> reachable;
+    if (!rules_.empty()) {
+      reachable.insert(rules_.front().first);
+    }
+    for (size_t size = 0; size != reachable.size();) {
+      size = reachable.size();
+      for (const auto& [name, body] : rules_) {
+        if (reachable.contains(name)) {
+          collect_rules(*body, reachable);
+        }
+      }
+    }
+    Grammar grammar;
+    for (const auto& [name, body] : rules_) {
+      if (reachable.contains(name)) {
+        grammar.define(name, Pattern(body));
+      }
+    }
+    return grammar;
+  }
+
+ private:
+  NodePtr optimize_node(const NodePtr& node) {
+    switch (node->kind) {
+      case NodeKind::kChar:
+      case NodeKind::kString:
+      case NodeKind::kSet:
+      case NodeKind::kAny:
+        return node;
+      case NodeKind::kRule: {
+        auto it = inline_.find(node->text);
+        return it == inline_.end() ? node : it->second;
+      }
+      case NodeKind::kSequence:
+        return optimize_sequence(optimize_children(*node));
+      case NodeKind::kChoice:
+        return optimize_choice(optimize_children(*node));
+      default:
+        break;
+    }
+    NodePtr child = optimize(node->children[0]);
+    if (node->kind == NodeKind::kOptional) {
+      // (p*)? and (p?)? are p* and p?; (p+)? is p*.
+      if (child->kind == NodeKind::kStar ||
+          child->kind == NodeKind::kOptional) {
+        return child;
+      }
+      if (child->kind == NodeKind::kPlus) {
+        return make_parent(NodeKind::kStar, child->children);
+      }
+    }
+    Node result = *node;
+    result.children = {child};
+    return node_store().intern(std::move(result));
+  }
+
+  std::vector<NodePtr> optimize_children(const Node& node) {
+    std::vector<NodePtr> children;
+    for (const auto& child : node.children) {
+      children.push_back(optimize(child));
+    }
+    return children;
+  }
+
+  // True if next can only match empty after prev has matched, as with
+  // p* p* or [ \t]* [ ]*.
+  bool absorbs(const Node& prev, const Node& next) const {
+    if (prev.kind == NodeKind::kRule && next.kind == NodeKind::kRule &&
+        prev.text == next.text) {
+      const NodePtr* body = rule(prev.text);
+      return body != nullptr && (*body)->kind == NodeKind::kStar;
+    }
+    if ((prev.kind != NodeKind::kStar && prev.kind != NodeKind::kPlus) ||
+        (next.kind != NodeKind::kStar && next.kind != NodeKind::kOptional)) {
+      return false;
+    }
+    const Node& repeated = *prev.children[0];
+    const Node& following = *next.children[0];
+    if (same(repeated, following)) {
+      return true;
+    }
+    auto repeated_chars = char_set(repeated);
+    auto following_chars = char_set(following);
+    return repeated_chars && following_chars &&
+           (*following_chars & ~*repeated_chars).none();
+  }
+
+  const NodePtr* rule(const std::string& name) const {
+    for (const auto& [rule_name, body] : rules_) {
+      if (rule_name == name) {
+        return &body;
+      }
+    }
+    return nullptr;
+  }
+
+  NodePtr optimize_sequence(const std::vector<NodePtr>& children) {
+    std::vector<NodePtr> flat;
+    for (const auto& child : children) {
+      auto child_elements = elements(child);
+      flat.insert(flat.end(), child_elements.begin(), child_elements.end());
+    }
+    std::vector<NodePtr> result;
+    for (const auto& child : flat) {
+      if (literal(*child) && child->text.empty()) {
+        continue;
+      }
+      if (!result.empty()) {
+        const Node& prev = *result.back();
+        if (literal(prev) && literal(*child)) {
+          result.back() = make_literal(prev.text + child->text);
+          continue;
+        }
+        if (absorbs(prev, *child)) {
+          continue;
+        }
+      }
+      result.push_back(child);
+    }
+    if (result.size() == 1) {
+      return result.front();
+    }
+    return make_parent(NodeKind::kSequence, std::move(result));
+  }
+
+  NodePtr optimize_choice(const std::vector<NodePtr>& children) {
+    std::vector<NodePtr> flat;
+    for (const auto& child : children) {
+      if (child->kind == NodeKind::kChoice) {
+        flat.insert(flat.end(), child->children.begin(),
+                    child->children.end());
+      } else {
+        flat.push_back(child);
+      }
+    }
+    // Adjacent single chars merge into one set. Alternatives after one that
+    // always matches are never tried.
+    std::vector<NodePtr> merged;
+    for (const auto& child : flat) {
+      if (!merged.empty()) {
+        auto prev_chars = char_set(*merged.back());
+        auto chars = char_set(*child);
+        if (prev_chars && chars) {
+          merged.back() = make_set(*prev_chars | *chars);
+          continue;
+        }
+      }
+      merged.push_back(child);
+      if (always_matches(*child)) {
+        break;
+      }
+    }
+
+    std::vector<NodePtr> result;
+    for (size_t i = 0; i < merged.size();) {
+      size_t end = factor_run(merged, i);
+      if (end - i < 2) {
+        result.push_back(merged[i++]);
+        continue;
+      }
+      result.push_back(factor(merged, i, end));
+      i = end;
+    }
+    // p / "" -> p?
+    if (result.size() > 1 && always_matches(*result.back()) &&
+        elements(result.back()).empty()) {
+      result.pop_back();
+      NodePtr rest = result.size() == 1
+                         ? result.front()
+                         : make_parent(NodeKind::kChoice, std::move(result));
+      return make_parent(NodeKind::kOptional, {rest});
+    }
+    if (result.size() == 1) {
+      return result.front();
+    }
+    return make_parent(NodeKind::kChoice, std::move(result));
+  }
+
+  // The end of the run of alternatives from begin that start the same way:
+  // with the same element, or with literals sharing a prefix.
+  static size_t factor_run(const std::vector<NodePtr>& alternatives,
+                           size_t begin) {
+    auto first = elements(alternatives[begin]);
+    if (first.empty()) {
+      return begin + 1;
+    }
+    NodePtr head = first.front();
+    std::string prefix = literal(*head) ? head->text : "";
+    size_t end = begin + 1;
+    for (; end < alternatives.size(); ++end) {
+      auto next_elements = elements(alternatives[end]);
+      if (next_elements.empty()) {
+        break;
+      }
+      NodePtr next = next_elements.front();
+      if (literal(*head)) {
+        if (!literal(*next)) {
+          break;
+        }
+        auto [mismatch, unused] =
+            std::mismatch(prefix.begin(), prefix.end(), next->text.begin(),
+                          next->text.end());
+        if (mismatch == prefix.begin()) {
+          break;
+        }
+        prefix.erase(mismatch, prefix.end());
+      } else if (!same(*head, *next)) {
+        break;
+      }
+    }
+    return end;
+  }
+
+  // x y / x z -> x (y / z) for alternatives [begin, end), where trying x
+  // again after y fails can only give the same result.
+  NodePtr factor(const std::vector<NodePtr>& alternatives, size_t begin,
+                 size_t end) {
+    NodePtr head = elements(alternatives[begin]).front();
+    size_t prefix = 0;
+    if (literal(*head)) {
+      prefix = head->text.size();
+      for (size_t i = begin + 1; i < end; ++i) {
+        const std::string& text = elements(alternatives[i]).front()->text;
+        prefix = std::mismatch(head->text.begin(), head->text.begin() + prefix,
+                               text.begin(), text.end())
+                     .first -
+                 head->text.begin();
+      }
+      head = make_literal(head->text.substr(0, prefix));
+    }
+    std::vector<NodePtr> rests;
+    for (size_t i = begin; i < end; ++i) {
+      auto rest = elements(alternatives[i]);
+      if (literal(*rest.front())) {
+        rest.front() = make_literal(rest.front()->text.substr(prefix));
+      } else {
+        rest.erase(rest.begin());
+      }
+      rests.push_back(optimize_sequence(rest));
+    }
+    return optimize_sequence({head, optimize_choice(rests)});
+  }
+
+  std::vector<std::pair<std::string, NodePtr>> rules_;
+  std::map<std::string, NodePtr> inline_;
+  std::unordered_map<NodePtr, NodePtr> memo_;
+};
+
+}  // namespace detail
+
+Pattern optimize(const Pattern& pattern) {
+  return Pattern(detail::Optimizer(Grammar()).optimize(pattern.ptr()));
+}
+
+Grammar optimize(const Grammar& grammar) {
+  return detail::Optimizer(grammar).optimize_grammar();
+}
+
+}  // namespace peg
+
+#endif  // __PEG_OPTIMIZER_H__
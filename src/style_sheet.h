@@ -8,7 +8,7 @@
 
 struct Dimension
 {
-    int value;
+    double value;
     enum
     {
         pct,
@@ -1,7 +1,21 @@
+#include "../binary.h"
+#include "../css_grammar.h"
+#include "../json.h"
+#include "../lexer.h"
+#include "../parallel.h"
 #include "../parser.h"
+#include "../peg.h"
+#include "../peg_codegen.h"
+#include "../peg_optimizer.h"
 #include "../style_sheet.h"
+#include "css_recognizer.h"
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <numeric>
+#include <thread>
 
 using ::testing::ElementsAre;
 using ::testing::Eq;
@@ -50,33 +64,9 @@ auto hexit = parse_range('A', 'F')
                    return static_cast<int>(sv.front() - '0');
                  }));
 
-auto hexbyte = parse_n(hexit, 1, 2).transform([](auto hexs) {
-  int val = 0;
-  for (auto h : hexs) {
-    val = (val << 4) + h;
-  }
-  return val;
-});
+auto hexbyte = parse_hex<2>().or_else(parse_hex<1>());
 
-Parser<int> number() {
-  auto positive_number = parse_digit(1, 9).and_then([](int val) {
-    return parse_some(parse_digit()).transform([val](std::vector<int> digits) {
-      int result = val;
-      for (auto d : digits) {
-        result = (result * 10) + d;
-      }
-      return result;
-    });
-  });
-
-  auto zero = parse_digit(0, 0).and_not(parse_digit(0, 9));
-
-  auto integer = positive_number.or_else(zero).or_else(
-      parse_literal('-').and_then(positive_number).transform([](int val) {
-        return -val;
-      }));
-  return integer;
-}
+Parser<int> number() { return parse_int<int>(); }
 }  // namespace parsers
 // Demonstrate some basic assertions.
 TEST(ParserTest, ParseStringTest) {
@@ -148,7 +138,6 @@ TEST(ParserTest, ParseDigit) {
 }
 
 TEST(ParserTest, ParseNumber) {
-  // These are complicated enough that they should probably go in the library
   auto integer = parsers::number();
 
   EXPECT_EQ(integer("0").value(), 0);
@@ -159,6 +148,76 @@ TEST(ParserTest, ParseNumber) {
   EXPECT_FALSE(integer("-0"));
 }
 
+TEST(ParserTest, ParseInt) {
+  auto int32 = parse_int<int32_t>();
+  EXPECT_EQ(int32("2147483647").value(), 2147483647);
+  EXPECT_EQ(int32("-2147483648").value(), -2147483648);
+  EXPECT_FALSE(int32("2147483648"));
+  EXPECT_FALSE(int32("-2147483649"));
+  EXPECT_FALSE(int32("-"));
+  EXPECT_FALSE(int32(""));
+
+  auto result = int32("1234567890123;");
+  EXPECT_FALSE(result);
+
+  result = int32("12345678;");
+  ASSERT_TRUE(result);
+  EXPECT_EQ(result.value(), 12345678);
+  EXPECT_EQ(result.input, ";");
+
+  auto uint64 = parse_int<uint64_t>();
+  EXPECT_EQ(uint64("18446744073709551615").value(),
+            std::numeric_limits<uint64_t>::max());
+  EXPECT_FALSE(uint64("18446744073709551616"));
+  EXPECT_FALSE(uint64("-1"));
+
+  auto int64 = parse_int<int64_t>();
+  EXPECT_EQ(int64("-9223372036854775808").value(),
+            std::numeric_limits<int64_t>::min());
+  EXPECT_FALSE(int64("9223372036854775808"));
+
+  auto byte = parse_int<uint8_t>();
+  EXPECT_EQ(byte("255").value(), 255);
+  EXPECT_FALSE(byte("256"));
+}
+
+TEST(ParserTest, ParseFloat) {
+  auto number = parse_float<double>();
+  EXPECT_EQ(number("0").value(), 0.0);
+  EXPECT_EQ(number("12.5").value(), 12.5);
+  EXPECT_EQ(number("-0.25").value(), -0.25);
+  EXPECT_EQ(number("1e3").value(), 1000.0);
+  EXPECT_EQ(number("1.5E-2").value(), 0.015);
+  EXPECT_EQ(number("123456789012345678901234567890").value(),
+            123456789012345678901234567890.0);
+  EXPECT_EQ(number("1.7976931348623157e308").value(),
+            std::numeric_limits<double>::max());
+  EXPECT_EQ(number("4.9e-324").value(),
+            std::numeric_limits<double>::denorm_min());
+  EXPECT_EQ(number("0.1000000000000000055511151231257827").value(), 0.1);
+  EXPECT_FALSE(number("1e400"));
+  EXPECT_FALSE(number("18e307"));
+  // Too small for a subnormal rounds to zero, keeping the sign.
+  EXPECT_EQ(number("1e-400").value(), 0.0);
+  EXPECT_TRUE(std::signbit(number("-1e-400").value()));
+  EXPECT_EQ(number("0." + std::string(400, '0') + "1").value(), 0.0);
+  EXPECT_EQ(number("100e-99999999999").value(), 0.0);
+  EXPECT_FALSE(number("1e99999999999"));
+  EXPECT_FALSE(number("01"));
+  EXPECT_FALSE(number("1."));
+  EXPECT_FALSE(number(".5"));
+  EXPECT_FALSE(number("1e"));
+
+  auto result = number("12.5px");
+  ASSERT_TRUE(result);
+  EXPECT_EQ(result.value(), 12.5);
+  EXPECT_EQ(result.input, "px");
+
+  auto single = parse_float<float>();
+  EXPECT_EQ(single("3.25").value(), 3.25f);
+  EXPECT_EQ(single("0.1").value(), 0.1f);
+}
+
 TEST(ParserTest, Optional) {
   auto optional_star = parse_literal('*');
   auto parser = parse_str("v")
@@ -222,6 +281,46 @@ TEST(ParserTest, ParseN) {
   EXPECT_EQ(result.input.front(), 'd');
 }
 
+TEST(ParserTest, Fold) {
+  auto sum = parse_fold(
+      parse_digit().skip(parse_opt(parse_literal('+'))), 0,
+      [](int acc, int digit) { return acc + digit; });
+  auto result = sum("1+2+3+4;");
+  ASSERT_TRUE(result);
+  EXPECT_EQ(result.value(), 10);
+  EXPECT_EQ(result.input, ";");
+  EXPECT_EQ(sum(";").value(), 0);
+
+  auto decimal = parse_fold(
+      parse_digit(), 0, [](int acc, int digit) { return acc * 10 + digit; },
+      1, 3);
+  EXPECT_EQ(decimal("255").value(), 255);
+  EXPECT_FALSE(decimal("x"));
+  EXPECT_FALSE(decimal("1234"));
+}
+
+TEST(ParserTest, Count) {
+  auto count = parse_count(parse_literal('a'));
+  EXPECT_EQ(count("aaab").value(), 3);
+  EXPECT_EQ(count("b").value(), 0);
+  EXPECT_FALSE(parse_count(parse_literal('a'), 2)("ab"));
+  EXPECT_FALSE(parse_count(parse_literal('a'), 0, 2)("aaa"));
+
+  // Parsers that don't consume input are only counted once.
+  EXPECT_EQ(parse_count(pure(1))("abc").value(), 1);
+}
+
+TEST(ParserTest, ForEach) {
+  std::vector<int> seen;
+  auto item = parse_int<int>().skip(parse_opt(parse_literal(',')));
+  auto parser =
+      parse_for_each(item, [&seen](int value) { seen.push_back(value); });
+  auto result = parser("10,-2,30");
+  ASSERT_TRUE(result);
+  EXPECT_EQ(result.value(), 3);
+  EXPECT_THAT(seen, ElementsAre(10, -2, 30));
+}
+
 TEST(ParserTest, AndNot) {
   auto parser = parse_n(parse_range('a', 'z').and_not(parse_literal('x')), 4);
 
@@ -249,38 +348,75 @@ TEST(ParserTest, RGB) {
   EXPECT_TRUE(result.input.empty());
 }
 
-int decode_hex_str(std::string_view str) {
-  char buf[3] = {str[0], str[1], '\0'};
-  return (uint8_t)(std::strtoul(buf, nullptr, 16));
-}
-
 TEST(ParserTest, HexColor) {
-  auto is_hexit = [](char ch) {
-    ch = toupper(ch);
-    return (ch >= '0' && ch <= '9') || (ch >= 'A' && ch <= 'F');
-  };
-
-  auto parse_hex_digit(detail::parse_char_class(is_hexit));
-
-  auto hex_color_parser =
-      parse_literal('#')
-          .and_then(parse_n(parse_hex_digit, 6))
-          .transform([](std::string_view value) {
-            return Color{.r = decode_hex_str(value.substr(0, 2)),
-                         .g = decode_hex_str(value.substr(2, 4)),
-                         .b = decode_hex_str(value.substr(4, 6))};
-          });
-  //    EXPECT_TRUE(hex_color_parser("#004488;"));
+  auto hex_color_parser = parse_hex_color().transform([](uint32_t rgb) {
+    return Color{.r = static_cast<int>((rgb >> 16) & 0xFF),
+                 .g = static_cast<int>((rgb >> 8) & 0xFF),
+                 .b = static_cast<int>(rgb & 0xFF)};
+  });
+  EXPECT_TRUE(hex_color_parser("#004488;"));
   auto result = hex_color_parser("#A87F01;");
   Color c = result.value();
   EXPECT_THAT(c.r, Eq(0xA8));
   EXPECT_THAT(c.g, Eq(0x7F));
   EXPECT_THAT(c.b, Eq(0x01));
   EXPECT_THAT(result.input.front(), Eq(';'));
+
+  EXPECT_EQ(parse_hex_color()("#fa0").value(), 0xFFAA00u);
+  EXPECT_EQ(parse_hex_color()("#Fa0;").input, ";");
+  EXPECT_FALSE(parse_hex_color()("#g00"));
+  // Other lengths aren't read as a shorter color.
+  for (std::string_view other : {"#abcd", "#abcde", "#abcdef0", "#ab"}) {
+    auto color = parse_hex_color()(other);
+    EXPECT_FALSE(color) << other;
+    EXPECT_EQ(color.input, other);
+  }
+  EXPECT_EQ(parse_hex_color()("#abc-").value(), 0xAABBCCu);
+  EXPECT_FALSE(parse_hex_color()("A87F01"));
+}
+
+TEST(ParserTest, FixedWidthHex) {
+  // Every byte value in every position of an 8 digit word.
+  for (int pos = 0; pos < 8; ++pos) {
+    for (int ch = 0; ch < 256; ++ch) {
+      std::string input = "00000000";
+      input[pos] = static_cast<char>(ch);
+      bool is_hex = std::isxdigit(ch) != 0;
+      auto result = parse_hex<8>()(input);
+      ASSERT_EQ(result.has_value(), is_hex) << pos << " " << ch;
+      if (is_hex) {
+        uint32_t digit = std::stoul(std::string(1, static_cast<char>(ch)),
+                                    nullptr, 16);
+        EXPECT_EQ(result.value(), digit << (4 * (7 - pos)));
+      }
+    }
+  }
+
+  EXPECT_EQ(parse_hex<1>()("f").value(), 0xFu);
+  EXPECT_EQ(parse_hex<4>()("BeEf!").value(), 0xBEEFu);
+  EXPECT_EQ(parse_hex<4>()("BeEf!").input, "!");
+  EXPECT_EQ(parse_hex<16>()("0123456789abcdef").value(),
+            0x0123456789ABCDEFull);
+  EXPECT_EQ(parse_hex<12>()("DEADBEEF1234").value(), 0xDEADBEEF1234ull);
+  EXPECT_FALSE(parse_hex<4>()("123"));
+  EXPECT_FALSE(parse_hex<10>()("012345678g"));
+}
+
+TEST(ParserTest, FixedWidthDigits) {
+  EXPECT_EQ(parse_digits<2>()("07").value(), 7u);
+  EXPECT_EQ(parse_digits<4>()("2025-10").value(), 2025u);
+  EXPECT_EQ(parse_digits<4>()("2025-10").input, "-10");
+  EXPECT_EQ(parse_digits<8>()("12345678").value(), 12345678u);
+  EXPECT_EQ(parse_digits<9>()("123456789").value(), 123456789u);
+  EXPECT_EQ(parse_digits<19>()("9223372036854775807").value(),
+            9223372036854775807ull);
+  EXPECT_FALSE(parse_digits<3>()("1a3"));
+  EXPECT_FALSE(parse_digits<3>()("12"));
+  EXPECT_FALSE(parse_digits<12>()("12345678901/"));
 }
 
 TEST(ParserTest, Spacing) {
-  auto dimension_parser = parsers::number().and_then([](auto value) {
+  auto dimension_parser = parse_float<double>().and_then([](auto value) {
     return parse_str("px")
         .as(Dimension{.value = value, .units = Dimension::px})
         .or_else(parse_literal('%').as(
@@ -330,6 +466,41 @@ TEST(ParserTest, RecursiveParser) {
   EXPECT_THAT(parse_term("(20)").value(), Eq(20));
 }
 
+TEST(ParserTest, DeepRecursion) {
+  auto nesting = [](size_t max_depth) {
+    return parse_recursive<int>(
+        [](const Parser<int>& nested) {
+          // nested is copied rather than referenced through parse_ref.
+          return parse_literal('[').and_then(
+              parse_literal(']').as(1).or_else(
+                  nested.skip(parse_literal(']')).transform([](int depth) {
+                    return depth + 1;
+                  })));
+        },
+        max_depth);
+  };
+  auto brackets = [](size_t depth) {
+    return std::string(depth, '[') + std::string(depth, ']');
+  };
+
+  // Far deeper than the native stack could hold.
+  std::string deep = brackets(200000);
+  auto result = nesting(1 << 20)(deep);
+  ASSERT_TRUE(result);
+  EXPECT_THAT(result.value(), Eq(200000));
+  EXPECT_TRUE(result.input.empty());
+
+  auto limited = nesting(1000);
+  EXPECT_THAT(limited(brackets(1000)).value(), Eq(1000));
+  auto too_deep = limited(brackets(1001));
+  EXPECT_FALSE(too_deep);
+  EXPECT_THAT(too_deep.error,
+              ::testing::HasSubstr("nesting deeper than 1000 levels"));
+
+  // The depth is per thread and unwinds with each parse.
+  EXPECT_THAT(limited(brackets(999)).value(), Eq(999));
+}
+
 TEST(ParserTest, Expression) {
   // expr ::= term + expr | term - expr | term
   // term ::= factor * term | factor / term | factor
@@ -480,3 +651,1294 @@ TEST(ParserTest, ParseJson) {
     std::cout << result.error << std::endl;
   }
 }
+
+TEST(ParserTest, SharedNodes) {
+  auto word = parse_str("word");
+  auto copy = word;
+  EXPECT_EQ(copy.id(), word.id());
+  EXPECT_NE(parse_str("word").id(), word.id());
+  // Every trim() shares the same whitespace skips.
+  EXPECT_EQ(parse_opt_ws().id(), parse_opt_ws().id());
+  EXPECT_EQ(word.trim()("  word ").value(), "word");
+}
+
+TEST(ParserTest, ResultLayout) {
+  // A value, the remaining input and a single pointer for the error.
+  EXPECT_LE(sizeof(ParseResult<int>),
+            2 * sizeof(void*) + sizeof(std::string_view));
+  EXPECT_LE(sizeof(ParseResult<std::string_view>),
+            sizeof(void*) + 2 * sizeof(std::string_view));
+
+  auto failed = parse_literal('a')("b");
+  ASSERT_FALSE(failed);
+  EXPECT_EQ(failed.error, "Expected a but saw b");
+  EXPECT_EQ(failed.input, "b");
+  // Copies share the message.
+  auto copy = failed;
+  EXPECT_EQ(copy.error.message().data(), failed.error.message().data());
+  // An empty message is still a failure.
+  EXPECT_FALSE(empty_parse_result<int>(std::string_view("x"), ""));
+
+  auto parsed = parse_literal('a')("ab");
+  ASSERT_TRUE(parsed);
+  EXPECT_FALSE(parsed.error);
+  EXPECT_EQ(parsed.value(), "a");
+  EXPECT_EQ(parsed.input, "b");
+
+  // Assignment moves between success and failure, and a value that throws
+  // while being copied leaves the target as it was.
+  struct Fragile {
+    bool fail = false;
+    Fragile() = default;
+    Fragile(const Fragile& other) : fail(other.fail) {
+      if (fail) {
+        throw std::runtime_error("copy");
+      }
+    }
+    Fragile& operator=(const Fragile& other) {
+      if (other.fail) {
+        throw std::runtime_error("copy");
+      }
+      fail = other.fail;
+      return *this;
+    }
+  };
+  std::string_view rest = "rest";
+  auto good = make_parse_result(Fragile(), rest);
+  auto bad = empty_parse_result<Fragile>(rest, "bad");
+  auto result = bad;
+  result = good;
+  EXPECT_TRUE(result);
+  result = bad;
+  EXPECT_EQ(result.error, "bad");
+  auto throwing = good;
+  throwing.value().fail = true;
+  EXPECT_THROW(result = throwing, std::runtime_error);
+  EXPECT_EQ(result.error, "bad");
+  result = good;
+  EXPECT_THROW(result = throwing, std::runtime_error);
+  EXPECT_TRUE(result);
+  EXPECT_FALSE(result.value().fail);
+}
+
+TEST(ParserTest, CachedContinuations) {
+  int built = 0;
+  auto field = parse_some(parse_alpha())
+                   .skip(parse_literal(':'))
+                   .and_then_cached([&built](std::string_view name) {
+                     ++built;
+                     int scale = static_cast<int>(name.size());
+                     return parse_int<int>().transform(
+                         [scale](int value) { return value * scale; });
+                   });
+  auto fields = parse_delimited_by(field, parse_literal(','), parse_end());
+
+  size_t before = parser_nodes_constructed();
+  EXPECT_THAT(fields("a:1,bb:2,a:3").value(), ElementsAre(1, 4, 3));
+  EXPECT_EQ(built, 2);
+  EXPECT_GT(parser_nodes_constructed(), before);
+
+  // Names seen before reuse their parsers, so nothing more is built.
+  std::string input = "bb:5,a:6";
+  before = parser_nodes_constructed();
+  EXPECT_THAT(fields(input).value(), ElementsAre(10, 6));
+  EXPECT_EQ(built, 2);
+  EXPECT_EQ(parser_nodes_constructed(), before);
+}
+
+TEST(ParserTest, DeferredActions) {
+  int built = 0;
+  auto item = parse_int<int>().transform_deferred([&built](int value) {
+    ++built;
+    return std::to_string(value);
+  });
+  // Every item is parsed twice: first as "n;", which fails, then as "n.".
+  auto entry = item.skip(parse_literal(';'))
+                   .or_else(item.skip(parse_literal('.')));
+  auto entries = parse_n(entry, 1);
+
+  ActionStats stats;
+  auto result = parse_with_actions(entries, "1.22.333.", &stats);
+  ASSERT_TRUE(result);
+  ASSERT_EQ(result.value().size(), 3);
+  EXPECT_EQ(result.value()[1].get(), "22");
+  EXPECT_EQ(built, 3);
+  EXPECT_EQ(stats.recorded, 6);
+  EXPECT_EQ(stats.discarded, 3);
+
+  // Nothing runs if the parse fails.
+  built = 0;
+  EXPECT_FALSE(parse_with_actions(entries.skip(parse_end()), "1.2.x"));
+  EXPECT_EQ(built, 0);
+
+  // Outside parse_with_actions actions run straight away.
+  auto eager = entries("1.22.333.");
+  ASSERT_TRUE(eager);
+  EXPECT_TRUE(eager.value()[2].ready());
+  EXPECT_EQ(built, 6);
+
+  // Actions of a parser skipped by recovery are dropped.
+  built = 0;
+  auto statement =
+      recover_to(item.skip(parse_literal(';')), parse_literal(';'));
+  std::string_view statements = "1;5x;3;";
+  ActionStats recovery_stats;
+  RecoveryScope scope(statements);
+  auto recovered = parse_with_actions(parse_some(statement), statements,
+                                      &recovery_stats);
+  ASSERT_TRUE(recovered);
+  ASSERT_EQ(recovered.value().size(), 3);
+  EXPECT_FALSE(recovered.value()[1]);
+  EXPECT_EQ(built, 2);
+  EXPECT_EQ(recovery_stats.recorded, 3);
+  EXPECT_EQ(recovery_stats.discarded, 1);
+
+  // Lookahead records nothing; the parse that follows it does.
+  built = 0;
+  ActionStats peek_stats;
+  auto peeked =
+      parse_with_actions(parse_peek(item).and_then(item), "42", &peek_stats);
+  ASSERT_TRUE(peeked);
+  EXPECT_EQ(peeked.value().get(), "42");
+  EXPECT_EQ(built, 1);
+  EXPECT_EQ(peek_stats.recorded, 2);
+  EXPECT_EQ(peek_stats.discarded, 1);
+
+  // Char parsers built on items drop the actions of a failed repetition,
+  // and parse_not never keeps its match.
+  auto then = [](char ch) {
+    return [ch](const auto&) { return parse_literal(ch); };
+  };
+  built = 0;
+  auto terminated = parse_n(item.and_then(then(';')), 1);
+  ActionStats repeat_stats;
+  auto repeated = parse_with_actions(terminated, "1;2x", &repeat_stats);
+  ASSERT_TRUE(repeated);
+  EXPECT_EQ(built, 1);
+  EXPECT_EQ(repeat_stats.discarded, 1);
+  built = 0;
+  EXPECT_TRUE(parse_with_actions(parse_some(item.and_then(then(';'))), "1;2x"));
+  EXPECT_EQ(built, 1);
+  built = 0;
+  EXPECT_FALSE(parse_with_actions(parse_not(item.and_then(then('x'))), "5x"));
+  EXPECT_TRUE(parse_with_actions(parse_not(item.and_then(then(';'))), "5x"));
+  EXPECT_EQ(built, 0);
+}
+
+TEST(ParserTest, Recognize) {
+  int built = 0;
+  auto count = [&built](auto&& value) {
+    ++built;
+    return value;
+  };
+  // Nested lists of numbers, with a prefix that picks the parser for the
+  // rest of the entry.
+  auto list = parse_recursive<std::vector<int>>(
+      [&](const Parser<std::vector<int>>& list) {
+        auto item = parse_int<int>()
+                        .transform(count)
+                        .transform([](int value) { return std::vector{value}; })
+                        .or_else(parse_literal('[').and_then(list).skip(
+                            parse_literal(']')));
+        return parse_delimited_by(item, parse_literal(','),
+                                  parse_peek(parse_literal(']')))
+            .transform([](const std::vector<std::vector<int>>& items) {
+              std::vector<int> flat;
+              for (const auto& item : items) {
+                flat.insert(flat.end(), item.begin(), item.end());
+              }
+              return flat;
+            });
+      });
+  auto entry = parse_alpha()
+                   .skip(parse_literal('='))
+                   .and_then_cached([&](std::string_view name) {
+                     return name == "n" ? parse_literal('[')
+                                              .and_then(list)
+                                              .skip(parse_literal(']'))
+                                        : parse_never<std::vector<int>>();
+                   });
+  auto entries = parse_n(parse_opt(entry).skip(parse_literal(';')), 1);
+
+  for (std::string_view input :
+       {"n=[1,[2,3],[[4]]];;n=[5];", "n=[1,[2,x]];", "q=[1];", "n=[1,2;",
+        "", "n=[1];rest"}) {
+    built = 0;
+    auto parsed = entries(input);
+    auto parsed_built = built;
+    built = 0;
+    auto recognized = recognize(entries, input);
+    EXPECT_EQ(bool(recognized), bool(parsed)) << input;
+    EXPECT_EQ(recognized.input, parsed.input) << input;
+    EXPECT_EQ(recognized.error.message(), parsed.error.message()) << input;
+    EXPECT_GE(parsed_built, parsed ? 1 : 0) << input;
+    EXPECT_EQ(built, 0) << input;
+  }
+
+  // Recovery records the same diagnostics either way.
+  auto block = recover_to(entry.skip(parse_literal(';')), parse_literal(';'));
+  auto blocks = parse_some(block).skip(parse_end());
+  std::string_view bad = "n=[1];n=[x];q=[2];n=[3];";
+  auto parsed = parse_with_recovery(blocks, bad);
+  RecoveryScope scope(bad);
+  auto recognized = recognize(blocks, bad);
+  ASSERT_TRUE(parsed.result);
+  ASSERT_TRUE(recognized);
+  EXPECT_TRUE(recognized.input.empty());
+  ASSERT_EQ(scope.diagnostics().size(), 2);
+  EXPECT_EQ(scope.diagnostics()[1].column, parsed.diagnostics[1].column);
+  EXPECT_EQ(scope.diagnostics()[1].message, parsed.diagnostics[1].message);
+}
+
+TEST(ParserTest, Span) {
+  int built = 0;
+  auto number = parse_int<int>().transform([&built](int value) {
+    ++built;
+    return value;
+  });
+  auto numbers = parse_delimited_by(number, parse_literal(','),
+                                    parse_peek(parse_literal(';')));
+  auto span = parse_span(numbers);
+  auto result = span("1,22,333;rest");
+  ASSERT_TRUE(result);
+  EXPECT_EQ(result.value(), "1,22,333");
+  EXPECT_EQ(result.input, ";rest");
+  EXPECT_EQ(built, 0);
+
+  // Failures are those of the parser.
+  auto failed = span("1,x;");
+  ASSERT_FALSE(failed);
+  EXPECT_EQ(failed.input, numbers("1,x;").input);
+  EXPECT_EQ(failed.error.message(), numbers("1,x;").error.message());
+
+  // The slice covers what skip leaves out, so quoted text comes back as one
+  // view of the input.
+  auto quote = parse_literal('"');
+  auto escaped = parse_literal('\\').and_then(parse_any());
+  auto body = parse_count(parse_none_of("\"\\").or_else(escaped)).span();
+  auto string = quote.and_then(body).skip(quote);
+  std::string_view input = R"("a \"b\" c": 1)";
+  auto quoted = string(input);
+  ASSERT_TRUE(quoted);
+  EXPECT_EQ(quoted.value(), R"(a \"b\" c)");
+  EXPECT_EQ(quoted.value().data(), input.data() + 1);
+  EXPECT_EQ(parse_span(string.skip(parse_literal(':')))(input).value(),
+            R"("a \"b\" c":)");
+
+  // Any input works.
+  std::vector<std::byte> bytes = {std::byte{1}, std::byte{1}, std::byte{2}};
+  auto ones = parse_span(parse_count(parse_element(std::byte{1})));
+  auto ones_result = ones(ByteSpan(bytes));
+  ASSERT_TRUE(ones_result);
+  EXPECT_EQ(ones_result.value().size(), 2);
+  EXPECT_EQ(ones_result.input.size(), 1);
+}
+
+TEST(ParserTest, SharedGrammarAcrossThreads) {
+  // Built once and used by every thread, with all of the per-parse state:
+  // nesting depth, the continuation cache, the action tape and recovery.
+  auto nested = parse_recursive<int>([](const Parser<int>& nested) {
+    return parse_literal('[').and_then(parse_literal(']').as(1).or_else(
+        nested.skip(parse_literal(']')).transform([](int depth) {
+          return depth + 1;
+        })));
+  });
+  auto field = parse_some(parse_alpha())
+                   .skip(parse_literal('='))
+                   .and_then_cached([nested](std::string_view name) {
+                     int scale = static_cast<int>(name.size());
+                     return nested.transform(
+                         [scale](int depth) { return depth * scale; });
+                   })
+                   .transform_deferred([](int value) { return value; });
+  auto fields = parse_some(
+      recover_to(field.skip(parse_literal(';')), parse_literal(';')));
+
+  auto brackets = [](size_t depth) {
+    return std::string(depth, '[') + std::string(depth, ']');
+  };
+  // Deep enough to move onto heap stack segments.
+  std::string deep = brackets(5000);
+
+  std::atomic<int> failures = 0;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; ++t) {
+    threads.emplace_back([&, t] {
+      std::string name(1 + t % 4, 'x');
+      std::string input =
+          fmt::format("{}=[[]];?;{}={};", name, name, brackets(t + 1));
+      for (int i = 0; i < 20; ++i) {
+        auto depth = nested(deep);
+        if (!depth || depth.value() != 5000) {
+          ++failures;
+        }
+
+        RecoveryScope scope(input);
+        ActionStats stats;
+        auto result = parse_with_actions(fields, input, &stats);
+        if (!result || result.value().size() != 3 || !result.value()[2] ||
+            result.value()[2]->get() != (t + 1) * (1 + t % 4) ||
+            scope.diagnostics().size() != 1 || stats.recorded != 2) {
+          ++failures;
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(failures, 0);
+}
+
+TEST(ParserTest, Peek) {
+  auto parser = parse_peek(parse_literal('a')).and_then(parse_str("ab"));
+  EXPECT_EQ(parser("ab").value(), "ab");
+  EXPECT_FALSE(parser("b"));
+}
+
+TEST(ParserTest, RecoverTo) {
+  // block ::= name '{' (key '=' number ';')* '}'
+  auto name = parse_n(parse_alpha(), 1);
+  auto entry = name.trim()
+                   .skip(parse_literal('='))
+                   .and_then(parse_int<int>())
+                   .skip(parse_literal(';'));
+  auto entries = parse_some(
+      parse_peek(parse_not(parse_literal('}')))
+          .and_then(recover_to(entry, parse_literal(';').or_else(parse_peek(
+                                          parse_literal('}'))))));
+  auto block = name.skip(parse_literal('{'))
+                   .and_then(entries)
+                   .skip(parse_literal('}'));
+  auto blocks = parse_some(recover_to(block, parse_literal('}')));
+
+  std::string_view input = "a{x=1;y=q;z=3;}b{x=1}c{\nw=4;v=;}d{u=5;}";
+
+  // Without a scope the first error stops the parse.
+  auto strict = blocks(input);
+  ASSERT_TRUE(strict);
+  EXPECT_EQ(strict.value().size(), 0);
+  EXPECT_EQ(strict.input, input);
+
+  auto [result, diagnostics] = parse_with_recovery(blocks, input);
+  ASSERT_TRUE(result);
+  EXPECT_TRUE(result.input.empty());
+  ASSERT_EQ(result.value().size(), 4);
+  EXPECT_TRUE(result.value()[0].has_value());
+  EXPECT_THAT(result.value()[0]->size(), Eq(3));
+  EXPECT_FALSE(result.value()[0]->at(1).has_value());
+  EXPECT_TRUE(result.value()[1].has_value());
+  EXPECT_TRUE(result.value()[2].has_value());
+  EXPECT_TRUE(result.value()[3].has_value());
+
+  ASSERT_EQ(diagnostics.size(), 3);
+  EXPECT_EQ(diagnostics[0].offset, input.find("y=q"));
+  EXPECT_EQ(diagnostics[0].column, 7);
+  EXPECT_EQ(diagnostics[1].offset, input.find("}c"));
+  EXPECT_EQ(diagnostics[2].line, 2);
+  EXPECT_EQ(diagnostics[2].column, 5);
+  EXPECT_FALSE(diagnostics[2].message.empty());
+
+  // Errors recovered in an alternative that is then abandoned are dropped
+  // with it.
+  auto pair = parse_literal('(')
+                  .and_then(recover_to(parse_literal('a'), parse_literal(',')))
+                  .skip(parse_literal(')'));
+  auto either = pair.transform([](auto) { return 1; })
+                    .or_else(parse_literal('(').as(2).skip(parse_str("b)")));
+  auto chosen = parse_with_recovery(either, "(b)");
+  ASSERT_TRUE(chosen.result);
+  EXPECT_EQ(chosen.result.value(), 2);
+  EXPECT_TRUE(chosen.diagnostics.empty());
+
+  // An error outside the scope's document is kept without a position.
+  std::string other = "x=q;";
+  RecoveryScope scope(input);
+  EXPECT_TRUE(recover_to(entry, parse_literal(';'))(other));
+  ASSERT_EQ(scope.diagnostics().size(), 1);
+  EXPECT_EQ(scope.diagnostics()[0].offset, std::string_view::npos);
+  EXPECT_EQ(scope.diagnostics()[0].line, 0);
+  std::ostringstream out;
+  out << scope.diagnostics()[0];
+  EXPECT_EQ(out.str(), scope.diagnostics()[0].message);
+}
+
+TEST(ParserTest, ParseIter) {
+  int parsed = 0;
+  auto item = parse_int<int>()
+                  .skip(parse_opt(parse_literal(',')))
+                  .transform([&parsed](int value) {
+                    ++parsed;
+                    return value;
+                  });
+
+  std::vector<int> values;
+  std::string_view rest;
+  for (int value : parse_iter(item, "1,2,3,x", &rest)) {
+    values.push_back(value);
+  }
+  EXPECT_THAT(values, ElementsAre(1, 2, 3));
+  EXPECT_EQ(rest, "x");
+
+  // Items are parsed on demand, so stopping early skips the rest.
+  parsed = 0;
+  for (int value : parse_iter(item, "1,2,3,4,5,6")) {
+    if (value == 2) {
+      break;
+    }
+  }
+  EXPECT_EQ(parsed, 2);
+
+  auto empty = parse_iter(item, "");
+  EXPECT_TRUE(empty.begin() == empty.end());
+}
+
+namespace {
+// A user-defined view over audio samples.
+class Samples : public std::ranges::view_interface<Samples> {
+ public:
+  Samples() = default;
+  Samples(const int16_t* data, size_t size) : data_(data), size_(size) {}
+
+  const int16_t* begin() const { return data_; }
+  const int16_t* end() const { return data_ + size_; }
+
+ private:
+  const int16_t* data_ = nullptr;
+  size_t size_ = 0;
+};
+}  // namespace
+
+TEST(ParserTest, GenericInputs) {
+  static_assert(ParseInput<std::string_view>);
+  static_assert(ParseInput<std::u16string_view>);
+  static_assert(ParseInput<ByteSpan>);
+  static_assert(ParseInput<Samples>);
+  static_assert(!ParseInput<std::string>);
+  static_assert(!ParseInput<std::vector<std::byte>>);
+
+  // Framed bytes: 0x7e, payload, 0x0a.
+  std::vector<std::byte> bytes;
+  for (int ch : {0x7e, int{'h'}, int{'i'}, 0x0a, 0x7e, 0x0a, 0x7e, int{'x'}}) {
+    bytes.push_back(std::byte(ch));
+  }
+  auto frame = parse_element(std::byte{0x7e})
+                   .and_then(parse_until(std::byte{0x0a}))
+                   .skip(parse_element(std::byte{0x0a}));
+  auto frames = parse_some(frame);
+  auto result = frames(ByteSpan(bytes));
+  ASSERT_TRUE(result);
+  ASSERT_EQ(result.value().size(), 2);
+  EXPECT_EQ(result.value()[0].size(), 2);
+  EXPECT_EQ(result.value()[0][1], std::byte{'i'});
+  EXPECT_TRUE(result.value()[1].empty());
+  EXPECT_EQ(result.input.size(), 2);
+  auto missing = frame(result.input);
+  ASSERT_FALSE(missing);
+  EXPECT_EQ(missing.error, "Error: expected 0xa but saw end of input");
+
+  // UTF-16, long enough for parse_until to compare a word at a time.
+  std::u16string_view text = u"long key with ünïcode=value";
+  auto pair = parse_until(u'=').skip(parse_elements(std::u16string_view(u"=")));
+  auto key = pair(text);
+  ASSERT_TRUE(key);
+  EXPECT_EQ(key.value(), u"long key with ünïcode");
+  EXPECT_EQ(key.input, u"value");
+  EXPECT_FALSE(pair(u"no separator here"));
+
+  // A user-defined view: count the leading silence, then a peak.
+  std::vector<int16_t> samples = {0, 1, -1, 0, 9000, 12000, 3};
+  auto quiet = parse_while<Samples>([](int16_t s) { return std::abs(s) < 10; });
+  auto loud =
+      parse_element_if<Samples>([](int16_t s) { return std::abs(s) > 8000; });
+  auto peak = quiet.and_then(parse_count(loud, 1));
+  auto peaks = peak(Samples(samples.data(), samples.size()));
+  ASSERT_TRUE(peaks);
+  EXPECT_EQ(peaks.value(), 2);
+  EXPECT_EQ(peaks.input.size(), 1);
+
+  // Over chars these are ordinary StringParsers.
+  auto line = parse_until('\n').skip(parse_literal('\n'));
+  EXPECT_EQ(parse_some(line)("ab\ncd\n").value().size(), 2);
+}
+
+namespace {
+std::vector<std::byte> bytes_of(std::initializer_list<int> values) {
+  std::vector<std::byte> bytes;
+  for (int value : values) {
+    bytes.push_back(std::byte(value));
+  }
+  return bytes;
+}
+}  // namespace
+
+TEST(BinaryTest, FixedWidth) {
+  auto bytes = bytes_of({0x01, 0x02, 0x03, 0x04, 0x00, 0x00, 0x80, 0x3f});
+  ByteSpan input(bytes);
+  EXPECT_EQ(parse_le<uint32_t>()(input).value(), 0x04030201u);
+  EXPECT_EQ(parse_be<uint32_t>()(input).value(), 0x01020304u);
+  EXPECT_EQ(parse_be<int16_t>()(input).value(), 0x0102);
+  EXPECT_EQ(parse_le<uint8_t>()(input).input.size(), 7);
+  EXPECT_EQ(parse_le<float>()(input.subspan(4)).value(), 1.0f);
+
+  auto pair = parse_le<uint16_t>().and_then(parse_be<uint16_t>());
+  EXPECT_EQ(pair(input).value(), 0x0304);
+  auto short_input = parse_le<uint64_t>()(input.first(7));
+  ASSERT_FALSE(short_input);
+  EXPECT_EQ(short_input.error, "Error: expected 8 bytes but saw 7");
+}
+
+TEST(BinaryTest, Varints) {
+  auto uleb = [](std::initializer_list<int> values) {
+    auto bytes = bytes_of(values);
+    auto result = parse_uleb128()(ByteSpan(bytes));
+    return result ? std::optional<uint64_t>(result.value()) : std::nullopt;
+  };
+  EXPECT_EQ(uleb({0x00}), 0);
+  EXPECT_EQ(uleb({0x7f}), 127);
+  EXPECT_EQ(uleb({0xe5, 0x8e, 0x26}), 624485);
+  EXPECT_EQ(uleb({0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x01}),
+            std::numeric_limits<uint64_t>::max());
+  EXPECT_EQ(uleb({0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x02}),
+            std::nullopt);
+  EXPECT_EQ(uleb({0xe5, 0x8e}), std::nullopt);
+
+  auto sleb = [](std::initializer_list<int> values) {
+    auto bytes = bytes_of(values);
+    auto result = parse_sleb128()(ByteSpan(bytes));
+    return result ? std::optional<int64_t>(result.value()) : std::nullopt;
+  };
+  EXPECT_EQ(sleb({0x02}), 2);
+  EXPECT_EQ(sleb({0x7e}), -2);
+  EXPECT_EQ(sleb({0xc0, 0xbb, 0x78}), -123456);
+  EXPECT_EQ(sleb({0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x7f}),
+            std::numeric_limits<int64_t>::min());
+  EXPECT_EQ(sleb({0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00}),
+            std::numeric_limits<int64_t>::max());
+  EXPECT_EQ(sleb({0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x01}),
+            std::nullopt);
+
+  auto small = bytes_of({0x80, 0x02});
+  EXPECT_FALSE(parse_uleb128<uint8_t>()(ByteSpan(small)));
+  auto fits = bytes_of({0xff, 0x01});
+  EXPECT_EQ(parse_uleb128<uint8_t>()(ByteSpan(fits)).value(), 255);
+}
+
+TEST(BinaryTest, Frames) {
+  // A message is a big endian length, then a type byte, padding to 4
+  // bytes from the start of the message, and a varint per remaining entry.
+  auto bytes = bytes_of({0x00, 0x07, 0x2a, 0x00, 0x01, 0xe5, 0x8e, 0x26, 0x7f,
+                         0x00, 0x02, 0x68, 0x69});
+  ByteSpan buffer(bytes);
+  auto body = parse_le<uint8_t>()
+                  .skip(parse_align(4))
+                  .and_then(parse_some(parse_uleb128()));
+  auto message = parse_framed(parse_be<uint16_t>(), body);
+  auto result = message(buffer);
+  ASSERT_TRUE(result) << result.error;
+  EXPECT_THAT(result.value(), ElementsAre(1, 624485, 127));
+
+  // The same grammar reads a message in another buffer.
+  auto other = bytes_of({0x00, 0x04, 0x2a, 0x00, 0x05, 0x06});
+  EXPECT_THAT(message(ByteSpan(other)).value(), ElementsAre(5, 6));
+  EXPECT_EQ(parse_align(4)(ByteSpan(other)).error,
+            "Error: parse_align outside a frame");
+
+  // Unframed messages align from a given start, and reject input elsewhere.
+  auto unframed = parse_le<uint8_t>().skip(parse_align(buffer, 4));
+  EXPECT_EQ(unframed(buffer.subspan(2)).input.data(), bytes.data() + 4);
+  EXPECT_EQ(unframed(ByteSpan(other)).error,
+            "Error: input outside the message");
+
+  auto name = parse_length_prefixed(parse_be<uint16_t>());
+  auto rest = name(result.input);
+  ASSERT_TRUE(rest);
+  ASSERT_EQ(rest.value().size(), 2);
+  EXPECT_EQ(rest.value().data(), bytes.data() + 11);
+  EXPECT_TRUE(rest.input.empty());
+
+  auto truncated = name(buffer.first(8));
+  ASSERT_FALSE(truncated);
+  EXPECT_EQ(truncated.error, "Error: frame of 7 bytes but only 6 left");
+  auto partial = parse_framed(parse_be<uint16_t>(), parse_le<uint8_t>());
+  EXPECT_EQ(partial(buffer).error, "Error: 6 unread bytes in frame");
+}
+
+namespace {
+std::vector<std::pair<TokenKind, std::string_view>> kinds_and_text(
+    const std::vector<Token>& tokens) {
+  std::vector<std::pair<TokenKind, std::string_view>> result;
+  for (const auto& token : tokens) {
+    result.emplace_back(token.kind, token.text);
+  }
+  return result;
+}
+}  // namespace
+
+TEST(ParallelTest, ForkJoinPool) {
+  ForkJoinPool pool(3);
+  std::vector<size_t> squares(100);
+  pool.run(squares.size(), [&](size_t i) { squares[i] = i * i; });
+  EXPECT_EQ(squares[99], 99 * 99);
+
+  // Nested runs queue onto the same workers.
+  std::atomic<size_t> total = 0;
+  pool.run(8, [&](size_t) { pool.run(8, [&](size_t j) { total += j; }); });
+  EXPECT_EQ(total, 8 * 28);
+
+  EXPECT_THROW(pool.run(4,
+                        [](size_t i) {
+                          if (i == 2) {
+                            throw std::runtime_error("task failed");
+                          }
+                        }),
+               std::runtime_error);
+
+  // A caller whose last task was stolen sleeps rather than spinning until
+  // it finishes.
+  ForkJoinPool single(1);
+  std::atomic<bool> stolen = false;
+  auto cpu_time = [] {
+    timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return std::chrono::seconds(now.tv_sec) +
+           std::chrono::nanoseconds(now.tv_nsec);
+  };
+  auto before = cpu_time();
+  single.run(2, [&](size_t i) {
+    if (i == 0) {
+      while (!stolen) {
+        std::this_thread::yield();
+      }
+    } else {
+      stolen = true;
+      std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    }
+  });
+  EXPECT_LT(cpu_time() - before, std::chrono::milliseconds(100));
+}
+
+TEST(ParallelTest, ParseParallel) {
+  ForkJoinPool pool(3);
+  std::string input;
+  for (int i = 0; i < 1000; ++i) {
+    input += fmt::format("{}\n", i);
+  }
+
+  auto split = split_after('\n', 64);
+  auto pieces = split(input);
+  EXPECT_GT(pieces.size(), 1);
+  std::string joined;
+  for (auto piece : pieces) {
+    EXPECT_EQ(piece.back(), '\n');
+    joined += piece;
+  }
+  EXPECT_EQ(joined, input);
+
+  auto line = parse_int<int>().skip(parse_literal('\n'));
+  auto sums = parse_parallel(parse_fold(line, 0, std::plus<>()), split, &pool);
+  auto result = sums(input);
+  ASSERT_TRUE(result);
+  EXPECT_TRUE(result.input.empty());
+  EXPECT_EQ(result.value().size(), pieces.size());
+  EXPECT_EQ(
+      std::accumulate(result.value().begin(), result.value().end(), 0),
+      499500);
+
+  // A piece that doesn't parse to its end fails the whole parse.
+  std::string bad = input;
+  bad.replace(bad.find("\n250\n"), 5, "\n2x0\n");
+  auto failed = sums(bad);
+  ASSERT_FALSE(failed);
+  EXPECT_EQ(failed.input.substr(0, 4), "2x0\n");
+  EXPECT_TRUE(recognize(sums, input));
+  EXPECT_EQ(recognize(sums, bad).input, failed.input);
+
+  // Recovered errors and deferred actions from the pieces join those of
+  // the enclosing parse in input order.
+  bad.replace(bad.find("\n900\n"), 5, "\n9?0\n");
+  auto entry =
+      recover_to(line.transform_deferred([](int value) { return value; }),
+                 parse_literal('\n'));
+  auto entries = parse_parallel(parse_some(entry), split, &pool);
+  RecoveryScope scope(bad);
+  ActionStats stats;
+  auto recovered = parse_with_actions(entries, bad, &stats);
+  ASSERT_TRUE(recovered);
+  ASSERT_EQ(scope.diagnostics().size(), 2);
+  EXPECT_EQ(scope.diagnostics()[0].line, 251);
+  EXPECT_EQ(scope.diagnostics()[1].line, 901);
+  EXPECT_EQ(stats.recorded, 998);
+  EXPECT_EQ(recovered.value().back().back()->get(), 999);
+}
+
+TEST(ParallelTest, DelimitedByParallel) {
+  ForkJoinPool pool(3);
+  // Quoted strings full of commas, in pieces small enough that most cuts
+  // fall inside one.
+  auto quote = parse_literal('"');
+  auto string = parse_span(quote.and_then(parse_until('"')).skip(quote));
+  auto item = string.or_else(parse_int<int>().as(std::string_view("int")));
+  auto sequential =
+      parse_delimited_by(item, parse_literal(','), parse_literal(']'));
+  auto parallel =
+      parse_delimited_by_parallel(item, ',', parse_literal(']'), 16, &pool);
+
+  std::string input;
+  for (int i = 0; i < 500; ++i) {
+    input += i % 3 == 0 ? fmt::format("{},", i)
+                        : fmt::format("\"{},{},,{}\",", i, i + 1, i + 2);
+  }
+  input += "\"last\"]rest";
+  auto expected = sequential(input);
+  auto result = parallel(input);
+  ASSERT_TRUE(expected);
+  ASSERT_TRUE(result);
+  EXPECT_EQ(result.input, "]rest");
+  ASSERT_EQ(result.value().size(), expected.value().size());
+  for (size_t i = 0; i < result.value().size(); ++i) {
+    EXPECT_EQ(result.value()[i], expected.value()[i]) << i;
+  }
+  EXPECT_TRUE(recognize(parallel, input));
+
+  // Errors are the same too, wherever they are.
+  for (const std::string& bad : std::vector<std::string>{
+           input.substr(0, input.size() - 5), "1,2,x]",
+           input.substr(0, 1000) + "\"open," + input.substr(1000), ""}) {
+    auto expected_error = sequential(bad);
+    auto error = parallel(bad);
+    EXPECT_EQ(bool(error), bool(expected_error));
+    EXPECT_EQ(error.input, expected_error.input);
+    EXPECT_EQ(error.error.message(), expected_error.error.message());
+    EXPECT_EQ(recognize(parallel, bad).input, expected_error.input);
+  }
+}
+
+TEST(ParallelTest, LinesParallel) {
+  ForkJoinPool pool(3);
+  std::string input;
+  for (int i = 0; i < 1000; ++i) {
+    input += fmt::format("{}\n", i);
+  }
+  auto lines = parse_lines_parallel(parse_int<int>(), 64, &pool);
+  auto result = lines(input);
+  ASSERT_TRUE(result);
+  EXPECT_TRUE(result.input.empty());
+  ASSERT_EQ(result.value().size(), 1000);
+  EXPECT_EQ(result.value()[999], 999);
+  EXPECT_TRUE(std::ranges::is_sorted(result.value()));
+  EXPECT_TRUE(recognize(lines, input));
+
+  // The last line needs no newline, and every line must be parsed whole.
+  EXPECT_EQ(lines("1\n2").value().size(), 2);
+  std::string bad = input;
+  bad.replace(bad.find("\n500\n"), 5, "\n5x0\n");
+  auto failed = lines(bad);
+  ASSERT_FALSE(failed);
+  EXPECT_EQ(failed.input, "x0");
+  EXPECT_EQ(failed.input.data(), bad.data() + bad.find("x0\n"));
+  EXPECT_EQ(failed.error.message(), "Error: line not parsed to its end");
+}
+
+TEST(JsonTest, Values) {
+  auto text = json::parse_text();
+  auto result = text(R"(
+    {"name": "Fred", "age": 99, "height": -1.5e2, "tags": ["a", "b"],
+     "empty": {}, "none": [], "ok": true, "no": false, "nothing": null}
+  )");
+  ASSERT_TRUE(result) << result.error;
+  const json::Value& value = result.value();
+  ASSERT_TRUE(value.is<json::Object>());
+  EXPECT_EQ(value.as<json::Object>().size(), 9);
+  EXPECT_EQ(value.find("name")->as<std::string>(), "Fred");
+  EXPECT_EQ(value.find("age")->as<double>(), 99);
+  EXPECT_EQ(value.find("height")->as<double>(), -150);
+  EXPECT_EQ(value.find("tags")->as<json::Array>()[1].as<std::string>(), "b");
+  EXPECT_TRUE(value.find("empty")->as<json::Object>().empty());
+  EXPECT_TRUE(value.find("none")->as<json::Array>().empty());
+  EXPECT_TRUE(value.find("ok")->as<bool>());
+  EXPECT_TRUE(value.find("nothing")->is<std::nullptr_t>());
+  EXPECT_EQ(value.find("missing"), nullptr);
+
+  // Written back out compactly, in document order, and read again.
+  std::ostringstream out;
+  out << value;
+  EXPECT_EQ(out.str(),
+            R"({"name":"Fred","age":99,"height":-150,"tags":["a","b"],)"
+            R"("empty":{},"none":[],"ok":true,"no":false,"nothing":null})");
+  EXPECT_EQ(text(out.str()).value(), value);
+
+  // Any value is a text, and numbers follow the RFC grammar.
+  EXPECT_EQ(text(" 12 ").value().as<double>(), 12);
+  EXPECT_EQ(text("0.25e1").value().as<double>(), 2.5);
+  EXPECT_EQ(text("1e-400").value().as<double>(), 0);
+  for (std::string_view bad : {"01", "1.", ".5", "+1", "1e", "-", "1e400"}) {
+    EXPECT_FALSE(text(bad)) << bad;
+  }
+
+  // Deep nesting is fine.
+  std::string deep = std::string(20000, '[') + std::string(20000, ']');
+  EXPECT_TRUE(text(deep));
+}
+
+TEST(JsonTest, Strings) {
+  auto string = json::parse_string();
+  EXPECT_EQ(string(R"("plain")").value(), "plain");
+  EXPECT_EQ(string(R"("a\"b\\c\/d\b\f\n\r\t")").value(),
+            "a\"b\\c/d\b\f\n\r\t");
+  // \u escapes are encoded as UTF-8 of one, two and three bytes.
+  EXPECT_EQ(string(R"("\u0041\u00e9\u20AC")").value(),
+            "A\xc3\xa9\xe2\x82\xac");
+  // A surrogate pair is one char; a lone surrogate becomes U+FFFD.
+  EXPECT_EQ(string(R"("\ud83d\ude00")").value(), "\xf0\x9f\x98\x80");
+  EXPECT_EQ(string(R"("\ud83dx")").value(), "\xef\xbf\xbdx");
+  EXPECT_EQ(string(R"("\ude00\ud83d\u0041")").value(),
+            "\xef\xbf\xbd\xef\xbf\xbd" "A");
+  // UTF-8 text passes through unchanged.
+  EXPECT_EQ(string("\"caf\xc3\xa9 long enough to scan by words\"").value(),
+            "caf\xc3\xa9 long enough to scan by words");
+
+  std::string_view bad = "\"tab\there\"";
+  auto control = string(bad);
+  ASSERT_FALSE(control);
+  EXPECT_EQ(control.input.data(), bad.data() + 4);
+  EXPECT_FALSE(string(R"("\x")"));
+  EXPECT_FALSE(string(R"("\u12G4")"));
+  EXPECT_FALSE(string(R"("open)"));
+
+  std::ostringstream out;
+  out << json::Value{.data = std::string("q\"\\\n\x01")};
+  EXPECT_EQ(out.str(), R"("q\"\\\n\u0001")");
+}
+
+TEST(JsonTest, Errors) {
+  auto text = json::parse_text();
+  for (std::string_view bad :
+       {R"({"a": 1,})", R"([1 2])", R"({"a" 1})", R"({a: 1})", "[1, x]",
+        "[1, \"x\ny\"]", "tru", "", "[] []"}) {
+    auto result = text(bad);
+    EXPECT_FALSE(result) << bad;
+    // recognize fails the same way without building anything.
+    auto recognized = recognize(text, bad);
+    EXPECT_FALSE(recognized) << bad;
+    EXPECT_EQ(recognized.input, result.input) << bad;
+    EXPECT_EQ(recognized.error.message(), result.error.message()) << bad;
+  }
+  auto missing = text("[1, x]");
+  EXPECT_EQ(missing.input, "x]");
+  EXPECT_EQ(missing.error.message(), "Error: expected value but saw x");
+
+  // Records a line each, as in JSON lines logs.
+  auto records = parse_lines_parallel(json::parse_text(), 16);
+  auto lines = records("{\"n\": 1}\n[2, \"a,b\"]\n\"three\"\n");
+  ASSERT_TRUE(lines);
+  ASSERT_EQ(lines.value().size(), 3);
+  EXPECT_EQ(lines.value()[2].as<std::string>(), "three");
+}
+
+TEST(LexerTest, Css) {
+  using enum TokenKind;
+  auto tokens = tokenize_css(R"(
+.a, #id { /* note */
+        height: 20px; width: -50%;
+        color: #fff; margin: .5em 1e3 -x;
+        content: "a \"b\" c"; }
+)");
+  EXPECT_THAT(
+      kinds_and_text(tokens),
+      ElementsAre(
+          std::pair(kPunct, "."), std::pair(kIdent, "a"),
+          std::pair(kPunct, ","), std::pair(kHash, "#id"),
+          std::pair(kPunct, "{"), std::pair(kIdent, "height"),
+          std::pair(kPunct, ":"), std::pair(kDimension, "20px"),
+          std::pair(kPunct, ";"), std::pair(kIdent, "width"),
+          std::pair(kPunct, ":"), std::pair(kPercentage, "-50%"),
+          std::pair(kPunct, ";"), std::pair(kIdent, "color"),
+          std::pair(kPunct, ":"), std::pair(kHash, "#fff"),
+          std::pair(kPunct, ";"), std::pair(kIdent, "margin"),
+          std::pair(kPunct, ":"), std::pair(kDimension, ".5em"),
+          std::pair(kNumber, "1e3"), std::pair(kIdent, "-x"),
+          std::pair(kPunct, ";"), std::pair(kIdent, "content"),
+          std::pair(kPunct, ":"), std::pair(kString, R"("a \"b\" c")"),
+          std::pair(kPunct, ";"), std::pair(kPunct, "}")));
+
+  EXPECT_THAT(kinds_and_text(tokenize_css("a /* open")),
+              ElementsAre(std::pair(kIdent, "a"),
+                          std::pair(kError, "/* open")));
+  EXPECT_THAT(kinds_and_text(tokenize_css("'abc")),
+              ElementsAre(std::pair(kError, "'abc")));
+}
+
+TEST(LexerTest, Json) {
+  using enum TokenKind;
+  auto tokens = tokenize_json(
+      R"({"key": [0, -2.5e3, true, null], )"
+      R"("long string with \"escapes\" \u00e9": 10})");
+  EXPECT_THAT(
+      kinds_and_text(tokens),
+      ElementsAre(std::pair(kPunct, "{"), std::pair(kString, R"("key")"),
+                  std::pair(kPunct, ":"), std::pair(kPunct, "["),
+                  std::pair(kNumber, "0"), std::pair(kPunct, ","),
+                  std::pair(kNumber, "-2.5e3"), std::pair(kPunct, ","),
+                  std::pair(kIdent, "true"), std::pair(kPunct, ","),
+                  std::pair(kIdent, "null"), std::pair(kPunct, "]"),
+                  std::pair(kPunct, ","),
+                  std::pair(kString,
+                            R"("long string with \"escapes\" \u00e9")"),
+                  std::pair(kPunct, ":"), std::pair(kNumber, "10"),
+                  std::pair(kPunct, "}")));
+
+  for (std::string_view bad :
+       {"01", "-", "1.", "1e", "\"abc", "\"a\\x\"", "\"\\u12\"", "\"a\tb\"",
+        "@"}) {
+    auto bad_tokens = tokenize_json(bad);
+    ASSERT_FALSE(bad_tokens.empty()) << bad;
+    EXPECT_EQ(bad_tokens.front().kind, kError) << bad;
+  }
+}
+
+TEST(LexerTest, TokenParsers) {
+  // Sums the numbers in nested arrays, using the same combinators as char
+  // grammars.
+  auto number = parse_token(TokenKind::kNumber).transform([](Token token) {
+    return std::stod(std::string(token.text));
+  });
+  auto punct = [](std::string_view text) {
+    return parse_token(TokenKind::kPunct, text);
+  };
+  auto sum = parse_recursive<double, TokenSpan>(
+      [=](const TokenParser<double>& value) {
+        auto items =
+            parse_delimited_by(parse_ref(value), punct(","), punct("]"));
+        auto list = punct("[").and_then(
+            items.transform([](const std::vector<double>& values) {
+              double total = 0;
+              for (double v : values) {
+                total += v;
+              }
+              return total;
+            }));
+        list = list.skip(punct("]"));
+        auto empty = punct("[").and_then(punct("]")).as(0.0);
+        return number.or_else(empty).or_else(list);
+      });
+  auto document = sum.skip(parse_end<TokenSpan>());
+
+  auto tokens = tokenize_json("[1, [2, 3], [], [[4.5]]]");
+  auto result = document(tokens);
+  ASSERT_TRUE(result) << result.error;
+  EXPECT_EQ(result.value(), 10.5);
+  EXPECT_TRUE(result.input.empty());
+
+  tokens = tokenize_json("[1, [2, 3]");
+  result = document(tokens);
+  ASSERT_FALSE(result);
+  EXPECT_THAT(result.error, ::testing::HasSubstr("end of input"));
+
+  // Folds, counts and lookahead work over tokens too.
+  tokens = tokenize_css("a b c ;");
+  auto idents = parse_count(parse_token(TokenKind::kIdent));
+  auto counted = idents.skip(parse_peek(parse_token(TokenKind::kPunct)));
+  auto count = counted(tokens);
+  ASSERT_TRUE(count);
+  EXPECT_EQ(count.value(), 3);
+  EXPECT_EQ(count.input.size(), 1);
+}
+
+TEST(PegTest, NodeStore) {
+  using namespace peg;
+  auto ws = [] { return star(choice({space(), seq({lit("/*"), any()})})); };
+  EXPECT_EQ(ws().ptr(), ws().ptr());
+  EXPECT_EQ(seq({ws(), lit('a'), ws()}).node().children[0],
+            seq({ws(), lit('a'), ws()}).node().children[2]);
+  EXPECT_NE(lit('a').ptr(), lit('b').ptr());
+  EXPECT_NE(capture(1, lit('a')).ptr(), capture(2, lit('a')).ptr());
+
+  // Shared subpatterns compile to one DFA.
+  auto name = seq({alpha(), star(alnum())});
+  auto program = Program::compile(seq({name, lit(':'), not_(digit()), name}));
+  EXPECT_TRUE(program.match("a1:b2"));
+  std::vector<int32_t> dfas;
+  for (const auto& instruction : program.code()) {
+    if (instruction.op == Opcode::kDfa) {
+      dfas.push_back(instruction.arg);
+    }
+  }
+  EXPECT_THAT(dfas, ElementsAre(0, 0));
+}
+
+TEST(PegTest, Primitives) {
+  using namespace peg;
+  auto program = Program::compile(
+      seq({lit("ab"), star(lit('c')), choice({lit('d'), range('0', '9')}),
+           opt(lit('!'))}));
+  EXPECT_EQ(program.match("abd").end, 3);
+  EXPECT_EQ(program.match("abcccd!x").end, 7);
+  EXPECT_EQ(program.match("ab7").end, 3);
+  EXPECT_FALSE(program.match("abx"));
+  EXPECT_FALSE(program.match("a"));
+
+  auto lookahead = Program::compile(seq({and_(lit("ab")), lit('a')}));
+  EXPECT_EQ(lookahead.match("ab").end, 1);
+  EXPECT_FALSE(lookahead.match("ac"));
+
+  auto negative = Program::compile(plus(seq({!lit("*/"), any()})));
+  EXPECT_EQ(negative.match("abc*/").end, 3);
+  EXPECT_FALSE(negative.match("*/"));
+}
+
+TEST(PegTest, Captures) {
+  using namespace peg;
+  auto name = capture(1, plus(alpha()));
+  auto program = Program::compile(
+      seq({name, star(seq({lit(','), name})), capture(2, opt(lit(';')))}));
+  auto match = program.match("ab,cd,e;");
+  ASSERT_TRUE(match);
+  ASSERT_EQ(match.captures.size(), 4);
+  EXPECT_EQ(match.captures[0].text, "ab");
+  EXPECT_EQ(match.captures[2].text, "e");
+  EXPECT_EQ(match.captures[3].id, 2);
+  EXPECT_EQ(match.captures[3].text, ";");
+
+  // Captures from abandoned alternatives are dropped.
+  auto alternatives = Program::compile(choice(
+      {seq({capture(1, lit('a')), lit('x')}), capture(2, lit("ab"))}));
+  match = alternatives.match("ab");
+  ASSERT_TRUE(match);
+  ASSERT_EQ(match.captures.size(), 1);
+  EXPECT_EQ(match.captures[0].id, 2);
+}
+
+TEST(PegTest, RecursiveRules) {
+  using namespace peg;
+  Grammar grammar;
+  grammar.define("list", seq({lit('['), opt(ref("items")), lit(']')}))
+      .define("items", seq({ref("value"), star(seq({lit(','), ref("value")}))}))
+      .define("value", choice({plus(digit()), ref("list")}));
+  auto program = Program::compile(grammar);
+  EXPECT_TRUE(program.match("[1,[2,3],[],[[4]]]"));
+  EXPECT_FALSE(program.match("[1,2"));
+
+  // Nesting far deeper than the native stack allows.
+  size_t depth = 200000;
+  std::string deep = std::string(depth, '[') + std::string(depth, ']');
+  auto match = program.match(deep);
+  ASSERT_TRUE(match);
+  EXPECT_EQ(match.end, deep.size());
+
+  program.set_max_stack(1000);
+  match = program.match(deep);
+  EXPECT_FALSE(match);
+  EXPECT_THAT(match.error, ::testing::HasSubstr("stack limit"));
+}
+
+TEST(PegTest, Dfa) {
+  using namespace peg;
+  auto identifier = seq({choice({any_of("_.#"), alpha()}),
+                         choice({plus(alnum()), lit('-')})});
+  auto dfa = Dfa::compile(identifier);
+  ASSERT_TRUE(dfa);
+  EXPECT_EQ(dfa->match("abc1 x"), 4);
+  EXPECT_EQ(dfa->match("_-x"), 2);
+  EXPECT_EQ(dfa->match("-"), std::nullopt);
+  size_t stop = 0;
+  EXPECT_EQ(dfa->match("#", &stop), std::nullopt);
+  EXPECT_EQ(stop, 1);
+
+  // The same language written with combinators, on every short string over
+  // an alphabet that exercises each transition.
+  auto combinators =
+      parse_sequence({parse_any_of("_.#").or_else(parse_alpha()),
+                      parse_n(parse_alnum(), 1).or_else(parse_any_of("-"))});
+  auto compiled = to_parser(std::make_shared<const Dfa>(*dfa));
+  std::vector<std::string> inputs = {""};
+  for (size_t i = 0; i < inputs.size() && inputs[i].size() < 4; ++i) {
+    for (char ch : std::string_view("a1-_#x ")) {
+      inputs.push_back(inputs[i] + ch);
+    }
+  }
+  for (const auto& input : inputs) {
+    auto expected = combinators(input);
+    auto actual = compiled(input);
+    ASSERT_EQ(expected.has_value(), actual.has_value()) << input;
+    if (expected) {
+      EXPECT_EQ(expected.value(), actual.value()) << input;
+    }
+  }
+
+  // Patterns where ordered choice or greediness differ from longest match.
+  EXPECT_FALSE(Dfa::compile(choice({lit('a'), lit("ab")})));
+  EXPECT_FALSE(Dfa::compile(seq({star(lit('a')), lit('a')})));
+  EXPECT_FALSE(Dfa::compile(choice({opt(lit('a')), lit('b')})));
+  EXPECT_FALSE(Dfa::compile(seq({choice({lit('a'), lit("")}), lit('a')})));
+  // Patterns that aren't regular.
+  EXPECT_FALSE(Dfa::compile(capture(1, lit('a'))));
+  EXPECT_FALSE(Dfa::compile(not_(lit('a'))));
+  EXPECT_FALSE(Dfa::compile(ref("a")));
+  EXPECT_FALSE(Dfa::compile(plus(alpha()), 1));
+
+  // The VM runs such parts of a grammar as one instruction.
+  auto program = Program::compile(seq({capture(1, identifier), lit(';')}));
+  EXPECT_THAT(program.disassemble(), ::testing::HasSubstr("dfa"));
+  auto match = program.match("ab1;");
+  ASSERT_TRUE(match);
+  EXPECT_EQ(match.captures[0].text, "ab1");
+  EXPECT_FALSE(program.match("ab1 ;"));
+  EXPECT_EQ(program.match("ab1 ;").end, 3);
+}
+
+TEST(PegTest, InvalidGrammars) {
+  using namespace peg;
+  EXPECT_THROW(Program::compile(ref("missing")), std::invalid_argument);
+  EXPECT_THROW(Program::compile(star(opt(lit('a')))), std::invalid_argument);
+  EXPECT_THROW(Program::compile(Grammar()), std::invalid_argument);
+}
+
+TEST(PegTest, StyleSheet) {
+  using namespace peg;
+  auto program = std::make_shared<Program>(Program::compile(css_grammar()));
+
+  auto captures = to_capture_parser(program)(R"(
+.otherthing {
+    height: 20px;
+    color: rgb(156, 39, 188);
+}
+
+.something {
+    padding: 10px 2px;
+}
+)");
+  ASSERT_TRUE(captures);
+  auto& caps = captures.value();
+  ASSERT_EQ(caps.size(), 8);
+  EXPECT_EQ(caps[0].text, ".otherthing");
+  EXPECT_EQ(caps[3].text, "color");
+  EXPECT_EQ(caps[4].text, "rgb(156, 39, 188)");
+  EXPECT_EQ(caps[5].id, 1);
+  EXPECT_EQ(caps[5].text, ".something");
+  EXPECT_EQ(caps[7].text, "10px 2px");
+
+  // Programs combine with ordinary parsers.
+  auto parser = parse_literal('<').and_then(to_parser(program));
+  EXPECT_TRUE(parser("<a { b: c; }"));
+  EXPECT_FALSE(parser("<a { b: c; "));
+}
+
+TEST(PegTest, Dump) {
+  using namespace peg;
+  EXPECT_EQ(dump(seq({lit('a'), lit("b\"c"), range('0', '9'), any()})),
+            R"('a' "b\"c" [0-9] .)");
+  EXPECT_EQ(dump(star(choice({lit("ab"), seq({none_of("]\n"), ref("x")})}))),
+            R"(("ab" / [^\n\]] x)*)");
+  EXPECT_EQ(dump(opt(not_(capture(2, plus(space()))))), "(!{2: [\\t-\\r ]+})?");
+  EXPECT_EQ(dump(Grammar().define("a", ref("b")).define("b", lit('x'))),
+            "a <- b\nb <- 'x'\n");
+}
+
+TEST(PegTest, Optimizer) {
+  using namespace peg;
+  auto optimized = [](Pattern pattern) { return dump(optimize(pattern)); };
+  EXPECT_EQ(optimized(seq({lit('a'), seq({lit('b'), lit("")}), lit("cd")})),
+            R"("abcd")");
+  EXPECT_EQ(optimized(choice({lit('a'), choice({lit('b'), digit()})})),
+            "[0-9ab]");
+  EXPECT_EQ(optimized(choice({lit("abc"), lit("abd"), lit("x")})),
+            R"("ab" [cd] / 'x')");
+  EXPECT_EQ(optimized(choice({seq({ref("x"), lit('a')}),
+                              seq({ref("x"), lit('b')}), ref("x")})),
+            "x [ab]?");
+  EXPECT_EQ(optimized(seq({star(any_of(" \t")), star(lit(' ')), ref("x")})),
+            R"([\t ]* x)");
+  EXPECT_EQ(optimized(choice({opt(plus(ref("x"))), ref("y")})), "x*");
+
+  Grammar grammar = optimize(css_grammar());
+  // The comment rule is small enough to inline and is then unused.
+  EXPECT_EQ(grammar.find("comment"), nullptr);
+  EXPECT_THAT(dump(grammar),
+              ::testing::HasSubstr(
+                  R"({1: [#\-.0-9A-Z_a-z]+} ([\t-\r ] / "/*")"));
+
+  auto original = Program::compile(css_grammar());
+  auto program = Program::compile(grammar);
+  std::string base = ".a { b: c; /* d */ e: f }\n#g { h: i; }";
+  std::vector<std::string> inputs = {base, "", "\xEF\xBB\xBF a { b: c }"};
+  for (size_t i = 0; i < base.size(); ++i) {
+    inputs.push_back(base.substr(0, i) + base.substr(i + 1));
+    for (char ch : std::string_view("{}:;/* x")) {
+      inputs.push_back(base);
+      inputs.back()[i] = ch;
+    }
+  }
+  for (const auto& input : inputs) {
+    Match expected = original.match(input);
+    Match actual = program.match(input);
+    ASSERT_EQ(expected.ok, actual.ok) << input;
+    if (!expected.ok) {
+      continue;
+    }
+    EXPECT_EQ(expected.end, actual.end) << input;
+    ASSERT_EQ(expected.captures.size(), actual.captures.size()) << input;
+    for (size_t i = 0; i < expected.captures.size(); ++i) {
+      EXPECT_EQ(expected.captures[i].id, actual.captures[i].id);
+      EXPECT_EQ(expected.captures[i].text.data(),
+                actual.captures[i].text.data());
+      EXPECT_EQ(expected.captures[i].text.size(),
+                actual.captures[i].text.size());
+    }
+  }
+}
+
+TEST(PegTest, GeneratedRecognizer) {
+  using namespace peg;
+  auto program = Program::compile(css_grammar());
+  auto same = [&](std::string_view input) {
+    Match expected = program.match(input);
+    css_recognizer::Match actual = css_recognizer::match(input);
+    if (expected.ok != actual.ok || expected.end != actual.end ||
+        expected.captures.size() != actual.captures.size()) {
+      return false;
+    }
+    for (size_t i = 0; i < expected.captures.size(); ++i) {
+      if (expected.captures[i].id != actual.captures[i].id ||
+          expected.captures[i].text.data() !=
+              actual.captures[i].text.data() ||
+          expected.captures[i].text.size() != actual.captures[i].text.size()) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  std::vector<std::string> inputs = {
+      "",
+      "a{}",
+      "\xEF\xBB\xBF a { b: c }",
+      ".x { /* note */ height: 20px; color: rgb(1, 2, 3); }\n",
+      ".x { height: 20px; /* unterminated }",
+      ".x { height: 20px; color }",
+      ".x { height: 20px; } .y { }",
+      ".x { height: 20px; } junk",
+      ".x { : 20px; }",
+      "/**/ #id{a:b;c:d}",
+  };
+  for (const auto& input : inputs) {
+    EXPECT_TRUE(same(input)) << input;
+  }
+
+  // Deletions and substitutions of the interesting characters explore the
+  // failure paths that the inputs above don't.
+  std::string base = ".a { b: c; /* d */ e: f }\n#g { h: i; }";
+  for (size_t i = 0; i < base.size(); ++i) {
+    std::string deleted = base;
+    deleted.erase(i, 1);
+    EXPECT_TRUE(same(deleted)) << deleted;
+    for (char ch : std::string_view("{}:;/* x")) {
+      std::string replaced = base;
+      replaced[i] = ch;
+      EXPECT_TRUE(same(replaced)) << replaced;
+    }
+  }
+
+  EXPECT_THROW(generate_cpp(Grammar().define("a", ref("b")), "x"),
+               std::invalid_argument);
+}
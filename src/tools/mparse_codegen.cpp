@@ -0,0 +1,64 @@
+//
+// Copyright 2025 John R. Burkhardt
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the “Software”), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+// Writes the generated recognizer for one of the grammars below. Run by
+// the build; see CMakeLists.txt.
+//
+//   mparse_codegen GRAMMAR NAMESPACE OUTPUT
+
+#include "../css_grammar.h"
+#include "../peg_codegen.h"
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <string>
+
+int main(int argc, char* argv[]) {
+  static const std::map<std::string, std::function<peg::Grammar()>> grammars =
+      {
+          {"css", peg::css_grammar},
+      };
+  if (argc != 4) {
+    std::cerr << "usage: mparse_codegen GRAMMAR NAMESPACE OUTPUT" << std::endl;
+    return 2;
+  }
+  auto it = grammars.find(argv[1]);
+  if (it == grammars.end()) {
+    std::cerr << "Error: unknown grammar " << argv[1] << std::endl;
+    return 2;
+  }
+  std::string source;
+  try {
+    source = peg::generate_cpp(it->second(), argv[2]);
+  } catch (const std::invalid_argument& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+  std::ofstream out(argv[3]);
+  out << source;
+  if (!out) {
+    std::cerr << "Error: can't write " << argv[3] << std::endl;
+    return 1;
+  }
+  return 0;
+}